@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "cgroup_helpers.h"
+
+int cgroup_mount_path(char *path, size_t path_sz)
+{
+	char dir[PATH_MAX], type[64];
+	int ret = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/mounts", "r");
+	if (!f)
+		return -1;
+	while (fscanf(f, "%*s %4095s %63s %*[^\n]\n", dir, type) == 2) {
+		if (!strcmp(type, "cgroup2")) {
+			snprintf(path, path_sz, "%s", dir);
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+int cgroup_id_of(const char *path, __u64 *id)
+{
+	struct stat st;
+
+	/* the id of a cgroup v2 directory is its kernfs inode number */
+	if (stat(path, &st))
+		return -1;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	*id = st.st_ino;
+	return 0;
+}
+
+int cgroup_walk(const char *path, int (*fn)(const char *path, __u64 id, void *ctx),
+		void *ctx)
+{
+	char child[PATH_MAX];
+	struct dirent *d;
+	__u64 id;
+	DIR *dir;
+	int ret;
+
+	if (cgroup_id_of(path, &id))
+		return 0;
+	ret = fn(path, id, ctx);
+	if (ret)
+		return ret;
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir))) {
+		if (d->d_type != DT_DIR || !strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (snprintf(child, sizeof(child), "%s/%s", path, d->d_name) >= sizeof(child))
+			continue;
+		ret = cgroup_walk(child, fn, ctx);
+		if (ret)
+			break;
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* Container scopes of the systemd cgroup driver */
+static const struct {
+	const char *prefix;
+	const char *runtime;
+} container_scopes[] = {
+	{ "docker-", "docker" },
+	{ "cri-containerd-", "containerd" },
+	{ "crio-", "crio" },
+	{ "libpod-", "podman" },
+};
+
+#define CONTAINER_ID_LEN 12
+
+static size_t hex_len(const char *s)
+{
+	size_t n = 0;
+
+	while (isxdigit((unsigned char)s[n]))
+		n++;
+	return n;
+}
+
+static void name_cgroup(const char *rel, char *buf, size_t buf_sz)
+{
+	const char *last, *ctr = NULL, *runtime = NULL, *pod;
+	char uid[64];
+	size_t i, n;
+
+	last = strrchr(rel, '/');
+	last = last ? last + 1 : rel;
+	for (i = 0; i < sizeof(container_scopes) / sizeof(container_scopes[0]); i++) {
+		n = strlen(container_scopes[i].prefix);
+		if (!strncmp(last, container_scopes[i].prefix, n) && hex_len(last + n) >= 64) {
+			ctr = last + n;
+			runtime = container_scopes[i].runtime;
+			break;
+		}
+	}
+	/* cgroupfs driver: the directory is the container id */
+	if (!ctr && hex_len(last) >= 64 && !last[hex_len(last)])
+		ctr = last;
+
+	/* kubepods-burstable-pod<uid>.slice or kubepods/burstable/pod<uid> */
+	pod = strstr(rel, "-pod");
+	if (!pod)
+		pod = strstr(rel, "/pod");
+	if (pod && strstr(rel, "kubepods")) {
+		pod += 4;
+		for (n = 0; n < sizeof(uid) - 1 && pod[n] && pod[n] != '.' && pod[n] != '/'; n++)
+			uid[n] = pod[n] == '_' ? '-' : pod[n];
+		uid[n] = '\0';
+		if (ctr)
+			snprintf(buf, buf_sz, "pod %s/%.*s", uid, CONTAINER_ID_LEN, ctr);
+		else
+			snprintf(buf, buf_sz, "pod %s", uid);
+	} else if (ctr) {
+		snprintf(buf, buf_sz, "%s:%.*s", runtime ?: "container", CONTAINER_ID_LEN, ctr);
+	} else {
+		snprintf(buf, buf_sz, "%s", *rel ? rel : "/");
+	}
+}
+
+struct cgroup_name {
+	__u64 id;
+	char *name;
+};
+
+struct cgroup_names {
+	struct cgroup_name *names;
+	size_t nr;
+	size_t cap;
+	size_t root_len;
+};
+
+static int add_cgroup_name(const char *path, __u64 id, void *ctx)
+{
+	struct cgroup_names *names = ctx;
+	struct cgroup_name *tmp;
+	char buf[PATH_MAX];
+
+	if (names->nr == names->cap) {
+		names->cap = names->cap ? names->cap * 2 : 256;
+		tmp = realloc(names->names, names->cap * sizeof(*names->names));
+		if (!tmp)
+			return -1;
+		names->names = tmp;
+	}
+	name_cgroup(path + names->root_len, buf, sizeof(buf));
+	names->names[names->nr].name = strdup(buf);
+	if (!names->names[names->nr].name)
+		return -1;
+	names->names[names->nr++].id = id;
+	return 0;
+}
+
+static int cgroup_name_cmp(const void *a, const void *b)
+{
+	const struct cgroup_name *x = a, *y = b;
+
+	if (x->id == y->id)
+		return 0;
+	return x->id < y->id ? -1 : 1;
+}
+
+struct cgroup_names *cgroup_names__load(void)
+{
+	struct cgroup_names *names;
+	char root[PATH_MAX];
+
+	if (cgroup_mount_path(root, sizeof(root)))
+		return NULL;
+	names = calloc(1, sizeof(*names));
+	if (!names)
+		return NULL;
+	names->root_len = strlen(root);
+	if (cgroup_walk(root, add_cgroup_name, names)) {
+		cgroup_names__free(names);
+		return NULL;
+	}
+	qsort(names->names, names->nr, sizeof(*names->names), cgroup_name_cmp);
+	return names;
+}
+
+void cgroup_names__free(struct cgroup_names *names)
+{
+	size_t i;
+
+	if (!names)
+		return;
+	for (i = 0; i < names->nr; i++)
+		free(names->names[i].name);
+	free(names->names);
+	free(names);
+}
+
+const char *cgroup_names__get(const struct cgroup_names *names, __u64 id)
+{
+	struct cgroup_name key = { .id = id }, *found;
+
+	if (!names)
+		return NULL;
+	found = bsearch(&key, names->names, names->nr, sizeof(*names->names), cgroup_name_cmp);
+	return found ? found->name : NULL;
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __CGROUP_HELPERS_H
+#define __CGROUP_HELPERS_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/* Mount point of the cgroup v2 hierarchy, e.g. /sys/fs/cgroup */
+int cgroup_mount_path(char *path, size_t path_sz);
+/* The id bpf_get_current_cgroup_id() returns for the cgroup directory path */
+int cgroup_id_of(const char *path, __u64 *id);
+/*
+ * Call fn for path and every cgroup below it, stopping at the first non-zero
+ * return, which is returned.
+ */
+int cgroup_walk(const char *path, int (*fn)(const char *path, __u64 id, void *ctx),
+		void *ctx);
+
+struct cgroup_names;
+
+/* Names of every cgroup that exists now, by id */
+struct cgroup_names *cgroup_names__load(void);
+void cgroup_names__free(struct cgroup_names *names);
+/*
+ * "pod <uid>/<container>" for Kubernetes, "<runtime>:<container>" for other
+ * containers, else the path below the mount point.  NULL if id is unknown.
+ */
+const char *cgroup_names__get(const struct cgroup_names *names, __u64 id);
+
+#endif /* __CGROUP_HELPERS_H */
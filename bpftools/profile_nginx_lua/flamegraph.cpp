@@ -0,0 +1,727 @@
+#include "flamegraph.h"
+#include <algorithm>
+#include <deque>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* Geometry and defaults follow FlameGraph's flamegraph.pl */
+#define IMAGE_WIDTH 1200
+#define FRAME_HEIGHT 16
+#define FONT_SIZE 12
+#define FONT_WIDTH 0.59
+#define MIN_WIDTH 0.1
+#define XPAD 10
+#define YPAD1 (FONT_SIZE * 3)
+#define YPAD2 (FONT_SIZE * 2 + 10)
+
+enum frame_kind
+{
+    FRAME_KIND_NATIVE,
+    FRAME_KIND_KERNEL,
+    FRAME_KIND_LUA,
+    FRAME_KIND_C,
+    FRAME_KIND_BUILTIN,
+};
+
+#define NO_NODE UINT32_MAX
+
+struct fg_node
+{
+    uint32_t name;
+    uint32_t depth;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint8_t kind;
+    unsigned long long total;
+    /* baseline samples, only used by differential graphs */
+    unsigned long long before;
+};
+
+/* Open addressing map from (parent node << 32 | name) to the child node */
+struct child_slot
+{
+    uint64_t key;
+    uint32_t node;
+};
+
+struct flamegraph
+{
+    /* interned frame names, the views point into name_storage */
+    std::deque<std::string> name_storage;
+    std::unordered_map<std::string_view, uint32_t> name_index;
+    std::vector<std::string_view> names;
+    /* the frame trie, node 0 is the "all" root */
+    std::vector<fg_node> nodes;
+    std::vector<child_slot> child_index;
+    size_t nr_children;
+    bool diff;
+};
+
+static inline size_t child_slot_of(uint64_t key, size_t mask)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & mask;
+}
+
+static void grow_child_index(struct flamegraph *fg)
+{
+    std::vector<child_slot> old;
+    old.swap(fg->child_index);
+    fg->child_index.assign(old.empty() ? 1024 : old.size() * 2, child_slot{0, NO_NODE});
+    size_t mask = fg->child_index.size() - 1;
+    for (const child_slot &slot : old)
+    {
+        if (slot.node == NO_NODE)
+        {
+            continue;
+        }
+        size_t i = child_slot_of(slot.key, mask);
+        while (fg->child_index[i].node != NO_NODE)
+        {
+            i = (i + 1) & mask;
+        }
+        fg->child_index[i] = slot;
+    }
+}
+
+/* Returns the slot for key, either holding it or empty */
+static child_slot *find_child_slot(struct flamegraph *fg, uint64_t key)
+{
+    size_t mask = fg->child_index.size() - 1;
+    size_t i = child_slot_of(key, mask);
+    while (fg->child_index[i].node != NO_NODE && fg->child_index[i].key != key)
+    {
+        i = (i + 1) & mask;
+    }
+    return &fg->child_index[i];
+}
+
+static uint32_t intern_name(struct flamegraph *fg, std::string_view name)
+{
+    auto it = fg->name_index.find(name);
+    if (it != fg->name_index.end())
+    {
+        return it->second;
+    }
+    fg->name_storage.emplace_back(name);
+    std::string_view stored = fg->name_storage.back();
+    uint32_t id = fg->names.size();
+    fg->names.push_back(stored);
+    fg->name_index.emplace(stored, id);
+    return id;
+}
+
+static uint8_t classify_frame(std::string_view name, bool kernel)
+{
+    if (kernel)
+    {
+        return FRAME_KIND_KERNEL;
+    }
+    if (name.compare(0, 2, "L:") == 0)
+    {
+        return FRAME_KIND_LUA;
+    }
+    if (name.compare(0, 2, "C:") == 0 || name.compare(0, 4, "FFI:") == 0)
+    {
+        return FRAME_KIND_C;
+    }
+    if (name.compare(0, 8, "builtin#") == 0)
+    {
+        return FRAME_KIND_BUILTIN;
+    }
+    return FRAME_KIND_NATIVE;
+}
+
+struct flamegraph *flamegraph__new(void)
+{
+    struct flamegraph *fg = new flamegraph;
+    fg_node root = {};
+    root.name = intern_name(fg, "all");
+    root.first_child = NO_NODE;
+    root.next_sibling = NO_NODE;
+    fg->nodes.push_back(root);
+    fg->nr_children = 0;
+    grow_child_index(fg);
+    return fg;
+}
+
+void flamegraph__free(struct flamegraph *fg)
+{
+    delete fg;
+}
+
+static int add_stack(struct flamegraph *fg, const char *const *frames, int nr_frames,
+                     int first_kernel, unsigned long long before, unsigned long long count)
+{
+    uint32_t cur = 0;
+
+    if (!fg || nr_frames < 0)
+    {
+        return -1;
+    }
+    fg->nodes[0].total += count;
+    fg->nodes[0].before += before;
+    for (int i = 0; i < nr_frames; i++)
+    {
+        std::string_view frame(frames[i]);
+        uint32_t name = intern_name(fg, frame);
+        uint64_t key = (uint64_t)cur << 32 | name;
+        child_slot *slot = find_child_slot(fg, key);
+        uint32_t child = slot->node;
+        if (child == NO_NODE)
+        {
+            fg_node node = {};
+            node.name = name;
+            node.depth = fg->nodes[cur].depth + 1;
+            node.kind = classify_frame(frame, i >= first_kernel);
+            node.first_child = NO_NODE;
+            node.next_sibling = fg->nodes[cur].first_child;
+            child = fg->nodes.size();
+            fg->nodes.push_back(node);
+            fg->nodes[cur].first_child = child;
+            slot->key = key;
+            slot->node = child;
+            /* keep the load factor under one half */
+            if (++fg->nr_children * 2 > fg->child_index.size())
+            {
+                grow_child_index(fg);
+            }
+        }
+        fg->nodes[child].total += count;
+        fg->nodes[child].before += before;
+        cur = child;
+    }
+    return 0;
+}
+
+int flamegraph__add_stack(struct flamegraph *fg, const char *const *frames, int nr_frames,
+                          int first_kernel, unsigned long long count)
+{
+    return add_stack(fg, frames, nr_frames, first_kernel, 0, count);
+}
+
+int flamegraph__add_diff_stack(struct flamegraph *fg, const char *const *frames, int nr_frames,
+                               unsigned long long before, unsigned long long after)
+{
+    if (!fg)
+    {
+        return -1;
+    }
+    fg->diff = true;
+    return add_stack(fg, frames, nr_frames, nr_frames, before, after);
+}
+
+unsigned long long flamegraph__total(const struct flamegraph *fg)
+{
+    return fg ? fg->nodes[0].total : 0;
+}
+
+static uint32_t name_hash(std::string_view name)
+{
+    uint32_t h = 2166136261u;
+    for (char c : name)
+    {
+        h = (h ^ (uint8_t)c) * 16777619u;
+    }
+    return h;
+}
+
+/* Palettes per frame kind, varied per name so adjacent frames differ */
+static void frame_color(std::string_view name, uint8_t kind, int *r, int *g, int *b)
+{
+    uint32_t h = name_hash(name);
+    double v1 = (h & 0xff) / 255.0, v2 = ((h >> 8) & 0xff) / 255.0, v3 = ((h >> 16) & 0xff) / 255.0;
+
+    switch (kind)
+    {
+    case FRAME_KIND_KERNEL:
+        *r = 200 + (int)(55 * v3);
+        *g = 100 + (int)(60 * v3);
+        *b = 0;
+        break;
+    case FRAME_KIND_LUA:
+        *r = 50 + (int)(60 * v3);
+        *g = 200 + (int)(55 * v1);
+        *b = 50 + (int)(60 * v3);
+        break;
+    case FRAME_KIND_C:
+        *r = 175 + (int)(55 * v3);
+        *g = 175 + (int)(55 * v3);
+        *b = 50 + (int)(20 * v1);
+        break;
+    case FRAME_KIND_BUILTIN:
+        *r = 50 + (int)(60 * v3);
+        *g = 165 + (int)(55 * v3);
+        *b = 165 + (int)(55 * v3);
+        break;
+    default:
+        *r = 205 + (int)(50 * v3);
+        *g = (int)(230 * v1);
+        *b = (int)(55 * v2);
+        break;
+    }
+}
+
+/*
+ * Differential colouring as in flamegraph.pl: red where a frame gained
+ * samples, blue where it lost, white when unchanged.
+ */
+static void diff_color(const fg_node &node, double max_delta, int *r, int *g, int *b)
+{
+    double delta = (double)node.total - (double)node.before;
+    int fade = max_delta > 0 ? (int)(210 * (max_delta - (delta < 0 ? -delta : delta)) / max_delta) : 210;
+
+    if (delta > 0)
+    {
+        *r = 255;
+        *g = *b = fade;
+    }
+    else if (delta < 0)
+    {
+        *b = 255;
+        *r = *g = fade;
+    }
+    else
+    {
+        *r = *g = *b = 250;
+    }
+}
+
+static void write_escaped(FILE *out, std::string_view s)
+{
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '&':
+            fputs("&amp;", out);
+            break;
+        case '<':
+            fputs("&lt;", out);
+            break;
+        case '>':
+            fputs("&gt;", out);
+            break;
+        case '"':
+            fputs("&quot;", out);
+            break;
+        default:
+            fputc(c, out);
+        }
+    }
+}
+
+static const char svg_script[] =
+    "<script type=\"text/ecmascript\"><![CDATA[\n"
+    "\"use strict\";\n"
+    "var svg, frames, details, unzoombtn, searchbtn, matchedtxt;\n"
+    "var xpad = 10, fontsize = 12, fontwidth = 0.59;\n"
+    "function init(evt) {\n"
+    "\tsvg = document.getElementsByTagName(\"svg\")[0];\n"
+    "\tframes = document.getElementById(\"frames\");\n"
+    "\tdetails = document.getElementById(\"details\").firstChild;\n"
+    "\tunzoombtn = document.getElementById(\"unzoom\");\n"
+    "\tsearchbtn = document.getElementById(\"search\");\n"
+    "\tmatchedtxt = document.getElementById(\"matched\");\n"
+    "}\n"
+    "window.addEventListener(\"click\", function(e) {\n"
+    "\tvar g = find_group(e.target);\n"
+    "\tif (g) {\n"
+    "\t\tif (g.classList.contains(\"parent\")) unzoom();\n"
+    "\t\tzoom(g);\n"
+    "\t}\n"
+    "\telse if (e.target.id == \"unzoom\") unzoom();\n"
+    "\telse if (e.target.id == \"search\") search_prompt();\n"
+    "}, false);\n"
+    "window.addEventListener(\"mouseover\", function(e) {\n"
+    "\tvar g = find_group(e.target);\n"
+    "\tif (g) details.nodeValue = \"Function: \" + g.querySelector(\"title\").textContent;\n"
+    "}, false);\n"
+    "window.addEventListener(\"mouseout\", function(e) {\n"
+    "\tif (find_group(e.target)) details.nodeValue = \" \";\n"
+    "}, false);\n"
+    "function find_group(node) {\n"
+    "\tvar parent = node.parentElement;\n"
+    "\tif (!parent) return null;\n"
+    "\tif (parent.id == \"frames\") return node;\n"
+    "\treturn find_group(parent);\n"
+    "}\n"
+    "function orig(e, attr) {\n"
+    "\tif (!e.hasAttribute(\"_orig_\" + attr)) e.setAttribute(\"_orig_\" + attr, e.getAttribute(attr));\n"
+    "\treturn parseFloat(e.getAttribute(\"_orig_\" + attr));\n"
+    "}\n"
+    "function update_text(g) {\n"
+    "\tvar r = g.querySelector(\"rect\"), t = g.querySelector(\"text\");\n"
+    "\tvar w = parseFloat(r.getAttribute(\"width\")) - 3;\n"
+    "\tvar txt = g.querySelector(\"title\").textContent.replace(/ \\([^(]*\\)$/, \"\");\n"
+    "\tvar n = Math.floor(w / (fontsize * fontwidth));\n"
+    "\tt.setAttribute(\"x\", parseFloat(r.getAttribute(\"x\")) + 3);\n"
+    "\tif (n < 3) t.textContent = \"\";\n"
+    "\telse t.textContent = txt.length <= n ? txt : txt.substring(0, n - 2) + \"..\";\n"
+    "}\n"
+    "function zoom(g) {\n"
+    "\tvar r = g.querySelector(\"rect\");\n"
+    "\tvar x0 = orig(r, \"x\"), w0 = orig(r, \"width\"), y0 = parseFloat(r.getAttribute(\"y\"));\n"
+    "\tvar full = svg.width.baseVal.value - 2 * xpad, ratio = full / w0, eps = 0.0001;\n"
+    "\tunzoombtn.classList.remove(\"hide\");\n"
+    "\tfor (var i = 0; i < frames.children.length; i++) {\n"
+    "\t\tvar e = frames.children[i], er = e.querySelector(\"rect\");\n"
+    "\t\tvar ex = orig(er, \"x\"), ew = orig(er, \"width\"), ey = parseFloat(er.getAttribute(\"y\"));\n"
+    "\t\te.classList.remove(\"hide\", \"parent\");\n"
+    "\t\tif (ey > y0 && ex <= x0 + eps && ex + ew >= x0 + w0 - eps) {\n"
+    "\t\t\te.classList.add(\"parent\");\n"
+    "\t\t\ter.setAttribute(\"x\", xpad);\n"
+    "\t\t\ter.setAttribute(\"width\", full);\n"
+    "\t\t} else if (ey <= y0 && ex >= x0 - eps && ex + ew <= x0 + w0 + eps) {\n"
+    "\t\t\ter.setAttribute(\"x\", (ex - x0) * ratio + xpad);\n"
+    "\t\t\ter.setAttribute(\"width\", ew * ratio);\n"
+    "\t\t} else {\n"
+    "\t\t\te.classList.add(\"hide\");\n"
+    "\t\t}\n"
+    "\t\tupdate_text(e);\n"
+    "\t}\n"
+    "}\n"
+    "function unzoom() {\n"
+    "\tunzoombtn.classList.add(\"hide\");\n"
+    "\tfor (var i = 0; i < frames.children.length; i++) {\n"
+    "\t\tvar e = frames.children[i], er = e.querySelector(\"rect\");\n"
+    "\t\te.classList.remove(\"hide\", \"parent\");\n"
+    "\t\ter.setAttribute(\"x\", orig(er, \"x\"));\n"
+    "\t\ter.setAttribute(\"width\", orig(er, \"width\"));\n"
+    "\t\tupdate_text(e);\n"
+    "\t}\n"
+    "}\n"
+    "function search_prompt() {\n"
+    "\tvar term = prompt(\"Enter a search term (regexp allowed, empty to reset)\", \"\");\n"
+    "\tif (term != null) search(term);\n"
+    "}\n"
+    "function search(term) {\n"
+    "\tvar re = new RegExp(term), matched = 0, total = 0;\n"
+    "\tfor (var i = 0; i < frames.children.length; i++) {\n"
+    "\t\tvar e = frames.children[i], er = e.querySelector(\"rect\");\n"
+    "\t\tvar name = e.querySelector(\"title\").textContent;\n"
+    "\t\tvar w = orig(er, \"width\");\n"
+    "\t\torig(er, \"fill\");\n"
+    "\t\tif (w > total) total = w;\n"
+    "\t\tif (term != \"\" && re.test(name)) {\n"
+    "\t\t\ter.setAttribute(\"fill\", \"rgb(230,0,230)\");\n"
+    "\t\t\tmatched += w;\n"
+    "\t\t} else {\n"
+    "\t\t\ter.setAttribute(\"fill\", er.getAttribute(\"_orig_fill\"));\n"
+    "\t\t}\n"
+    "\t}\n"
+    "\tsearchbtn.classList.toggle(\"show\", term != \"\");\n"
+    "\tmatchedtxt.classList.toggle(\"hide\", term == \"\");\n"
+    "\tmatchedtxt.firstChild.nodeValue = \"Matched: \" + (100 * Math.min(matched, total) / total).toFixed(1) + \"%\";\n"
+    "}\n"
+    "]]></script>\n";
+
+static void write_frame(FILE *out, struct flamegraph *fg, const fg_node &node, double x, double width,
+                        int image_height, double max_delta)
+{
+    std::string_view name = fg->names[node.name];
+    double y = image_height - YPAD2 - (double)(node.depth + 1) * FRAME_HEIGHT;
+    unsigned long long total = fg->nodes[0].total;
+    int r, g, b;
+    size_t fit;
+
+    if (fg->diff)
+    {
+        diff_color(node, max_delta, &r, &g, &b);
+    }
+    else
+    {
+        frame_color(name, node.kind, &r, &g, &b);
+    }
+    fputs("<g><title>", out);
+    write_escaped(out, name);
+    if (fg->diff)
+    {
+        fprintf(out, " (%llu samples, %.2f%%; %+.2f%%)</title>", node.total, 100.0 * node.total / total,
+                100.0 * ((double)node.total - (double)node.before) / total);
+    }
+    else
+    {
+        fprintf(out, " (%llu samples, %.2f%%)</title>", node.total, 100.0 * node.total / total);
+    }
+    fprintf(out, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d.0\" fill=\"rgb(%d,%d,%d)\" rx=\"2\" ry=\"2\" />",
+            x, y, width, FRAME_HEIGHT - 1, r, g, b);
+    fprintf(out, "<text x=\"%.2f\" y=\"%.1f\">", x + 3, y + FRAME_HEIGHT - 5);
+    fit = (size_t)((width - 3) / (FONT_SIZE * FONT_WIDTH));
+    if (fit >= 3)
+    {
+        if (name.size() <= fit)
+        {
+            write_escaped(out, name);
+        }
+        else
+        {
+            write_escaped(out, name.substr(0, fit - 2));
+            fputs("..", out);
+        }
+    }
+    fputs("</text></g>\n", out);
+}
+
+int flamegraph__write_svg(struct flamegraph *fg, FILE *out, const char *title)
+{
+    unsigned long long total;
+    double width_per_sample, max_delta = 0;
+    uint32_t max_depth = 0;
+    int image_height;
+
+    if (!fg || !out)
+    {
+        return -1;
+    }
+    total = fg->nodes[0].total;
+    width_per_sample = total ? (double)(IMAGE_WIDTH - 2 * XPAD) / total : 0;
+
+    for (const fg_node &node : fg->nodes)
+    {
+        if (node.total * width_per_sample >= MIN_WIDTH && node.depth > max_depth)
+        {
+            max_depth = node.depth;
+        }
+        double delta = (double)node.total - (double)node.before;
+        if (node.depth && (delta < 0 ? -delta : delta) > max_delta)
+        {
+            max_delta = delta < 0 ? -delta : delta;
+        }
+    }
+    image_height = (max_depth + 1) * FRAME_HEIGHT + YPAD1 + YPAD2;
+
+    fprintf(out, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+                 "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n"
+                 "<svg version=\"1.1\" width=\"%d\" height=\"%d\" onload=\"init(evt)\" viewBox=\"0 0 %d %d\" "
+                 "xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n",
+            IMAGE_WIDTH, image_height, IMAGE_WIDTH, image_height);
+    fputs("<defs><linearGradient id=\"background\" y1=\"0\" y2=\"1\" x1=\"0\" x2=\"0\">"
+          "<stop stop-color=\"#eeeeee\" offset=\"5%\" /><stop stop-color=\"#eeeeb0\" offset=\"95%\" />"
+          "</linearGradient></defs>\n"
+          "<style type=\"text/css\">\n"
+          "\ttext { font-family:Verdana; font-size:12px; fill:rgb(0,0,0); }\n"
+          "\t#search, #unzoom { cursor:pointer; }\n"
+          "\t#search { opacity:0.1; }\n"
+          "\t#search:hover, #search.show { opacity:1; }\n"
+          "\t#title { text-anchor:middle; font-size:17px; }\n"
+          "\t#frames > *:hover { stroke:black; stroke-width:0.5; cursor:pointer; }\n"
+          "\t.hide { display:none; }\n"
+          "\t.parent { opacity:0.5; }\n"
+          "</style>\n",
+          out);
+    fputs(svg_script, out);
+    fprintf(out, "<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"url(#background)\" />\n",
+            IMAGE_WIDTH, image_height);
+    fprintf(out, "<text id=\"title\" x=\"%d\" y=\"%d\">", IMAGE_WIDTH / 2, FONT_SIZE * 2);
+    write_escaped(out, title ? title : "Flame Graph");
+    fputs("</text>\n", out);
+    fprintf(out, "<text id=\"details\" x=\"%d\" y=\"%d\"> </text>\n", XPAD, image_height - YPAD2 / 2);
+    fprintf(out, "<text id=\"unzoom\" class=\"hide\" x=\"%d\" y=\"%d\">Reset Zoom</text>\n", XPAD, FONT_SIZE * 2);
+    fprintf(out, "<text id=\"search\" x=\"%d\" y=\"%d\">Search</text>\n", IMAGE_WIDTH - XPAD - 100, FONT_SIZE * 2);
+    fprintf(out, "<text id=\"matched\" class=\"hide\" x=\"%d\" y=\"%d\"> </text>\n",
+            IMAGE_WIDTH - XPAD - 100, image_height - YPAD2 / 2);
+
+    fputs("<g id=\"frames\">\n", out);
+    if (total)
+    {
+        /* depth-first, parents before children; x in samples from the left */
+        std::vector<std::pair<uint32_t, unsigned long long>> todo;
+        std::vector<uint32_t> children;
+        todo.emplace_back(0, 0);
+        while (!todo.empty())
+        {
+            auto [id, offset] = todo.back();
+            todo.pop_back();
+            const fg_node &node = fg->nodes[id];
+            double width = node.total * width_per_sample;
+            if (width < MIN_WIDTH)
+            {
+                continue;
+            }
+            write_frame(out, fg, node, XPAD + offset * width_per_sample, width, image_height, max_delta);
+            /* siblings are laid out by name, like flamegraph.pl's sorted input */
+            children.clear();
+            for (uint32_t child = node.first_child; child != NO_NODE; child = fg->nodes[child].next_sibling)
+            {
+                children.push_back(child);
+            }
+            std::sort(children.begin(), children.end(), [fg](uint32_t a, uint32_t b)
+                      { return fg->names[fg->nodes[a].name] < fg->names[fg->nodes[b].name]; });
+            size_t first = todo.size();
+            unsigned long long child_offset = offset;
+            for (uint32_t child : children)
+            {
+                todo.emplace_back(child, child_offset);
+                child_offset += fg->nodes[child].total;
+            }
+            /* pop the leftmost child first */
+            std::reverse(todo.begin() + first, todo.end());
+        }
+    }
+    fputs("</g>\n</svg>\n", out);
+    return 0;
+}
+
+/*
+ * Two folded profiles with every distinct stack interned once, so that
+ * million-line inputs cost one hash lookup per line.
+ */
+struct folded_diff
+{
+    std::deque<std::string> stack_storage;
+    std::unordered_map<std::string_view, uint32_t> stack_index;
+    std::vector<std::string_view> stacks;
+    std::vector<unsigned long long> counts[2];
+    unsigned long long totals[2];
+};
+
+struct folded_diff *folded_diff__new(void)
+{
+    struct folded_diff *d = new folded_diff;
+    d->totals[0] = d->totals[1] = 0;
+    return d;
+}
+
+void folded_diff__free(struct folded_diff *d)
+{
+    delete d;
+}
+
+int folded_diff__add(struct folded_diff *d, int which, const char *stack, size_t len,
+                     unsigned long long count)
+{
+    std::string_view key(stack, len);
+    uint32_t id;
+
+    if (!d || which < 0 || which > 1)
+    {
+        return -1;
+    }
+    auto it = d->stack_index.find(key);
+    if (it == d->stack_index.end())
+    {
+        d->stack_storage.emplace_back(key);
+        std::string_view stored = d->stack_storage.back();
+        id = d->stacks.size();
+        d->stacks.push_back(stored);
+        d->counts[0].push_back(0);
+        d->counts[1].push_back(0);
+        d->stack_index.emplace(stored, id);
+    }
+    else
+    {
+        id = it->second;
+    }
+    d->counts[which][id] += count;
+    d->totals[which] += count;
+    return 0;
+}
+
+int folded_diff__load(struct folded_diff *d, int which, FILE *in)
+{
+    char *line = NULL, *end, *sp;
+    size_t cap = 0;
+    ssize_t len;
+    unsigned long long count;
+    int err = 0;
+
+    while ((len = getline(&line, &cap, in)) >= 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        {
+            line[--len] = '\0';
+        }
+        sp = strrchr(line, ' ');
+        if (!sp || sp == line)
+        {
+            continue;
+        }
+        count = strtoull(sp + 1, &end, 10);
+        if (*end)
+        {
+            continue;
+        }
+        if (folded_diff__add(d, which, line, sp - line, count))
+        {
+            err = -1;
+            break;
+        }
+    }
+    free(line);
+    return err;
+}
+
+/* Scale factor applied to the baseline when normalizing to the same total */
+static double baseline_scale(const struct folded_diff *d, bool normalize)
+{
+    if (!normalize || !d->totals[0])
+    {
+        return 1.0;
+    }
+    return (double)d->totals[1] / d->totals[0];
+}
+
+unsigned long long folded_diff__total(const struct folded_diff *d, int which)
+{
+    return d && which >= 0 && which <= 1 ? d->totals[which] : 0;
+}
+
+int folded_diff__write_folded(const struct folded_diff *d, FILE *out, bool normalize)
+{
+    double scale;
+
+    if (!d || !out)
+    {
+        return -1;
+    }
+    scale = baseline_scale(d, normalize);
+    for (size_t i = 0; i < d->stacks.size(); i++)
+    {
+        fwrite(d->stacks[i].data(), 1, d->stacks[i].size(), out);
+        fprintf(out, " %llu %llu\n", (unsigned long long)(d->counts[0][i] * scale + 0.5), d->counts[1][i]);
+    }
+    return 0;
+}
+
+struct flamegraph *folded_diff__flamegraph(const struct folded_diff *d, bool normalize)
+{
+    std::vector<const char *> frames;
+    std::string stack;
+    double scale;
+
+    if (!d)
+    {
+        return NULL;
+    }
+    struct flamegraph *fg = flamegraph__new();
+    scale = baseline_scale(d, normalize);
+    for (size_t i = 0; i < d->stacks.size(); i++)
+    {
+        /* split a private copy in place into NUL-terminated frames */
+        stack.assign(d->stacks[i]);
+        frames.clear();
+        size_t start = 0;
+        for (size_t j = 0; j <= stack.size(); j++)
+        {
+            if (j == stack.size() || stack[j] == ';')
+            {
+                stack[j] = '\0';
+                frames.push_back(stack.data() + start);
+                start = j + 1;
+            }
+        }
+        flamegraph__add_diff_stack(fg, frames.data(), frames.size(),
+                                   (unsigned long long)(d->counts[0][i] * scale + 0.5), d->counts[1][i]);
+    }
+    /* an empty graph is still rendered in differential colours */
+    fg->diff = true;
+    return fg;
+}
@@ -0,0 +1,52 @@
+#ifndef FLAMEGRAPH_H
+#define FLAMEGRAPH_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    struct flamegraph;
+
+    struct flamegraph *flamegraph__new(void);
+    void flamegraph__free(struct flamegraph *fg);
+    /*
+     * Add one aggregated stack, root frame first.  Frames from index
+     * first_kernel on are kernel frames; pass nr_frames if there are none.
+     */
+    int flamegraph__add_stack(struct flamegraph *fg, const char *const *frames, int nr_frames,
+                              int first_kernel, unsigned long long count);
+    /*
+     * Add one stack of a differential graph: widths follow after, colours
+     * the change from before (red grew, blue shrank).
+     */
+    int flamegraph__add_diff_stack(struct flamegraph *fg, const char *const *frames, int nr_frames,
+                                   unsigned long long before, unsigned long long after);
+    unsigned long long flamegraph__total(const struct flamegraph *fg);
+    int flamegraph__write_svg(struct flamegraph *fg, FILE *out, const char *title);
+
+    /* A pair of profiles (0: before, 1: after) keyed by folded stack */
+    struct folded_diff;
+
+    struct folded_diff *folded_diff__new(void);
+    void folded_diff__free(struct folded_diff *d);
+    int folded_diff__add(struct folded_diff *d, int which, const char *stack, size_t len,
+                         unsigned long long count);
+    /* Read "frame;frame;... count" lines */
+    int folded_diff__load(struct folded_diff *d, int which, FILE *in);
+    unsigned long long folded_diff__total(const struct folded_diff *d, int which);
+    /*
+     * Write "stack before after" lines as consumed by flamegraph.pl, with
+     * the baseline scaled to the same total when normalize is set.
+     */
+    int folded_diff__write_folded(const struct folded_diff *d, FILE *out, bool normalize);
+    struct flamegraph *folded_diff__flamegraph(const struct folded_diff *d, bool normalize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
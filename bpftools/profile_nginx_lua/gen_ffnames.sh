@@ -0,0 +1,53 @@
+#!/bin/sh
+# SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#
+# Generate the fast function name tables of lua_ffnames.c from LuaJIT source
+# trees, one table per tree:
+#
+#   ./gen_ffnames.sh ~/src/luajit2 ~/src/LuaJIT-2.0.5 > .output/lua_ffdefs.h
+#
+# The names come from src/lj_ffdef.h when the tree was built, else from the
+# LJLIB_CF/LJLIB_ASM definitions of the lib_*.c files, in the order of
+# LJLIB_O in src/Makefile, the way buildvm numbers them.
+
+set -e
+
+echo "/* Generated by gen_ffnames.sh, do not edit */"
+
+tables=""
+n=0
+for dir in "$@"; do
+	src="$dir/src"
+	[ -d "$src" ] || src="$dir"
+	hdr="$src/luajit.h"
+	[ -f "$hdr" ] || hdr="$src/luajit_rolling.h"
+	version=$(sed -n 's/^#define LUAJIT_VERSION[ \t]*"LuaJIT \(.*\)"/\1/p' "$hdr")
+	if [ -z "$version" ]; then
+		echo "gen_ffnames.sh: no LUAJIT_VERSION in $hdr" >&2
+		exit 1
+	fi
+
+	if [ -f "$src/lj_ffdef.h" ]; then
+		names=$(sed -n 's/^FFDEF(\(.*\))$/\1/p' "$src/lj_ffdef.h")
+	else
+		libs=$(awk '/^LJLIB_O=/ { on = 1; sub(/^LJLIB_O=/, "") }
+			on { cont = sub(/\\$/, ""); print; if (!cont) exit }' "$src/Makefile" |
+			tr ' \t' '\n\n' | sed -n 's/\.o$/.c/p')
+		names=$(cd "$src" && grep -oh 'LJLIB_\(CF\|ASM_\?\)([A-Za-z0-9_]*)' $libs |
+			sed 's/^[^(]*(\(.*\))$/\1/')
+	fi
+
+	echo "/* LuaJIT $version from $dir; the first fast function is ffid 2 */"
+	echo "static const char *const lua_ffnames_$n[] = {"
+	echo "$names" | sed -e 's/^\(string\|table\|math\|bit\|io\|os\|package\|debug\|jit\|ffi\|coroutine\|buffer\)_/\1./' \
+		-e 's/.*/\t"&",/'
+	echo "};"
+	tables="$tables	{ \"$version\", lua_ffnames_$n, sizeof(lua_ffnames_$n) / sizeof(lua_ffnames_$n[0]) },
+"
+	n=$((n + 1))
+done
+
+echo "static const struct lua_ffnames_table lua_ffnames_tables[] = {"
+printf '%s' "$tables"
+echo "	{ NULL },"
+echo "};"
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lua_ffnames.h"
+
+struct lua_ffnames_table {
+	const char *version;
+	const char *const *names;
+	int nr;
+};
+
+#include "lua_ffdefs.h"
+
+/* ffids 0 and 1 are FF_LUA and FF_C */
+#define FF_FIRST 2
+
+static char version[64];
+static const struct lua_ffnames_table *selected;
+
+int lua_ffnames__select(const char *v)
+{
+	const struct lua_ffnames_table *t;
+
+	if (v != version)
+		snprintf(version, sizeof(version), "%s", v);
+	selected = NULL;
+	for (t = lua_ffnames_tables; t->version; t++) {
+		if (!strcmp(t->version, v)) {
+			selected = t;
+			return 0;
+		}
+	}
+	/* releases of one major.minor version add builtins too */
+	return -1;
+}
+
+const char *lua_ffnames__detect(const char *path)
+{
+	static const char tag[] = "LuaJIT 2.";
+	const char *p, *end;
+	struct stat st;
+	size_t n = 0;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* LUAJIT_VERSION, the value of jit.version */
+	p = memmem(data, st.st_size, tag, sizeof(tag) - 1);
+	if (p) {
+		p += strlen("LuaJIT ");
+		end = (const char *)data + st.st_size;
+		while (p + n < end && n < sizeof(version) - 1 && p[n] > ' ' && p[n] < 0x7f)
+			n++;
+		memcpy(version, p, n);
+		version[n] = '\0';
+	}
+	munmap(data, st.st_size);
+	if (!p)
+		return NULL;
+	lua_ffnames__select(version);
+	return version;
+}
+
+const char *lua_ffnames__version(void)
+{
+	return version[0] ? version : NULL;
+}
+
+const char *lua_ffnames__get(int ffid)
+{
+	if (!selected || ffid < FF_FIRST || ffid - FF_FIRST >= selected->nr)
+		return NULL;
+	return selected->names[ffid - FF_FIRST];
+}
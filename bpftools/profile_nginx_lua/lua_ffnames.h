@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __LUA_FFNAMES_H
+#define __LUA_FFNAMES_H
+
+/*
+ * Names of LuaJIT fast functions (builtins) by ffid, from the tables
+ * gen_ffnames.sh builds out of the LuaJIT sources given to make in
+ * LUAJIT_SRC.  The ffids differ between LuaJIT versions, so the table
+ * is picked by the version string of the profiled library.
+ */
+
+/*
+ * Read the version string out of the LuaJIT library at path and select its
+ * table.  Returns the version, e.g. "2.1.0-beta3", or NULL if none was found.
+ */
+const char *lua_ffnames__detect(const char *path);
+/*
+ * Select the table of exactly version: ffids shift between releases, and a
+ * wrong name is worse than none.  Returns 0 on a match and -1 otherwise.
+ */
+int lua_ffnames__select(const char *version);
+/* The version last detected or selected, or NULL */
+const char *lua_ffnames__version(void);
+/* e.g. "string.find" for the ffid of string.find, NULL if unknown */
+const char *lua_ffnames__get(int ffid);
+
+#endif /* __LUA_FFNAMES_H */
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "lua_state.h"
+#include "lua_func_lat.h"
+#include "bits.bpf.h"
+
+const volatile pid_t targ_pid = -1;
+const volatile int targ_line = 0;
+const volatile char targ_chunk[CHUNK_NAME_LEN] = {};
+const volatile bool targ_ms = false;
+
+/*
+ * The interpreter keeps BASE, the first slot of the running Lua function, in
+ * a fixed register: see the .define lines of vm_x64.dasc and vm_arm64.dasc.
+ */
+#if defined(__TARGET_ARCH_x86)
+#define LJ_VM_BASE(ctx) ((ctx)->dx)
+#elif defined(__TARGET_ARCH_arm64)
+#define LJ_VM_BASE(ctx) (((const struct user_pt_regs *)(ctx))->regs[19])
+#else
+#error "lua_func_lat only supports x86_64 and arm64"
+#endif
+
+// every prototype whose firstline matched: 1 if it is the target, 0 if not
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROTOS);
+	__type(key, __u64);
+	__type(value, __u8);
+} protos SEC(".maps");
+
+struct call_key
+{
+	__u32 pid;
+	__u32 pad;
+	__u64 base;
+};
+
+// entry time of calls in flight; a frame that is unwound by an error never
+// returns, so let the LRU drop it
+struct
+{
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_INFLIGHT);
+	__type(key, struct call_key);
+	__type(value, __u64);
+} starts SEC(".maps");
+
+__u32 hist[MAX_SLOTS] = {};
+__u64 calls = 0;
+__u64 total_ns = 0;
+
+static __always_inline bool chunk_matches(GCproto *pt)
+{
+	char name[CHUNK_NAME_LEN];
+	GCstr *s = proto_chunkname(pt);
+
+	if (bpf_probe_read_user_str(name, sizeof(name), strdata(s)) <= 0)
+		return false;
+	for (int i = 0; i < CHUNK_NAME_LEN; i++)
+	{
+		if (name[i] != targ_chunk[i])
+			return false;
+		if (!name[i])
+			break;
+	}
+	return true;
+}
+
+static int probe_func_entry(struct pt_regs *ctx)
+{
+	cTValue *base = (cTValue *)LJ_VM_BASE(ctx);
+	struct call_key key = {};
+	__u8 *known, is_target;
+	GCproto *pt;
+	GCfunc *fn;
+	__u64 ts;
+
+	key.pid = bpf_get_current_pid_tgid() >> 32;
+	if (targ_pid != -1 && targ_pid != key.pid)
+		return 0;
+
+	/* [func PC] sit right below base, see the LJ_FR2 frame layout */
+	fn = &gcval(base - 2)->fn;
+	pt = funcproto(fn);
+	if (!pt)
+		return 0;
+	/* a line compare rejects almost every call before any map lookup */
+	if (BPF_PROBE_READ_USER(pt, firstline) != targ_line)
+		return 0;
+
+	known = bpf_map_lookup_elem(&protos, &pt);
+	if (known)
+	{
+		is_target = *known;
+	}
+	else
+	{
+		is_target = chunk_matches(pt);
+		bpf_map_update_elem(&protos, &pt, &is_target, BPF_ANY);
+	}
+	if (!is_target)
+		return 0;
+
+	key.base = (__u64)base;
+	ts = bpf_ktime_get_ns();
+	bpf_map_update_elem(&starts, &key, &ts, BPF_ANY);
+	return 0;
+}
+
+static int probe_func_return(struct pt_regs *ctx)
+{
+	struct call_key key = {};
+	__u64 *tsp, delta;
+
+	/*
+	 * Every return is looked up.  A count of running calls cannot skip it:
+	 * frames unwound by errors or returning from traces never get here, and
+	 * starts drops them silently.
+	 */
+	key.pid = bpf_get_current_pid_tgid() >> 32;
+	if (targ_pid != -1 && targ_pid != key.pid)
+		return 0;
+	key.base = LJ_VM_BASE(ctx);
+	tsp = bpf_map_lookup_elem(&starts, &key);
+	if (!tsp)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - *tsp;
+	bpf_map_delete_elem(&starts, &key);
+	__sync_fetch_and_add(&calls, 1);
+	__sync_fetch_and_add(&total_ns, delta);
+
+	add_hist(hist, delta / (targ_ms ? 1000000 : 1000));
+	return 0;
+}
+
+SEC("kprobe/handle_func_entry")
+int handle_func_entry(struct pt_regs *ctx)
+{
+	return probe_func_entry(ctx);
+}
+
+SEC("kprobe/handle_func_return")
+int handle_func_return(struct pt_regs *ctx)
+{
+	return probe_func_return(ctx);
+}
+
+char LICENSE[] SEC("license") = "GPL";
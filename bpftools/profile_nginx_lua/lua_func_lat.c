@@ -0,0 +1,316 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * lua_func_lat  Summarize the call latency of one Lua function as a histogram.
+ *
+ * The function is picked by chunk name and first line.  Calls are timed from
+ * the FUNCF/FUNCV bytecode handlers of the LuaJIT interpreter to its RET*
+ * handlers, so calls made from JIT-compiled traces are not seen.
+ */
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "lua_func_lat.h"
+#include "lua_func_lat.skel.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static struct env
+{
+	pid_t pid;
+	const char *lib;
+	char chunk[CHUNK_NAME_LEN];
+	int line;
+	bool milliseconds;
+	int interval;
+	int duration;
+	bool timestamp;
+	bool verbose;
+} env = {
+	.pid = -1,
+	.interval = 99999999,
+	.duration = 99999999,
+};
+
+static volatile bool exiting;
+
+const char *argp_program_version = "lua_func_lat 0.1";
+const char argp_program_doc[] =
+	"Summarize the call latency of a Lua function as a histogram.\n"
+	"\n"
+	"USAGE: lua_func_lat [OPTIONS...] CHUNKNAME:LINE\n"
+	"CHUNKNAME:LINE is the chunk name and first line of the function definition,\n"
+	"as printed in the L: frames of profile. Calls made from JIT-compiled code\n"
+	"are not seen; load jit.off() in the traced code for complete counts.\n"
+	"EXAMPLES:\n"
+	"    lua_func_lat -p 185 @/app/router.lua:120      # time router.lua:120 in PID 185\n"
+	"    lua_func_lat -m -i 5 -p 185 @/app/router.lua:120  # milliseconds, every 5s\n"
+	"    lua_func_lat --lib /usr/local/openresty/luajit/lib/libluajit-5.1.so.2 @init.lua:3\n";
+
+static const struct argp_option opts[] = {
+	{"pid", 'p', "PID", 0, "trace process with this PID only"},
+	{"lib", 'l', "PATH", 0, "path of the LuaJIT library (default: found from -p)"},
+	{"milliseconds", 'm', NULL, 0, "millisecond histogram"},
+	{"interval", 'i', "INTERVAL", 0, "summary interval in seconds"},
+	{"duration", 'd', "DURATION", 0, "total duration of trace in seconds"},
+	{"timestamp", 'T', NULL, 0, "print timestamp"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	char *sep;
+
+	switch (key)
+	{
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.pid = strtol(arg, NULL, 10);
+		if (errno || env.pid <= 0)
+		{
+			fprintf(stderr, "invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'l':
+		env.lib = arg;
+		break;
+	case 'm':
+		env.milliseconds = true;
+		break;
+	case 'i':
+		errno = 0;
+		env.interval = strtol(arg, NULL, 10);
+		if (errno || env.interval <= 0)
+		{
+			fprintf(stderr, "invalid INTERVAL: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'd':
+		errno = 0;
+		env.duration = strtol(arg, NULL, 10);
+		if (errno || env.duration <= 0)
+		{
+			fprintf(stderr, "invalid DURATION: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'T':
+		env.timestamp = true;
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num != 0)
+		{
+			fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+			argp_usage(state);
+		}
+		sep = strrchr(arg, ':');
+		if (!sep || sep == arg || sep - arg >= CHUNK_NAME_LEN)
+		{
+			fprintf(stderr, "invalid function, expected CHUNKNAME:LINE: %s\n", arg);
+			argp_usage(state);
+		}
+		errno = 0;
+		env.line = strtol(sep + 1, NULL, 10);
+		if (errno || env.line < 0)
+		{
+			fprintf(stderr, "invalid LINE: %s\n", sep + 1);
+			argp_usage(state);
+		}
+		memcpy(env.chunk, arg, sep - arg);
+		env.chunk[sep - arg] = '\0';
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num != 1)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static void sig_handler(int sig)
+{
+	exiting = true;
+}
+
+/* Interpreter labels of lj_vm.S; they are hidden symbols, so .symtab is needed */
+static const char *entry_labels[] = {
+	"lj_BC_FUNCF",
+	"lj_BC_IFUNCF",
+	"lj_BC_FUNCV",
+	"lj_BC_IFUNCV",
+};
+static const char *return_labels[] = {
+	"lj_BC_RET",
+	"lj_BC_RET0",
+	"lj_BC_RET1",
+	"lj_BC_RETM",
+};
+#define NR_LABELS (sizeof(entry_labels) / sizeof(entry_labels[0]) + \
+				   sizeof(return_labels) / sizeof(return_labels[0]))
+
+static int attach_labels(struct bpf_program *prog, const char *path, const char **labels,
+						 int nr, struct bpf_link **links)
+{
+	int i, attached = 0;
+	off_t func_off;
+
+	for (i = 0; i < nr; i++)
+	{
+		func_off = get_elf_func_offset(path, labels[i]);
+		if (func_off < 0)
+		{
+			if (env.verbose)
+				warn("could not find %s in %s\n", labels[i], path);
+			continue;
+		}
+		links[i] = bpf_program__attach_uprobe(prog, false, -1, path, func_off);
+		if (!links[i])
+		{
+			warn("failed to attach %s: %d\n", labels[i], -errno);
+			return -1;
+		}
+		attached++;
+	}
+	if (!attached)
+	{
+		warn("no LuaJIT interpreter labels found in %s, is it stripped?\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	struct bpf_link *links[NR_LABELS] = {};
+	struct lua_func_lat_bpf *obj;
+	const int nr_entry = sizeof(entry_labels) / sizeof(entry_labels[0]);
+	char lua_path[PATH_MAX];
+	char ts[32];
+	struct tm *tm;
+	time_t t;
+	__u64 calls, total_ns;
+	int err, i;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	if (env.lib)
+	{
+		snprintf(lua_path, sizeof(lua_path), "%s", env.lib);
+	}
+	else if (env.pid > 0)
+	{
+		if (get_pid_lib_path(env.pid, "luajit-5.1.so", lua_path, sizeof(lua_path)) < 0)
+		{
+			fprintf(stderr, "failed to get lib path for pid %d\n", env.pid);
+			return 1;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "the LuaJIT library is needed, use -p or --lib\n");
+		return 1;
+	}
+
+	libbpf_set_print(libbpf_print_fn);
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+	obj = lua_func_lat_bpf__open();
+	if (!obj)
+	{
+		fprintf(stderr, "failed to open BPF object\n");
+		return 1;
+	}
+
+	obj->rodata->targ_pid = env.pid;
+	obj->rodata->targ_line = env.line;
+	obj->rodata->targ_ms = env.milliseconds;
+	memcpy((char *)obj->rodata->targ_chunk, env.chunk, sizeof(env.chunk));
+
+	err = lua_func_lat_bpf__load(obj);
+	if (err)
+	{
+		fprintf(stderr, "failed to load BPF programs\n");
+		goto cleanup;
+	}
+
+	err = attach_labels(obj->progs.handle_func_entry, lua_path, entry_labels, nr_entry, links);
+	if (!err)
+		err = attach_labels(obj->progs.handle_func_return, lua_path, return_labels,
+							NR_LABELS - nr_entry, links + nr_entry);
+	if (err)
+		goto cleanup;
+
+	signal(SIGINT, sig_handler);
+
+	printf("Tracing %s:%d", env.chunk, env.line);
+	if (env.duration < 99999999)
+		printf(" for %d secs.\n", env.duration);
+	else
+		printf("... Hit Ctrl-C to end.\n");
+
+	for (i = 0; !exiting && i < env.duration; i += env.interval)
+	{
+		sleep(env.interval < env.duration - i ? env.interval : env.duration - i);
+
+		printf("\n");
+		if (env.timestamp)
+		{
+			time(&t);
+			tm = localtime(&t);
+			strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+			printf("%-8s\n", ts);
+		}
+
+		calls = __atomic_exchange_n(&obj->bss->calls, 0, __ATOMIC_RELAXED);
+		total_ns = __atomic_exchange_n(&obj->bss->total_ns, 0, __ATOMIC_RELAXED);
+		print_log2_hist(obj->bss->hist, MAX_SLOTS, env.milliseconds ? "msecs" : "usecs");
+		memset(obj->bss->hist, 0, sizeof(obj->bss->hist));
+		printf("\ncalls = %llu", calls);
+		if (calls)
+			printf(", avg = %llu %s", total_ns / calls / (env.milliseconds ? 1000000 : 1000),
+				   env.milliseconds ? "msecs" : "usecs");
+		printf("\n");
+	}
+
+cleanup:
+	for (i = 0; i < NR_LABELS; i++)
+		bpf_link__destroy(links[i]);
+	lua_func_lat_bpf__destroy(obj);
+	return err != 0;
+}
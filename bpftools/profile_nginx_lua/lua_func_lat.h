@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef __LUA_FUNC_LAT_H
+#define __LUA_FUNC_LAT_H
+
+#define MAX_SLOTS 32
+#define CHUNK_NAME_LEN 128
+#define MAX_PROTOS 4096
+#define MAX_INFLIGHT 10240
+
+#endif /* __LUA_FUNC_LAT_H */
@@ -0,0 +1,452 @@
+#include "lua_funcname.h"
+#include <map>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/uio.h>
+#include <tuple>
+#include <vector>
+
+extern "C"
+{
+#include "lua_ffnames.h"
+}
+
+/* GCproto of a GC64 build, see lj_obj.h */
+struct lj_proto
+{
+    uint64_t nextgc;
+    uint8_t marked;
+    uint8_t gct;
+    uint8_t numparams;
+    uint8_t framesize;
+    uint32_t sizebc;
+    uint32_t unused_gc64;
+    uint64_t gclist;
+    uint64_t k;
+    uint64_t uv;
+    uint32_t sizekgc;
+    uint32_t sizekn;
+    uint32_t sizept;
+    uint8_t sizeuv;
+    uint8_t flags;
+    uint16_t trace;
+    uint64_t chunkname;
+    int32_t firstline;
+    int32_t numline;
+    uint64_t lineinfo;
+    uint64_t uvinfo;
+    uint64_t varinfo;
+};
+static_assert(sizeof(struct lj_proto) == 104, "GCproto layout");
+
+/* ~LJ_TPROTO, in the gct field of a GCproto */
+#define LJ_GCT_PROTO 7
+/* sizeof(GCstr) of a GC64 build; the string data follows */
+#define LJ_GCSTR_SIZE 24
+#define FRAME_TYPE 3
+#define FRAME_LUA 0
+#define MAX_PROTO_SIZE (1 << 24)
+#define MAX_NAME_LEN 128
+
+#define bc_op(i) ((i) & 0xff)
+#define bc_a(i) (((i) >> 8) & 0xff)
+#define bc_b(i) ((i) >> 24)
+#define bc_c(i) (((i) >> 16) & 0xff)
+#define bc_d(i) ((i) >> 16)
+
+enum bc_mode
+{
+    BCM___,
+    BCMdst,
+    BCMbase,
+    BCMrbase,
+    BCMvar,
+    BCMuv,
+};
+
+/*
+ * LuaJIT 2.1 bytecodes up to JMP, in lj_bc.h order: name, mode of operand A
+ * and the metamethod the instruction may call.
+ */
+#define BCDEF(_)                                                                                         \
+    _(ISLT, var, lt) _(ISGE, var, lt) _(ISLE, var, le) _(ISGT, var, le)                                  \
+    _(ISEQV, var, eq) _(ISNEV, var, eq) _(ISEQS, var, eq) _(ISNES, var, eq)                              \
+    _(ISEQN, var, eq) _(ISNEN, var, eq) _(ISEQP, var, eq) _(ISNEP, var, eq)                              \
+    _(ISTC, dst, ___) _(ISFC, dst, ___) _(IST, ___, ___) _(ISF, ___, ___)                                \
+    _(ISTYPE, var, ___) _(ISNUM, var, ___)                                                               \
+    _(MOV, dst, ___) _(NOT, dst, ___) _(UNM, dst, unm) _(LEN, dst, len)                                  \
+    _(ADDVN, dst, add) _(SUBVN, dst, sub) _(MULVN, dst, mul) _(DIVVN, dst, div) _(MODVN, dst, mod)       \
+    _(ADDNV, dst, add) _(SUBNV, dst, sub) _(MULNV, dst, mul) _(DIVNV, dst, div) _(MODNV, dst, mod)       \
+    _(ADDVV, dst, add) _(SUBVV, dst, sub) _(MULVV, dst, mul) _(DIVVV, dst, div) _(MODVV, dst, mod)       \
+    _(POW, dst, pow) _(CAT, dst, concat)                                                                 \
+    _(KSTR, dst, ___) _(KCDATA, dst, ___) _(KSHORT, dst, ___) _(KNUM, dst, ___) _(KPRI, dst, ___)        \
+    _(KNIL, base, ___)                                                                                   \
+    _(UGET, dst, ___) _(USETV, uv, ___) _(USETS, uv, ___) _(USETN, uv, ___) _(USETP, uv, ___)            \
+    _(UCLO, rbase, ___) _(FNEW, dst, gc)                                                                 \
+    _(TNEW, dst, gc) _(TDUP, dst, gc) _(GGET, dst, index) _(GSET, var, newindex)                         \
+    _(TGETV, dst, index) _(TGETS, dst, index) _(TGETB, dst, index) _(TGETR, dst, index)                  \
+    _(TSETV, var, newindex) _(TSETS, var, newindex) _(TSETB, var, newindex) _(TSETM, base, newindex)     \
+    _(TSETR, var, newindex)                                                                              \
+    _(CALLM, base, call) _(CALL, base, call) _(CALLMT, base, call) _(CALLT, base, call)                  \
+    _(ITERC, base, call) _(ITERN, base, call) _(VARG, base, ___) _(ISNEXT, base, ___)                    \
+    _(RETM, base, ___) _(RET, rbase, ___) _(RET0, rbase, ___) _(RET1, rbase, ___)                        \
+    _(FORI, base, ___) _(JFORI, base, ___) _(FORL, base, ___) _(IFORL, base, ___) _(JFORL, base, ___)    \
+    _(ITERL, base, ___) _(IITERL, base, ___) _(JITERL, base, ___)                                        \
+    _(LOOP, rbase, ___) _(ILOOP, rbase, ___) _(JLOOP, rbase, ___) _(JMP, rbase, ___)
+
+enum bc_op
+{
+#define BCENUM(name, ma, mm) BC_##name,
+    BCDEF(BCENUM)
+#undef BCENUM
+        BC__MAX
+};
+
+static const struct
+{
+    uint8_t mode_a;
+    /* metamethod name without the __, NULL if none */
+    const char *mm;
+} bc_info[] = {
+#define BCINFO(name, ma, mm) {BCM##ma, #mm[0] == '_' ? NULL : #mm},
+    BCDEF(BCINFO)
+#undef BCINFO
+};
+
+/* Names of the internal variables of numeric and generic for loops */
+static const char *const varnames[] = {
+    NULL,
+    "(for index)",
+    "(for limit)",
+    "(for step)",
+    "(for generator)",
+    "(for state)",
+    "(for control)",
+};
+
+struct proto_image
+{
+    unsigned long addr;
+    std::vector<uint8_t> buf;
+
+    const struct lj_proto *pt() const
+    {
+        return (const struct lj_proto *)buf.data();
+    }
+    /* local copy of [a, a + len) of the proto, or NULL if outside of it */
+    const uint8_t *at(unsigned long a, size_t len) const
+    {
+        if (a < addr || a - addr > buf.size() || len > buf.size() - (a - addr))
+        {
+            return NULL;
+        }
+        return buf.data() + (a - addr);
+    }
+    uint32_t ins(uint32_t pos) const
+    {
+        uint32_t i;
+
+        memcpy(&i, buf.data() + sizeof(struct lj_proto) + pos * sizeof(i), sizeof(i));
+        return i;
+    }
+};
+
+struct lua_funcnames
+{
+    std::map<std::tuple<pid_t, unsigned long>, proto_image> protos;
+    std::map<std::tuple<pid_t, unsigned long, unsigned long>, std::string> names;
+};
+
+static size_t read_mem(pid_t pid, unsigned long addr, void *buf, size_t len)
+{
+    struct iovec local = {buf, len}, remote = {(void *)addr, len};
+    ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+
+    return n < 0 ? 0 : n;
+}
+
+static const proto_image &read_proto(struct lua_funcnames *n, pid_t pid, unsigned long addr)
+{
+    auto it = n->protos.find({pid, addr});
+    if (it != n->protos.end())
+    {
+        return it->second;
+    }
+    proto_image &p = n->protos[{pid, addr}];
+    struct lj_proto pt;
+
+    p.addr = addr;
+    /* the bytecode and debug info are colocated within sizept */
+    if (read_mem(pid, addr, &pt, sizeof(pt)) != sizeof(pt) || pt.gct != LJ_GCT_PROTO ||
+        pt.sizept > MAX_PROTO_SIZE || pt.sizept < sizeof(pt) + (size_t)pt.sizebc * sizeof(uint32_t))
+    {
+        return p;
+    }
+    p.buf.resize(pt.sizept);
+    if (read_mem(pid, addr, p.buf.data(), p.buf.size()) != p.buf.size())
+    {
+        p.buf.clear();
+    }
+    return p;
+}
+
+static bool read_uleb128(const uint8_t *&p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t r = 0;
+
+    for (int shift = 0; p < end && shift < 32; shift += 7)
+    {
+        r |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+        {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Name of the local variable in slot at pc, as debug_varname() */
+static const char *varname(const proto_image &p, uint32_t pc, uint32_t slot)
+{
+    const uint8_t *v = p.at(p.pt()->varinfo, 1), *end = p.buf.data() + p.buf.size();
+    uint32_t lastpc = 0, startpc, len;
+
+    if (!v)
+    {
+        return NULL;
+    }
+    while (v < end)
+    {
+        const char *name = (const char *)v;
+        uint32_t vn = *v;
+
+        if (vn < sizeof(varnames) / sizeof(varnames[0]))
+        {
+            if (!vn)
+            {
+                break;
+            }
+            name = varnames[vn];
+        }
+        else
+        {
+            v = (const uint8_t *)memchr(v, 0, end - v);
+            if (!v)
+            {
+                break;
+            }
+        }
+        v++;
+        if (!read_uleb128(v, end, &startpc))
+        {
+            break;
+        }
+        lastpc = startpc = lastpc + startpc;
+        if (startpc > pc || !read_uleb128(v, end, &len))
+        {
+            break;
+        }
+        if (pc < startpc + len && slot-- == 0)
+        {
+            return name;
+        }
+    }
+    return NULL;
+}
+
+/* Name of upvalue idx, as lj_debug_uvname() */
+static const char *uvname(const proto_image &p, uint32_t idx)
+{
+    const uint8_t *v = p.at(p.pt()->uvinfo, 1), *end = p.buf.data() + p.buf.size();
+
+    while (v && idx--)
+    {
+        v = (const uint8_t *)memchr(v, 0, end - v);
+        v = v && v + 1 < end ? v + 1 : NULL;
+    }
+    return v && memchr(v, 0, end - v) ? (const char *)v : NULL;
+}
+
+/* The string constant kgc[~idx] of the proto */
+static std::string kstr(pid_t pid, const proto_image &p, uint32_t idx)
+{
+    const uint8_t *ref = p.at(p.pt()->k - (idx + 1) * sizeof(uint64_t), sizeof(uint64_t));
+    char buf[MAX_NAME_LEN];
+    uint64_t str;
+    size_t len;
+
+    if (!ref || idx >= p.pt()->sizekgc)
+    {
+        return "";
+    }
+    memcpy(&str, ref, sizeof(str));
+    len = read_mem(pid, str + LJ_GCSTR_SIZE, buf, sizeof(buf) - 1);
+    buf[len] = '\0';
+    return buf;
+}
+
+/* Name of the value in slot at pos, as lj_debug_slotname() */
+static std::string slotname(pid_t pid, const proto_image &p, uint32_t pos, uint32_t slot)
+{
+    const char *name;
+
+restart:
+    name = varname(p, pos, slot);
+    if (name)
+    {
+        return name;
+    }
+    /* back to the instruction that set slot, stopping at the function header */
+    while (pos > 1)
+    {
+        uint32_t ins = p.ins(--pos), op = bc_op(ins), ra = bc_a(ins);
+
+        if (op >= BC__MAX)
+        {
+            return "";
+        }
+        if (bc_info[op].mode_a == BCMbase)
+        {
+            if (slot >= ra && (op != BC_KNIL || slot <= bc_d(ins)))
+            {
+                return "";
+            }
+        }
+        else if (bc_info[op].mode_a == BCMdst && ra == slot)
+        {
+            switch (op)
+            {
+            case BC_MOV:
+                slot = bc_d(ins);
+                goto restart;
+            case BC_GGET:
+                return kstr(pid, p, bc_d(ins));
+            case BC_TGETS:
+                return kstr(pid, p, bc_c(ins));
+            case BC_UGET:
+                name = uvname(p, bc_d(ins));
+                return name ?: "";
+            default:
+                return "";
+            }
+        }
+    }
+    return "";
+}
+
+/* Position of the call that returns to pc in the proto, as debug_framepc() */
+static bool call_pos(const proto_image &p, unsigned long pc, uint32_t *pos)
+{
+    unsigned long bc = p.addr + sizeof(struct lj_proto);
+
+    if (p.buf.empty() || pc <= bc || (pc - bc) % sizeof(uint32_t))
+    {
+        return false;
+    }
+    /* pc is the return address, right after the call */
+    *pos = (pc - bc) / sizeof(uint32_t) - 1;
+    return *pos < p.pt()->sizebc;
+}
+
+/* Source line of the instruction at pos, as lj_debug_line() */
+static int line_at(const proto_image &p, uint32_t pos)
+{
+    const struct lj_proto *pt = p.pt();
+    uint32_t width = pt->numline < 256 ? 1 : pt->numline < 65536 ? 2 : 4, delta = 0;
+    const uint8_t *info;
+
+    if (pos == 0)
+    {
+        return pt->firstline;
+    }
+    /* the function header at 0 has no entry */
+    info = p.at(pt->lineinfo + (pos - 1) * width, width);
+    if (!info)
+    {
+        return 0;
+    }
+    memcpy(&delta, info, width);
+    return pt->firstline + delta;
+}
+
+static std::string funcname(struct lua_funcnames *n, pid_t pid, unsigned long caller, unsigned long pc)
+{
+    const proto_image &p = read_proto(n, pid, caller);
+    uint32_t pos, ins, op, slot;
+
+    if (!call_pos(p, pc, &pos))
+    {
+        return "";
+    }
+    ins = p.ins(pos);
+    op = bc_op(ins);
+    if (op >= BC__MAX || !bc_info[op].mm)
+    {
+        return "";
+    }
+    if (strcmp(bc_info[op].mm, "call"))
+    {
+        return std::string("__") + bc_info[op].mm;
+    }
+    slot = bc_a(ins);
+    if (op == BC_ITERC)
+    {
+        slot -= 3;
+    }
+    return slotname(pid, p, pos, slot);
+}
+
+struct lua_funcnames *lua_funcnames__new(void)
+{
+    return new lua_funcnames;
+}
+
+void lua_funcnames__free(struct lua_funcnames *n)
+{
+    delete n;
+}
+
+void lua_funcnames__resolve(struct lua_funcnames *n, pid_t pid, struct stack_backtrace *lua_bt)
+{
+    /* the bytecode numbering differs before 2.1 */
+    const char *version = lua_ffnames__version();
+    bool supported = !version || !strncmp(version, "2.1", 3);
+
+    for (int i = 0; i < lua_bt->level_size; i++)
+    {
+        const struct lua_stack_event *e = &lua_bt->stack[i], *caller = e + 1;
+        /* the pc of a frame is where its callee returns to */
+        unsigned long long link = i ? lua_bt->stack[i - 1].frame_link : e->top_link;
+        uint32_t pos;
+
+        lua_bt->lines[i] = 0;
+        if (n && e->type == FUNC_TYPE_LUA && e->funcp && link && (link & FRAME_TYPE) == FRAME_LUA)
+        {
+            const proto_image &p = read_proto(n, pid, (unsigned long)e->funcp);
+            if (call_pos(p, link, &pos))
+            {
+                lua_bt->lines[i] = line_at(p, pos);
+            }
+        }
+
+        lua_bt->func_names[i] = NULL;
+        if (!n || !supported || e->type != FUNC_TYPE_LUA || !e->frame_link ||
+            (e->frame_link & FRAME_TYPE) != FRAME_LUA || i + 1 >= lua_bt->level_size ||
+            caller->type != FUNC_TYPE_LUA || !caller->funcp || caller->segment != e->segment)
+        {
+            continue;
+        }
+        auto key = std::make_tuple(pid, (unsigned long)caller->funcp, (unsigned long)e->frame_link);
+        auto it = n->names.find(key);
+        if (it == n->names.end())
+        {
+            it = n->names.emplace(key, funcname(n, pid, (unsigned long)caller->funcp, e->frame_link)).first;
+        }
+        if (!it->second.empty())
+        {
+            lua_bt->func_names[i] = it->second.c_str();
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef LUA_FUNCNAME_H
+#define LUA_FUNCNAME_H
+
+#include <sys/types.h>
+#include "lua_stacks_helper.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /*
+     * Names of Lua functions as lj_debug_funcname() finds them: from the
+     * bytecode of the call site in the caller, read out of the profiled
+     * process.  Results are cached per (process, caller proto, call site),
+     * and each caller proto is read once, so the cost grows with the number
+     * of distinct functions, not samples.
+     */
+    struct lua_funcnames;
+
+    struct lua_funcnames *lua_funcnames__new(void);
+    void lua_funcnames__free(struct lua_funcnames *n);
+    /*
+     * Set func_names of every level of lua_bt, NULL where the function was
+     * not called from Lua or has no name, and lines, the current line of
+     * each Lua function, 0 where its callee was not called from Lua.  The
+     * names live as long as n.
+     */
+    void lua_funcnames__resolve(struct lua_funcnames *n, pid_t pid, struct stack_backtrace *lua_bt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,216 @@
+#include "lua_heatmap.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define NR_CHUNKS_SHOWN 10
+/* source lines shown around every hot line */
+#define CONTEXT_LINES 2
+
+struct line_count
+{
+    unsigned long long self;
+    unsigned long long total;
+};
+
+struct heat_chunk
+{
+    std::string name;
+    /* a process that ran the chunk, to read the source from */
+    pid_t pid;
+    unsigned long long self;
+    unsigned long long total;
+};
+
+struct lua_heatmap
+{
+    std::unordered_map<std::string, uint32_t> chunk_index;
+    std::vector<heat_chunk> chunks;
+    /* (chunk id << 32 | line) to its counts */
+    std::unordered_map<uint64_t, line_count> lines;
+    unsigned long long nr_samples;
+};
+
+struct lua_heatmap *lua_heatmap__new(void)
+{
+    struct lua_heatmap *h = new lua_heatmap;
+    h->nr_samples = 0;
+    return h;
+}
+
+void lua_heatmap__free(struct lua_heatmap *h)
+{
+    delete h;
+}
+
+static uint32_t chunk_id(struct lua_heatmap *h, const char *name, pid_t pid)
+{
+    auto it = h->chunk_index.find(name);
+    if (it != h->chunk_index.end())
+    {
+        return it->second;
+    }
+    uint32_t id = h->chunks.size();
+    h->chunks.push_back({name, pid, 0, 0});
+    h->chunk_index.emplace(name, id);
+    return id;
+}
+
+void lua_heatmap__add(struct lua_heatmap *h, pid_t pid, const struct stack_backtrace *lua_bt,
+                      unsigned long long count)
+{
+    uint64_t seen[MAX_STACK_DEPTH];
+    uint32_t seen_chunks[MAX_STACK_DEPTH];
+    int nr_seen = 0, nr_seen_chunks = 0;
+    bool innermost = true;
+
+    h->nr_samples += count;
+    for (int i = 0; i < lua_bt->level_size; i++)
+    {
+        const struct lua_stack_event *e = &lua_bt->stack[i];
+
+        if (e->type != FUNC_TYPE_LUA)
+        {
+            continue;
+        }
+        if (lua_bt->lines[i] <= 0)
+        {
+            innermost = false;
+            continue;
+        }
+        uint32_t id = chunk_id(h, e->name, pid);
+        uint64_t key = (uint64_t)id << 32 | (uint32_t)lua_bt->lines[i];
+        line_count &c = h->lines[key];
+
+        if (innermost)
+        {
+            c.self += count;
+            h->chunks[id].self += count;
+            innermost = false;
+        }
+        /* recursion counts a line once per stack */
+        if (std::find(seen, seen + nr_seen, key) == seen + nr_seen)
+        {
+            seen[nr_seen++] = key;
+            c.total += count;
+        }
+        if (std::find(seen_chunks, seen_chunks + nr_seen_chunks, id) == seen_chunks + nr_seen_chunks)
+        {
+            seen_chunks[nr_seen_chunks++] = id;
+            h->chunks[id].total += count;
+        }
+    }
+}
+
+/* Lines of the chunk's source file as the process sees it, empty if unreadable */
+static std::vector<std::string> read_source(const heat_chunk &c)
+{
+    std::vector<std::string> src;
+    char path[4096], *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *f;
+
+    /* "@file" names a file, "=name" and source strings do not */
+    if (c.name.size() < 2 || c.name[0] != '@')
+    {
+        return src;
+    }
+    const char *file = c.name.c_str() + 1;
+    snprintf(path, sizeof(path), "/proc/%d/%s/%s", c.pid, file[0] == '/' ? "root" : "cwd", file);
+    f = fopen(path, "r");
+    if (!f)
+    {
+        return src;
+    }
+    while ((len = getline(&line, &cap, f)) >= 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        {
+            len--;
+        }
+        src.emplace_back(line, len);
+    }
+    free(line);
+    fclose(f);
+    return src;
+}
+
+static void print_chunk(const struct lua_heatmap *h, uint32_t id, FILE *out)
+{
+    const heat_chunk &c = h->chunks[id];
+    std::vector<std::pair<int, line_count>> hot;
+
+    for (const auto &l : h->lines)
+    {
+        if (l.first >> 32 == id)
+        {
+            hot.push_back({(int)(uint32_t)l.first, l.second});
+        }
+    }
+    std::sort(hot.begin(), hot.end(),
+              [](const std::pair<int, line_count> &a, const std::pair<int, line_count> &b) {
+                  return a.first < b.first;
+              });
+
+    std::vector<std::string> src = read_source(c);
+    fprintf(out, "\n%s: %llu samples (%.2f%%), %llu self\n", c.name.c_str(), c.total,
+            h->nr_samples ? 100.0 * c.total / h->nr_samples : 0.0, c.self);
+    if (src.empty())
+    {
+        fprintf(out, "  (source not readable, hot lines only)\n");
+    }
+    fprintf(out, "%8s %8s %6s  %s\n", "SELF", "TOTAL", "LINE", "SOURCE");
+
+    int shown = 0;
+    for (size_t i = 0; i < hot.size(); i++)
+    {
+        int line = hot[i].first;
+        int from = src.empty() ? line : std::max(line - CONTEXT_LINES, shown + 1);
+
+        if (shown && from > shown + 1)
+        {
+            fprintf(out, "%8s %8s %6s  ...\n", "", "", "");
+        }
+        /* cold lines of context before this hot line */
+        for (int l = from; l < line && l <= (int)src.size(); l++)
+        {
+            fprintf(out, "%8s %8s %6d  %s\n", "", "", l, src[l - 1].c_str());
+        }
+        fprintf(out, "%8llu %8llu %6d  %s\n", hot[i].second.self, hot[i].second.total, line,
+                line <= (int)src.size() ? src[line - 1].c_str() : "");
+        shown = line;
+        /* and after it, up to the next hot line */
+        int next = i + 1 < hot.size() ? hot[i + 1].first : INT32_MAX;
+        for (int l = line + 1; !src.empty() && l <= line + CONTEXT_LINES && l < next && l <= (int)src.size(); l++)
+        {
+            fprintf(out, "%8s %8s %6d  %s\n", "", "", l, src[l - 1].c_str());
+            shown = l;
+        }
+    }
+}
+
+void lua_heatmap__print(const struct lua_heatmap *h, FILE *out, int top)
+{
+    std::vector<uint32_t> order(h->chunks.size());
+    size_t n = top > 0 ? top : NR_CHUNKS_SHOWN;
+
+    for (uint32_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+              [h](uint32_t a, uint32_t b) { return h->chunks[a].total > h->chunks[b].total; });
+    if (order.empty())
+    {
+        fprintf(out, "no Lua frames with a known current line were sampled\n");
+        return;
+    }
+    for (size_t i = 0; i < order.size() && i < n; i++)
+    {
+        print_chunk(h, order[i], out);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef LUA_HEATMAP_H
+#define LUA_HEATMAP_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "lua_stacks_helper.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /*
+     * Samples per source line of every Lua chunk, printed as annotated
+     * source.  A line counts as self when it is the current line of the
+     * innermost Lua function, and as total once per stack it is on.
+     */
+    struct lua_heatmap;
+
+    struct lua_heatmap *lua_heatmap__new(void);
+    void lua_heatmap__free(struct lua_heatmap *h);
+    /* Add count samples of pid; lua_bt->lines must be resolved */
+    void lua_heatmap__add(struct lua_heatmap *h, pid_t pid, const struct stack_backtrace *lua_bt,
+                          unsigned long long count);
+    /*
+     * Print the top chunks by total samples, hot lines with some context.
+     * Sources are read through /proc/PID/root of a process that ran them.
+     */
+    void lua_heatmap__print(const struct lua_heatmap *h, FILE *f, int top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
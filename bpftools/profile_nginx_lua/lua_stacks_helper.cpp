@@ -1,9 +1,11 @@
 #include "lua_stacks_helper.h"
 #include <map>
+#include <utility>
 
 struct lua_stack_map
 {
-    std::map<int, struct stack_backtrace> map;
+    /* by user_stack_id and lua_stack_hash of the sample */
+    std::map<std::pair<int, unsigned long long>, struct stack_backtrace> map;
 };
 
 struct lua_stack_map *init_lua_stack_map(void)
@@ -19,36 +21,32 @@ void free_lua_stack_map(struct lua_stack_map *map)
 
 int insert_lua_stack_map(struct lua_stack_map *map, const struct lua_stack_event *e)
 {
-    if (!e)
-    {
-        return -1;
-    }
-    auto it = map->map.find(e->user_stack_id);
-    if (it == map->map.end())
-    {
-        struct stack_backtrace stack = {0};
-        stack.stack[e->level] = *e;
-        stack.level_size = e->level + 1;
-        map->map[e->user_stack_id] = stack; // insert
-        return 0;
-    }
-    struct stack_backtrace *stack = &it->second;
-    if (e->level >= MAX_STACK_DEPTH)
+    if (!e || e->level < 0 || e->level >= MAX_STACK_DEPTH)
     {
         return -1;
     }
+    struct stack_backtrace *stack = &map->map[{e->user_stack_id, e->lua_stack_hash}]; // inserted zeroed
     if (e->level >= stack->level_size)
     {
         stack->level_size = e->level + 1;
     }
     stack->stack[e->level] = *e;
+    if (e->segment >= 0 && e->segment < MAX_LUA_SEGMENTS)
+    {
+        stack->segments[e->segment] = {(unsigned long)e->seg_ret, (unsigned long)e->seg_fp_ret};
+        if (e->segment >= stack->nr_segments)
+        {
+            stack->nr_segments = e->segment + 1;
+        }
+    }
     return 0;
 }
 
 // return the level of stack in the map
-int get_lua_stack_backtrace(struct lua_stack_map *map, int user_stack_id, struct stack_backtrace *stack)
+int get_lua_stack_backtrace(struct lua_stack_map *map, int user_stack_id, unsigned long long lua_stack_hash,
+                            struct stack_backtrace *stack)
 {
-    auto it = map->map.find(user_stack_id);
+    auto it = map->map.find({user_stack_id, lua_stack_hash});
     if (it == map->map.end())
     {
         *stack = {0};
@@ -2,6 +2,7 @@
 #define LUA_STACKS_HELPER_H
 
 #define MAX_STACK_DEPTH 64
+#define MAX_LUA_SEGMENTS 16
 
 #include "profile.h"
 
@@ -10,10 +11,27 @@ extern "C"
 {
 #endif
 
+    /*
+     * Where the Lua frames of one segment join the native stack: the return
+     * address into lua_pcall & co of the VM entry, and the one above their
+     * caller, which a frame pointer walk finds instead.
+     */
+    struct lua_segment
+    {
+        unsigned long ret;
+        unsigned long fp_ret;
+    };
+
     struct stack_backtrace
     {
         int level_size;
         struct lua_stack_event stack[MAX_STACK_DEPTH];
+        /* function names from the call sites, see lua_funcname.h */
+        const char *func_names[MAX_STACK_DEPTH];
+        /* current line of Lua functions, 0 if unknown */
+        int lines[MAX_STACK_DEPTH];
+        int nr_segments;
+        struct lua_segment segments[MAX_LUA_SEGMENTS];
     };
 
     struct lua_stack_map;
@@ -21,7 +39,8 @@ extern "C"
     struct lua_stack_map *init_lua_stack_map(void);
     void free_lua_stack_map(struct lua_stack_map *map);
     int insert_lua_stack_map(struct lua_stack_map *map, const struct lua_stack_event *event);
-    int get_lua_stack_backtrace(struct lua_stack_map *map, int user_stack_id, struct stack_backtrace *stack);
+    int get_lua_stack_backtrace(struct lua_stack_map *map, int user_stack_id, unsigned long long lua_stack_hash,
+                                struct stack_backtrace *stack);
 
 #ifdef __cplusplus
 }
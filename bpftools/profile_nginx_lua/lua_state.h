@@ -703,7 +703,7 @@ enum
 **                  ^-- frame            | ^-- base   ^-- top
 */
 #define frame_gc(f) (gcval((f)-1))
-#define frame_ftsz(f) ((ptrdiff_t)BPF_PROBE_READ_USER(frame, ftsz))
+#define frame_ftsz(f) ((ptrdiff_t)BPF_PROBE_READ_USER(f, ftsz))
 
 #define frame_pc(f) ((const BCIns *)frame_ftsz(f))
 #define setframe_ftsz(f, sz) ((f)->ftsz = (sz))
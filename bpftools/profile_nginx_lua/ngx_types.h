@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef __NGX_TYPES_H
+#define __NGX_TYPES_H
+
+/*
+ * The few nginx structures read from BPF, as laid out by 64-bit builds of
+ * nginx 1.x (src/core/ngx_string.h, ngx_shmem.h and ngx_cycle.h).  Only the
+ * leading fields that are read need to match.
+ */
+
+typedef struct
+{
+	size_t len;
+	unsigned char *data;
+} ngx_str_t;
+
+typedef struct
+{
+	unsigned char *addr;
+	size_t size;
+	ngx_str_t name;
+	void *log;
+	unsigned long exists;
+} ngx_shm_t;
+
+typedef struct
+{
+	void *data;
+	ngx_shm_t shm;
+	void *init;
+	void *tag;
+	void *sync;
+	unsigned long noreuse;
+} ngx_shm_zone_t;
+
+#endif /* __NGX_TYPES_H */
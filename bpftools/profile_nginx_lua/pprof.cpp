@@ -0,0 +1,309 @@
+#include "pprof.h"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+/* Field numbers of profile.proto */
+enum
+{
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_PERIOD_TYPE = 11,
+    PROFILE_PERIOD = 12,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+    LOCATION_ID = 1,
+    LOCATION_LINE = 4,
+    LINE_FUNCTION_ID = 1,
+    LINE_LINE = 2,
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3,
+    FUNCTION_FILENAME = 4,
+    FUNCTION_START_LINE = 5,
+};
+
+#define WIRE_VARINT 0
+#define WIRE_BYTES 2
+
+struct pprof_function
+{
+    uint64_t name;
+    uint64_t system_name;
+    uint64_t filename;
+    int64_t line;
+};
+
+struct pprof
+{
+    std::unordered_map<std::string, uint64_t> strings;
+    std::vector<const std::string *> string_table;
+    /* function and location ids are the same, by frame name */
+    std::unordered_map<std::string, uint64_t> frames;
+    std::vector<pprof_function> functions;
+    /* leaf first location ids to the summed value */
+    std::unordered_map<std::string, unsigned long long> samples;
+    uint64_t type, unit, period_type, period_unit;
+    long long period;
+    uint64_t start_ns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* LEB128, as used by protobuf */
+static void put_varint(std::string &buf, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+static void put_field(std::string &buf, int field, unsigned long long v)
+{
+    put_varint(buf, field << 3 | WIRE_VARINT);
+    put_varint(buf, v);
+}
+
+static void put_message(std::string &buf, int field, const std::string &msg)
+{
+    put_varint(buf, field << 3 | WIRE_BYTES);
+    put_varint(buf, msg.size());
+    buf.append(msg);
+}
+
+static uint64_t string_id(struct pprof *p, const std::string &s)
+{
+    auto it = p->strings.find(s);
+    if (it != p->strings.end())
+    {
+        return it->second;
+    }
+    uint64_t id = p->string_table.size();
+    it = p->strings.emplace(s, id).first;
+    p->string_table.push_back(&it->first);
+    return id;
+}
+
+struct pprof *pprof__new(const char *type, const char *unit, const char *period_type,
+                         const char *period_unit, long long period)
+{
+    struct pprof *p = new pprof;
+
+    /* string 0 is always the empty string */
+    string_id(p, "");
+    p->type = string_id(p, type);
+    p->unit = string_id(p, unit);
+    p->period_type = string_id(p, period_type);
+    p->period_unit = string_id(p, period_unit);
+    p->period = period;
+    p->start_ns = now_ns();
+    return p;
+}
+
+void pprof__free(struct pprof *p)
+{
+    delete p;
+}
+
+/* Digits only, as the line numbers in Lua frame names */
+static bool parse_line(const std::string &s, size_t from, size_t to, int64_t *line)
+{
+    if (from >= to)
+    {
+        return false;
+    }
+    *line = 0;
+    for (size_t i = from; i < to; i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+        {
+            return false;
+        }
+        *line = *line * 10 + s[i] - '0';
+    }
+    return true;
+}
+
+/*
+ * Lua frames are L:chunk:line:name or L:chunk:line; they become functions
+ * of the chunk file, defined on that line.  Chunk names may hold colons.
+ */
+static void lua_function(struct pprof *p, const std::string &frame, pprof_function *f)
+{
+    size_t last = frame.rfind(':'), prev;
+    int64_t line;
+
+    if (last == std::string::npos || last < 2)
+    {
+        return;
+    }
+    if (parse_line(frame, last + 1, frame.size(), &line))
+    {
+        f->filename = string_id(p, frame.substr(2, last - 2));
+        f->line = line;
+        return;
+    }
+    prev = frame.rfind(':', last - 1);
+    if (prev == std::string::npos || prev < 2 || !parse_line(frame, prev + 1, last, &line))
+    {
+        return;
+    }
+    f->name = string_id(p, frame.substr(last + 1));
+    f->filename = string_id(p, frame.substr(2, prev - 2));
+    f->line = line;
+}
+
+static uint64_t frame_id(struct pprof *p, const char *name)
+{
+    auto it = p->frames.find(name);
+    if (it != p->frames.end())
+    {
+        return it->second;
+    }
+    pprof_function f = {};
+    std::string frame(name);
+
+    f.name = f.system_name = string_id(p, frame);
+    if (frame.compare(0, 2, "L:") == 0)
+    {
+        lua_function(p, frame, &f);
+        if (f.filename && p->string_table[f.filename]->compare(0, 1, "@") == 0)
+        {
+            f.filename = string_id(p, p->string_table[f.filename]->substr(1));
+        }
+    }
+    p->functions.push_back(f);
+    /* ids start at 1, 0 means none */
+    uint64_t id = p->functions.size();
+    p->frames.emplace(frame, id);
+    return id;
+}
+
+int pprof__add_stack(struct pprof *p, const char *const *frames, int nr_frames,
+                     unsigned long long value)
+{
+    std::string locations;
+
+    for (int i = nr_frames - 1; i >= 0; i--)
+    {
+        put_varint(locations, frame_id(p, frames[i]));
+    }
+    p->samples[locations] += value;
+    return 0;
+}
+
+static void encode(const struct pprof *p, std::string &out)
+{
+    std::string msg, sub;
+
+    put_field(msg, VALUE_TYPE_TYPE, p->type);
+    put_field(msg, VALUE_TYPE_UNIT, p->unit);
+    put_message(out, PROFILE_SAMPLE_TYPE, msg);
+
+    for (const auto &s : p->samples)
+    {
+        msg.clear();
+        put_message(msg, SAMPLE_LOCATION_ID, s.first);
+        sub.clear();
+        put_varint(sub, s.second);
+        put_message(msg, SAMPLE_VALUE, sub);
+        put_message(out, PROFILE_SAMPLE, msg);
+    }
+
+    for (size_t i = 0; i < p->functions.size(); i++)
+    {
+        const pprof_function &f = p->functions[i];
+
+        sub.clear();
+        put_field(sub, LINE_FUNCTION_ID, i + 1);
+        if (f.line)
+        {
+            put_field(sub, LINE_LINE, f.line);
+        }
+        msg.clear();
+        put_field(msg, LOCATION_ID, i + 1);
+        put_message(msg, LOCATION_LINE, sub);
+        put_message(out, PROFILE_LOCATION, msg);
+
+        msg.clear();
+        put_field(msg, FUNCTION_ID, i + 1);
+        put_field(msg, FUNCTION_NAME, f.name);
+        put_field(msg, FUNCTION_SYSTEM_NAME, f.system_name);
+        if (f.filename)
+        {
+            put_field(msg, FUNCTION_FILENAME, f.filename);
+        }
+        if (f.line)
+        {
+            put_field(msg, FUNCTION_START_LINE, f.line);
+        }
+        put_message(out, PROFILE_FUNCTION, msg);
+    }
+
+    for (const std::string *s : p->string_table)
+    {
+        put_message(out, PROFILE_STRING_TABLE, *s);
+    }
+
+    put_field(out, PROFILE_TIME_NANOS, p->start_ns);
+    put_field(out, PROFILE_DURATION_NANOS, now_ns() - p->start_ns);
+    msg.clear();
+    put_field(msg, VALUE_TYPE_TYPE, p->period_type);
+    put_field(msg, VALUE_TYPE_UNIT, p->period_unit);
+    put_message(out, PROFILE_PERIOD_TYPE, msg);
+    put_field(out, PROFILE_PERIOD, p->period);
+    put_field(out, PROFILE_DEFAULT_SAMPLE_TYPE, p->type);
+}
+
+int pprof__write(struct pprof *p, FILE *out)
+{
+    std::string buf;
+    unsigned char chunk[16384];
+    z_stream zs = {};
+    int ret;
+
+    encode(p, buf);
+    /* 16 + the window bits asks for a gzip header */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+    zs.next_in = (Bytef *)buf.data();
+    zs.avail_in = buf.size();
+    do
+    {
+        zs.next_out = chunk;
+        zs.avail_out = sizeof(chunk);
+        ret = deflate(&zs, Z_FINISH);
+        if (ret == Z_STREAM_ERROR ||
+            fwrite(chunk, 1, sizeof(chunk) - zs.avail_out, out) != sizeof(chunk) - zs.avail_out)
+        {
+            deflateEnd(&zs);
+            return -1;
+        }
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&zs);
+    return fflush(out) ? -1 : 0;
+}
@@ -0,0 +1,31 @@
+#ifndef PPROF_H
+#define PPROF_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /*
+     * A profile in the profile.proto format of pprof, with one value per
+     * sample.  Every distinct frame name is one function and one location.
+     */
+    struct pprof;
+
+    /* type and unit name the sample value, e.g. "alloc_space" and "bytes" */
+    struct pprof *pprof__new(const char *type, const char *unit, const char *period_type,
+                             const char *period_unit, long long period);
+    void pprof__free(struct pprof *p);
+    /* Add one aggregated stack, root frame first */
+    int pprof__add_stack(struct pprof *p, const char *const *frames, int nr_frames,
+                         unsigned long long value);
+    /* Write the gzip compressed profile, as read by `go tool pprof` */
+    int pprof__write(struct pprof *p, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,8 @@
 #include "lua_state.h"
 #include "profile.h"
 #include "maps.bpf.h"
+#include "bits.bpf.h"
+#include "ngx_types.h"
 
 const volatile bool kernel_stacks_only = false;
 const volatile bool user_stacks_only = false;
@@ -13,6 +15,19 @@ const volatile pid_t targ_tid = -1;
 const volatile __u64 targ_ns_dev = 0;
 const volatile __u64 targ_ns_ino = 0;
 const volatile __u64 stack_depth_limit = 0;
+const volatile __u64 stall_threshold_ns = 0;
+const volatile bool ssl_handshakes_only = false;
+const volatile bool ipc_mode = false;
+const volatile bool multi_event = false;
+const volatile bool filter_cgroups = false;
+const volatile bool filter_tgids = false;
+const volatile pid_t targ_master = -1;
+const volatile char targ_comm[TASK_COMM_LEN] = {};
+const volatile bool own_stack_table = false;
+const volatile __u32 stack_table_mask = 0;
+const volatile __u32 own_stack_depth = 0;
+const volatile bool dwarf_unwind = false;
+const volatile __u64 alloc_sample_bytes = 0;
 
 struct
 {
@@ -20,6 +35,36 @@ struct
 	__type(key, u32);
 } stackmap SEC(".maps");
 
+struct stack_buf
+{
+	__u64 ips[MAX_STACK_FRAMES];
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct stack_buf);
+} stack_bufs SEC(".maps");
+
+// stacks by id with own_stack_table, laid out like stackmap
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, MAX_STACK_FRAMES * sizeof(u64));
+	__uint(max_entries, 1);
+} stack_dedup SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct stack_stats);
+} stack_stats SEC(".maps");
+
 struct
 {
 	__uint(type, BPF_MAP_TYPE_HASH);
@@ -30,6 +75,41 @@ struct
 
 #define MAX_ENTRIES 10240
 
+// cgroup ids to profile, with filter_cgroups
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_CGROUPS);
+	__type(key, u64);
+	__type(value, u8);
+} cgroup_filter SEC(".maps");
+
+// processes to profile, with filter_tgids
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TARGETS);
+	__type(key, u32);
+	__type(value, u8);
+} targ_tgids SEC(".maps");
+
+// .eh_frame rows of the binaries of the target processes, with dwarf_unwind
+struct
+{
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct unwind_row);
+} unwind_rows SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TARGETS);
+	__type(key, u32);
+	__type(value, struct unwind_proc);
+} unwind_procs SEC(".maps");
+
 // for collecting lua stack trace function name
 // and pass the pointer of Lua_state to perf event
 struct
@@ -49,6 +129,162 @@ struct
 	__uint(value_size, sizeof(__u32));
 } lua_event_output SEC(".maps");
 
+// the running ngx_process_events_and_timers() call of each worker thread
+struct loop_iter
+{
+	__u64 start;
+	int user_stack_id;
+	int kern_stack_id;
+	bool sampled;
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct loop_iter);
+} loop_iters SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, sizeof(__u32));
+} stall_output SEC(".maps");
+
+// busy time of every event loop iteration, in usecs
+__u32 loop_hist[MAX_SLOTS] = {};
+
+// instructions counter of every CPU, read at each cycles sample in --ipc mode
+struct
+{
+	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u32));
+} ipc_counters SEC(".maps");
+
+// counter values at the previous sample of the CPU
+struct
+{
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct ipc_value);
+} ipc_last SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, struct profile_key_t);
+	__type(value, struct ipc_value);
+} ipc_counts SEC(".maps");
+
+// threads inside SSL_do_handshake()
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, __u8);
+} ssl_threads SEC(".maps");
+
+// a thread of the target waiting on a run queue, keyed by its global tid
+struct rq_wait
+{
+	__u64 ts;
+	__u32 pid;
+	__s32 user_stack_id;
+	__u32 preempted;
+	__u64 cgroup_id;
+	char name[TASK_COMM_LEN];
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct rq_wait);
+} rq_waits SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct rq_hist);
+} rq_hists SEC(".maps");
+
+// shared dict zone of the ngx_http_lua_ffi_shdict_*() call running on a thread
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, __u64);
+} shdict_zones SEC(".maps");
+
+struct lock_wait
+{
+	__u64 mtx;
+	__u64 start;
+	__u64 zone;
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct lock_wait);
+} lock_waits SEC(".maps");
+
+struct lock_hold
+{
+	__u64 mtx;
+	__u64 start;
+	struct zone_key zone;
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct lock_hold);
+} lock_holds SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+	__type(key, struct zone_key);
+	__type(value, struct zone_stats);
+} zone_stats SEC(".maps");
+
+// bytes every thread still allocates before its next sample, in --alloc mode
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, __s64);
+} alloc_countdown SEC(".maps");
+
+// sampled allocations of every stack, counts holds their bytes
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, struct profile_key_t);
+	__type(value, __u64);
+} alloc_samples SEC(".maps");
+
+// an uncontended ngx_shmtx_lock() plus the uprobe overhead stays below this
+#define LOCK_MIN_WAIT_NS 5000
+
 /*
  * If PAGE_OFFSET macro is not available in vmlinux.h, determine ip whose MSB
  * (Most Significant Bit) is 1 as the kernel address.
@@ -68,13 +304,40 @@ static __always_inline bool is_kernel_addr(u64 addr)
 }
 #endif /* __TARGET_ARCH_arm64 || __TARGET_ARCH_x86 */
 
-static inline int lua_get_funcdata(struct bpf_perf_event_data *ctx, cTValue *frame, struct lua_stack_event *eventp, int level)
+/*
+ * An interpreted FFI call runs the fast function ffi.meta.__call with the
+ * cdata being called as its first argument; the payload of a cdata of
+ * function pointer type is the address of the C function.
+ */
+static __always_inline void *lua_get_ffi_func(cTValue *frame)
+{
+#if LJ_GC64
+	TValue arg;
+	void *func = NULL;
+
+	if (bpf_probe_read_user(&arg, sizeof(arg), frame + 1))
+		return NULL;
+	if ((uint32_t)(arg.it64 >> 47) != LJ_TCDATA)
+		return NULL;
+	bpf_probe_read_user(&func, sizeof(func), cdataptr((GCcdata *)(arg.u64 & LJ_GCVMASK)));
+	return func;
+#else
+	return NULL;
+#endif
+}
+
+static inline int lua_get_funcdata(void *ctx, cTValue *frame, struct lua_stack_event *eventp, int level)
 {
 	if (!frame)
 		return -1;
 	GCfunc *fn = frame_func(frame);
 	if (!fn)
 		return -1;
+	eventp->ffi_func = NULL;
+	// user space names the function and finds the caller's current line from
+	// the return pc into the caller, see lj_debug_funcname()
+	cTValue *f = frame_isvarg(frame) ? frame_prevd(frame) : frame;
+	eventp->frame_link = frame_ftsz(f);
 	if (isluafunc(fn))
 	{
 		eventp->type = FUNC_TYPE_LUA;
@@ -82,6 +345,7 @@ static inline int lua_get_funcdata(struct bpf_perf_event_data *ctx, cTValue *fra
 		if (!pt)
 			return -1;
 		eventp->ffid = BPF_PROBE_READ_USER(pt, firstline);
+		eventp->funcp = pt;
 		GCstr *name = proto_chunkname(pt); /* GCstr *name */
 		const char *src = strdata(name);
 		if (!src)
@@ -98,13 +362,102 @@ static inline int lua_get_funcdata(struct bpf_perf_event_data *ctx, cTValue *fra
 	{
 		eventp->type = FUNC_TYPE_F;
 		eventp->ffid = BPF_PROBE_READ_USER(fn, c.ffid);
+		eventp->funcp = BPF_PROBE_READ_USER(fn, c.f);
+		eventp->ffi_func = lua_get_ffi_func(frame);
 	}
 	eventp->level = level;
 	bpf_perf_event_output(ctx, &lua_event_output, BPF_F_CURRENT_CPU, eventp, sizeof(*eventp));
 	return 0;
 }
 
-static int fix_lua_stack(struct bpf_perf_event_data *ctx, __u32 tid, int stack_id)
+#if defined(__TARGET_ARCH_x86)
+// C frame that lj_vm_resume/pcall/call/cpcall push on x86_64, see lj_frame.h
+#define CFRAME_OFS_PREV (4 * 8)
+#define CFRAME_OFS_RBP (10 * 8)
+#define CFRAME_OFS_RET (11 * 8)
+#define CFRAME_RAWMASK (~3ULL)
+
+/*
+ * The native frames around the VM entry of a segment of the Lua stack: the
+ * return address into lua_pcall & co, and the return address an rbp walk
+ * finds next, as the VM keeps the rbp of its caller.
+ */
+static __always_inline void read_lua_segment(struct lua_stack_event *eventp, __u64 cframe)
+{
+	__u64 rbp = 0;
+
+	eventp->seg_ret = 0;
+	eventp->seg_fp_ret = 0;
+	if (!cframe)
+		return;
+	bpf_probe_read_user(&eventp->seg_ret, sizeof(eventp->seg_ret), (void *)(cframe + CFRAME_OFS_RET));
+	if (!bpf_probe_read_user(&rbp, sizeof(rbp), (void *)(cframe + CFRAME_OFS_RBP)) && rbp)
+		bpf_probe_read_user(&eventp->seg_fp_ret, sizeof(eventp->seg_fp_ret), (void *)(rbp + 8));
+}
+
+static __always_inline __u64 prev_cframe(__u64 cframe)
+{
+	__u64 prev = 0;
+
+	if (cframe)
+		bpf_probe_read_user(&prev, sizeof(prev), (void *)(cframe + CFRAME_OFS_PREV));
+	return prev & CFRAME_RAWMASK;
+}
+#else
+#define CFRAME_RAWMASK (~3ULL)
+
+static __always_inline void read_lua_segment(struct lua_stack_event *eventp, __u64 cframe)
+{
+	eventp->seg_ret = 0;
+	eventp->seg_fp_ret = 0;
+}
+
+static __always_inline __u64 prev_cframe(__u64 cframe)
+{
+	return 0;
+}
+#endif /* __TARGET_ARCH_x86 */
+
+/*
+ * The functions and links of the frames fix_lua_stack() walks, so samples
+ * that reach the same native stack from different Lua code are told apart.
+ */
+static __u64 lua_stack_hash(__u32 tid)
+{
+	struct lua_stack_event *eventp;
+	cTValue *frame, *bot;
+	GCfunc *fn;
+	__u64 hash = 0xcbf29ce484222325ULL, funcp;
+
+	eventp = bpf_map_lookup_elem(&lua_events, &tid);
+	if (!eventp || !eventp->L)
+		return 0;
+	lua_State *L = eventp->L;
+
+	bot = tvref(BPF_PROBE_READ_USER(L, stack)) + LJ_FR2;
+	frame = BPF_PROBE_READ_USER(L, base) - 1;
+	for (int i = 0; i < stack_depth_limit && frame > bot; i++)
+	{
+		fn = frame_func(frame);
+		if (!fn)
+			break;
+		// closures of one prototype are the same Lua function
+		funcp = isluafunc(fn) ? (__u64)funcproto(fn) : (__u64)BPF_PROBE_READ_USER(fn, c.f);
+		hash = (hash ^ funcp) * 0x100000001b3ULL;
+		hash = (hash ^ frame_ftsz(frame)) * 0x100000001b3ULL;
+		if (frame_islua(frame))
+			frame = frame_prevl(frame);
+		else
+			frame = frame_prevd(frame);
+	}
+	return hash;
+}
+
+/*
+ * report_top keeps level 0 if it is a Lua function, as for allocations made
+ * by the bytecode of the running function itself.
+ */
+static int fix_lua_stack(void *ctx, __u32 tid, int stack_id, __u64 lua_hash, bool report_top)
 {
 	if (stack_id == 0)
 	{
@@ -117,6 +470,7 @@ static int fix_lua_stack(struct bpf_perf_event_data *ctx, __u32 tid, int stack_i
 		return 0;
 
 	eventp->user_stack_id = stack_id;
+	eventp->lua_stack_hash = lua_hash;
 	lua_State *L = eventp->L;
 	if (!L)
 		return 0;
@@ -128,6 +482,18 @@ static int fix_lua_stack(struct bpf_perf_event_data *ctx, __u32 tid, int stack_i
 	cTValue *frame, *nextframe, *bot = tvref(BPF_PROBE_READ_USER(L, stack)) + LJ_FR2;
 	int i = 0;
 	frame = nextframe = BPF_PROBE_READ_USER(L, base) - 1;
+	// frames called from C through lua_pcall/lua_call start a new segment
+	__u64 cframe = (__u64)BPF_PROBE_READ_USER(L, cframe) & CFRAME_RAWMASK;
+	eventp->segment = 0;
+	read_lua_segment(eventp, cframe);
+	// the link of the skipped running function holds the pc of its caller
+	eventp->top_link = frame_ftsz(frame);
+	if (report_top && frame > bot && isluafunc(frame_func(frame)))
+	{
+		// its own pc is not in the frame, so its line is unknown
+		level = 0;
+		eventp->top_link = 0;
+	}
 	/* Traverse frames backwards. */
 	// for the ebpf verifier insns (limit 1000000), we need to limit the max loop times to 13
 	for (; i < stack_depth_limit && frame > bot; i++)
@@ -136,6 +502,12 @@ static int fix_lua_stack(struct bpf_perf_event_data *ctx, __u32 tid, int stack_i
 		{
 			level++; /* Skip dummy frames. See lj_err_optype_call(). */
 		}
+		// level 0 is skipped, unless it is an FFI call running in C
+		if (i == 0 && level == 1 && isffunc(frame_func(frame)) && lua_get_ffi_func(frame))
+		{
+			if (lua_get_funcdata(ctx, frame, eventp, count) == 0)
+				count++;
+		}
 		if (level-- == 0)
 		{
 			level++;
@@ -156,6 +528,13 @@ static int fix_lua_stack(struct bpf_perf_event_data *ctx, __u32 tid, int stack_i
 		{
 			if (frame_isvarg(frame))
 				level++; /* Skip vararg pseudo-frame. */
+			// FRAME_C and FRAME_CP
+			if (frame_isc(frame))
+			{
+				eventp->segment++;
+				cframe = prev_cframe(cframe);
+				read_lua_segment(eventp, cframe);
+			}
 			frame = frame_prevd(frame);
 		}
 	}
@@ -177,81 +556,390 @@ static long get_current_pid_tgid(__u32 *pid, __u32 *tid)
 	if (ret)
 		return ret;
 
-	*pid = ns.pid;
-	*tid = ns.tgid;
+	*pid = ns.tgid;
+	*tid = ns.pid;
 	return 0;
 }
 
-SEC("perf_event")
-int do_perf_event(struct bpf_perf_event_data *ctx)
+#define STACK_PROBES 4
+
+static __always_inline bool same_stack(const __u64 *a, const __u64 *b)
 {
-	__u32 pid = 0, tid = 0;
-	if (get_current_pid_tgid(&pid, &tid))
-		return 0;
+	for (int i = 0; i < MAX_STACK_FRAMES && i < own_stack_depth; i++)
+	{
+		if (a[i] != b[i])
+			return false;
+	}
+	return true;
+}
 
-	__u64 *valp;
-	static const __u64 zero;
-	struct profile_key_t key = {};
+#define UNWIND_SEARCH_STEPS 24
 
-	if (!include_idle && tid == 0)
-		return 0;
+static __always_inline struct unwind_mapping *find_mapping(struct unwind_proc *proc, __u64 pc)
+{
+	for (int i = 0; i < MAX_UNWIND_MAPPINGS && i < proc->nr_mappings; i++)
+	{
+		if (pc >= proc->mappings[i].start && pc < proc->mappings[i].end)
+			return &proc->mappings[i];
+	}
+	return NULL;
+}
 
-	if (targ_pid != -1 && targ_pid != pid)
-		return 0;
-	if (targ_tid != -1 && targ_tid != tid)
-		return 0;
+/* The last row of the mapping of pc at or before it, by binary search */
+static __always_inline struct unwind_row *find_row(struct unwind_proc *proc, __u64 pc)
+{
+	struct unwind_mapping *m;
+	struct unwind_row *row;
+	__u32 lo, hi, mid;
 
-	key.pid = pid;
-	bpf_get_current_comm(&key.name, sizeof(key.name));
+	m = find_mapping(proc, pc);
+	if (!m || !m->nr_rows)
+		return NULL;
+	pc -= m->bias;
+	lo = m->row_start;
+	hi = m->row_start + m->nr_rows;
+	for (int i = 0; i < UNWIND_SEARCH_STEPS && hi - lo > 1; i++)
+	{
+		mid = lo + (hi - lo) / 2;
+		row = bpf_map_lookup_elem(&unwind_rows, &mid);
+		if (!row)
+			return NULL;
+		if (row->pc <= pc)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	row = bpf_map_lookup_elem(&unwind_rows, &lo);
+	if (!row || row->pc > pc)
+		return NULL;
+	return row;
+}
 
-	if (user_stacks_only)
-		key.kern_stack_id = -1;
-	else
-		key.kern_stack_id = bpf_get_stackid(&ctx->regs, &stackmap, 0);
+#if defined(__TARGET_ARCH_x86)
+/*
+ * bpf_get_stack() of the user stack for binaries built without frame
+ * pointers: every frame is unwound with the .eh_frame row of its pc, stored
+ * by user space for the current process.  -ENOENT if it has no rows.
+ */
+static __always_inline long dwarf_get_stack(struct stack_buf *buf)
+{
+	struct task_struct *task = bpf_get_current_task_btf();
+	struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(task);
+	struct unwind_proc *proc;
+	struct unwind_row *row;
+	__u64 pc, sp, bp, cfa;
+	__u32 pid, tid;
+	int n = 0;
 
-	if (kernel_stacks_only)
-		key.user_stack_id = -1;
-	else
-		key.user_stack_id = bpf_get_stackid(&ctx->regs, &stackmap, BPF_F_USER_STACK);
+	if (get_current_pid_tgid(&pid, &tid))
+		return -ESRCH;
+	proc = bpf_map_lookup_elem(&unwind_procs, &pid);
+	if (!proc)
+		return -ENOENT;
 
-	if (key.kern_stack_id >= 0)
+	pc = BPF_CORE_READ(regs, ip);
+	sp = BPF_CORE_READ(regs, sp);
+	bp = BPF_CORE_READ(regs, bp);
+	for (int i = 0; i < MAX_UNWIND_FRAMES && i < own_stack_depth; i++)
 	{
-		// populate extras to fix the kernel stack
-		__u64 ip = PT_REGS_IP(&ctx->regs);
+		buf->ips[i] = pc;
+		n = i + 1;
+		// a return address may be the first byte of the next function
+		row = find_row(proc, i ? pc - 1 : pc);
+		if (!row || row->cfa_type == UNWIND_CFA_NONE || row->cfa_type == UNWIND_CFA_END)
+			break;
+		if (row->cfa_type == UNWIND_CFA_RSP)
+			cfa = sp + row->cfa_offset;
+		else if (row->cfa_type == UNWIND_CFA_RBP)
+			cfa = bp + row->cfa_offset;
+		else
+			cfa = sp + ((pc & 15) >= row->cfa_offset ? 16 : 8);
+		if (row->rbp_offset &&
+			bpf_probe_read_user(&bp, sizeof(bp), (void *)(cfa + row->rbp_offset)))
+			break;
+		if (bpf_probe_read_user(&pc, sizeof(pc), (void *)(cfa - 8)) || !pc)
+			break;
+		sp = cfa;
+	}
+	// like bpf_get_stack(), the unused part of the buffer is zeroed
+	for (int i = 0; i < MAX_STACK_FRAMES && i < own_stack_depth; i++)
+	{
+		if (i >= n)
+			buf->ips[i] = 0;
+	}
+	return n * sizeof(__u64);
+}
+#else
+// the rows describe x86_64 registers, user space rejects --dwarf elsewhere
+static __always_inline long dwarf_get_stack(struct stack_buf *buf)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* __TARGET_ARCH_x86 */
 
-		if (is_kernel_addr(ip))
+/*
+ * bpf_get_stackid() on our own table: the FNV-1a hash of the stack picks a
+ * slot and the next STACK_PROBES - 1 slots are tried after it, so stacks
+ * whose hashes share a bucket both get an id instead of one being dropped.
+ */
+static __always_inline long dedup_stackid(void *ctx, __u64 flags)
+{
+	__u64 hash = 14695981039346656037ULL;
+	struct stack_buf *buf;
+	__u32 zero = 0, id;
+	__u64 *slot;
+	long len = -ENOENT;
+
+	buf = bpf_map_lookup_elem(&stack_bufs, &zero);
+	if (!buf)
+		return -ENOMEM;
+	if (dwarf_unwind && (flags & BPF_F_USER_STACK))
+		len = dwarf_get_stack(buf);
+	// processes started later have no rows, they keep frame pointer stacks
+	if (len == -ENOENT)
+		len = bpf_get_stack(ctx, buf->ips, own_stack_depth * sizeof(__u64), flags);
+	if (len <= 0)
+		return len ? len : -EFAULT;
+	for (int i = 0; i < MAX_STACK_FRAMES && i < own_stack_depth; i++)
+	{
+		hash ^= buf->ips[i];
+		hash *= 1099511628211ULL;
+	}
+
+	for (int p = 0; p < STACK_PROBES; p++)
+	{
+		id = (hash + p) & stack_table_mask;
+		slot = bpf_map_lookup_elem(&stack_dedup, &id);
+		if (!slot)
 		{
-			key.kernel_ip = ip;
+			if (!bpf_map_update_elem(&stack_dedup, &id, buf->ips, BPF_NOEXIST))
+				return id;
+			// another CPU stored a stack there first
+			slot = bpf_map_lookup_elem(&stack_dedup, &id);
+			if (!slot)
+				continue;
 		}
+		if (same_stack(slot, buf->ips))
+			return id;
 	}
+	return -EEXIST;
+}
 
-	valp = bpf_map_lookup_or_try_init(&counts, &key, &zero);
-	if (valp)
-		__sync_fetch_and_add(valp, 1);
+/* bpf_get_stackid() on stackmap or our own table, counted in stack_stats */
+static __always_inline long get_stackid(void *ctx, __u64 flags)
+{
+	struct stack_stats *stats;
+	__u32 zero = 0;
+	long id;
 
-	if (!disable_lua_user_trace && (!valp || *valp <= 1))
+	if (own_stack_table)
+		id = dedup_stackid(ctx, flags);
+	else
+		id = bpf_get_stackid(ctx, &stackmap, flags);
+
+	stats = bpf_map_lookup_elem(&stack_stats, &zero);
+	if (stats)
 	{
-		// only get lua stack the first time we found a new stack id
-		fix_lua_stack(ctx, tid, key.user_stack_id);
+		stats->stacks++;
+		if (id == -EEXIST)
+			stats->collisions++;
+		else if (id < 0)
+			stats->failures++;
 	}
-	return 0;
+	return id;
 }
 
-static int probe_entry_lua_cancel(struct pt_regs *ctx)
+static __always_inline bool pid_is_target(__u32 pid)
 {
-	if (!PT_REGS_PARM2(ctx))
-		return 0;
-	if (!PT_REGS_PARM4(ctx))
-		return 0;
-
-	__u32 pid = 0, tid = 0;
-	if (get_current_pid_tgid(&pid, &tid))
-		return 0;
-
 	if (targ_pid != -1 && targ_pid != pid)
-		return 0;
-	bpf_map_delete_elem(&lua_events, &tid);
-	return 0;
+		return false;
+	return !filter_tgids || bpf_map_lookup_elem(&targ_tgids, &pid);
+}
+
+static __always_inline bool cgroup_is_target(__u64 cgroup_id)
+{
+	return !filter_cgroups || bpf_map_lookup_elem(&cgroup_filter, &cgroup_id);
+}
+
+static __always_inline __u64 get_task_cgroup_id(struct task_struct *task)
+{
+	return BPF_CORE_READ(task, cgroups, dfl_cgrp, kn, id);
+}
+
+#define MAX_PID_NS_LEVEL 8
+
+/*
+ * get_current_pid_tgid() for a task that is not current, e.g. the one being
+ * woken up: pid and tid as seen from the target pid namespace.
+ */
+static __always_inline long get_task_pid_tgid(struct task_struct *task, __u32 *pid, __u32 *tid)
+{
+	struct pid *tp, *gp;
+	struct upid upid;
+	unsigned int level;
+
+	if (targ_ns_dev == 0 && targ_ns_ino == 0)
+	{
+		*pid = BPF_CORE_READ(task, tgid);
+		*tid = BPF_CORE_READ(task, pid);
+		return 0;
+	}
+
+	tp = BPF_CORE_READ(task, thread_pid);
+	gp = BPF_CORE_READ(task, group_leader, thread_pid);
+	level = BPF_CORE_READ(tp, level);
+	for (int i = 0; i < MAX_PID_NS_LEVEL && i <= level; i++)
+	{
+		bpf_core_read(&upid, sizeof(upid), &tp->numbers[i]);
+		if (BPF_CORE_READ(upid.ns, ns.inum) != targ_ns_ino)
+			continue;
+		*tid = upid.nr;
+		bpf_core_read(&upid, sizeof(upid), &gp->numbers[i]);
+		*pid = upid.nr;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Cycles and instructions since the previous sample of this CPU.  The window
+ * can start in another task, so the last values are updated before any
+ * filtering; at a high enough frequency it rarely does.
+ */
+static __always_inline void read_ipc_delta(struct bpf_perf_event_data *ctx, struct ipc_value *delta)
+{
+	struct bpf_perf_event_value cycles, insns;
+	struct ipc_value *last;
+	__u32 zero = 0;
+
+	last = bpf_map_lookup_elem(&ipc_last, &zero);
+	if (!last)
+		return;
+	if (bpf_perf_prog_read_value(ctx, &cycles, sizeof(cycles)) ||
+		bpf_perf_event_read_value(&ipc_counters, BPF_F_CURRENT_CPU, &insns, sizeof(insns)))
+		return;
+	if (last->cycles && cycles.counter > last->cycles && insns.counter > last->instructions)
+	{
+		delta->cycles = cycles.counter - last->cycles;
+		delta->instructions = insns.counter - last->instructions;
+	}
+	last->cycles = cycles.counter;
+	last->instructions = insns.counter;
+}
+
+SEC("perf_event")
+int do_perf_event(struct bpf_perf_event_data *ctx)
+{
+	struct ipc_value ipc = {};
+	__u32 pid = 0, tid = 0;
+	__u64 cgroup_id;
+
+	if (ipc_mode)
+		read_ipc_delta(ctx, &ipc);
+	// other containers cost one map lookup
+	cgroup_id = bpf_get_current_cgroup_id();
+	if (!cgroup_is_target(cgroup_id))
+		return 0;
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+
+	__u64 *valp;
+	static const __u64 zero;
+	struct profile_key_t key = {};
+
+	if (!include_idle && tid == 0)
+		return 0;
+
+	if (!pid_is_target(pid))
+		return 0;
+	if (targ_tid != -1 && targ_tid != tid)
+		return 0;
+
+	// in stall mode only sample threads stuck in one event loop iteration
+	struct loop_iter *iter = NULL;
+	if (stall_threshold_ns)
+	{
+		iter = bpf_map_lookup_elem(&loop_iters, &tid);
+		if (!iter || bpf_ktime_get_ns() - iter->start < stall_threshold_ns)
+			return 0;
+	}
+	if (ssl_handshakes_only && !bpf_map_lookup_elem(&ssl_threads, &tid))
+		return 0;
+
+	key.pid = pid;
+	key.cgroup_id = cgroup_id;
+	bpf_get_current_comm(&key.name, sizeof(key.name));
+	// user space sets the event index as the attach cookie
+	if (multi_event && bpf_core_enum_value_exists(enum bpf_func_id, BPF_FUNC_get_attach_cookie))
+		key.event = bpf_get_attach_cookie(ctx);
+
+	if (user_stacks_only)
+		key.kern_stack_id = -1;
+	else
+		key.kern_stack_id = get_stackid(&ctx->regs, 0);
+
+	if (kernel_stacks_only)
+		key.user_stack_id = -1;
+	else
+		key.user_stack_id = get_stackid(&ctx->regs, BPF_F_USER_STACK);
+
+	if (key.kern_stack_id >= 0)
+	{
+		// populate extras to fix the kernel stack
+		__u64 ip = PT_REGS_IP(&ctx->regs);
+
+		if (is_kernel_addr(ip))
+		{
+			key.kernel_ip = ip;
+		}
+	}
+
+	if (iter && !iter->sampled)
+	{
+		iter->user_stack_id = key.user_stack_id;
+		iter->kern_stack_id = key.kern_stack_id;
+		iter->sampled = true;
+	}
+
+	valp = bpf_map_lookup_or_try_init(&counts, &key, &zero);
+	if (valp)
+		__sync_fetch_and_add(valp, 1);
+
+	if (ipc.cycles)
+	{
+		static const struct ipc_value zero_ipc;
+		struct ipc_value *ipcp = bpf_map_lookup_or_try_init(&ipc_counts, &key, &zero_ipc);
+
+		if (ipcp)
+		{
+			__sync_fetch_and_add(&ipcp->cycles, ipc.cycles);
+			__sync_fetch_and_add(&ipcp->instructions, ipc.instructions);
+		}
+	}
+
+	if (!disable_lua_user_trace && (!valp || *valp <= 1))
+	{
+		// only get lua stack the first time we found a new stack id
+		fix_lua_stack(ctx, tid, key.user_stack_id, 0, false);
+	}
+	return 0;
+}
+
+static int probe_entry_lua_cancel(struct pt_regs *ctx)
+{
+	if (!PT_REGS_PARM2(ctx))
+		return 0;
+	if (!PT_REGS_PARM4(ctx))
+		return 0;
+
+	__u32 pid = 0, tid = 0;
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+
+	if (!pid_is_target(pid))
+		return 0;
+	bpf_map_delete_elem(&lua_events, &tid);
+	return 0;
 }
 
 SEC("kprobe/handle_entry_lua_cancel")
@@ -271,7 +959,7 @@ static int probe_entry_lua(struct pt_regs *ctx)
 
 	struct lua_stack_event event = {};
 
-	if (targ_pid != -1 && targ_pid != pid)
+	if (!pid_is_target(pid))
 		return 0;
 
 	event.pid = pid;
@@ -286,4 +974,599 @@ int handle_entry_lua(struct pt_regs *ctx)
 	return probe_entry_lua(ctx);
 }
 
+static int probe_loop_entry(struct pt_regs *ctx)
+{
+	struct loop_iter iter = {};
+	__u32 pid = 0, tid = 0;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	if (!pid_is_target(pid))
+		return 0;
+
+	iter.start = bpf_ktime_get_ns();
+	bpf_map_update_elem(&loop_iters, &tid, &iter, BPF_ANY);
+	return 0;
+}
+
+/*
+ * The iteration blocks in epoll_wait() until there is work, so only the
+ * time after the wakeup counts towards a stall.
+ */
+static int probe_epoll_exit(void)
+{
+	struct loop_iter *iter;
+	__u32 pid = 0, tid = 0;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	iter = bpf_map_lookup_elem(&loop_iters, &tid);
+	if (iter)
+		iter->start = bpf_ktime_get_ns();
+	return 0;
+}
+
+static int probe_loop_return(struct pt_regs *ctx)
+{
+	struct stall_event event = {};
+	struct loop_iter *iter;
+	__u32 pid = 0, tid = 0;
+	__u64 delta;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	iter = bpf_map_lookup_elem(&loop_iters, &tid);
+	if (!iter)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - iter->start;
+	add_hist(loop_hist, delta / 1000);
+
+	if (delta >= stall_threshold_ns)
+	{
+		event.pid = pid;
+		event.tid = tid;
+		event.duration_ns = delta;
+		event.user_stack_id = iter->user_stack_id;
+		event.kern_stack_id = iter->kern_stack_id;
+		event.sampled = iter->sampled;
+		bpf_get_current_comm(&event.name, sizeof(event.name));
+		bpf_perf_event_output(ctx, &stall_output, BPF_F_CURRENT_CPU, &event, sizeof(event));
+	}
+	bpf_map_delete_elem(&loop_iters, &tid);
+	return 0;
+}
+
+SEC("kprobe/handle_loop_entry")
+int handle_loop_entry(struct pt_regs *ctx)
+{
+	return probe_loop_entry(ctx);
+}
+
+SEC("kprobe/handle_loop_return")
+int handle_loop_return(struct pt_regs *ctx)
+{
+	return probe_loop_return(ctx);
+}
+
+SEC("tracepoint/syscalls/sys_exit_epoll_wait")
+int handle_epoll_wait_exit(void *ctx)
+{
+	return probe_epoll_exit();
+}
+
+SEC("tracepoint/syscalls/sys_exit_epoll_pwait")
+int handle_epoll_pwait_exit(void *ctx)
+{
+	return probe_epoll_exit();
+}
+
+static int probe_ssl_entry(void)
+{
+	__u32 pid = 0, tid = 0;
+	__u8 one = 1;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	if (!pid_is_target(pid))
+		return 0;
+	bpf_map_update_elem(&ssl_threads, &tid, &one, BPF_ANY);
+	return 0;
+}
+
+static int probe_ssl_return(void)
+{
+	__u32 pid = 0, tid = 0;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	bpf_map_delete_elem(&ssl_threads, &tid);
+	return 0;
+}
+
+SEC("kprobe/handle_ssl_entry")
+int handle_ssl_entry(struct pt_regs *ctx)
+{
+	return probe_ssl_entry();
+}
+
+SEC("kprobe/handle_ssl_return")
+int handle_ssl_return(struct pt_regs *ctx)
+{
+	return probe_ssl_return();
+}
+
+#define TASK_RUNNING 0
+
+/* task_struct::state was renamed to __state in 5.14 */
+struct task_struct___x
+{
+	unsigned int __state;
+} __attribute__((preserve_access_index));
+
+static __always_inline long get_task_state(struct task_struct *task)
+{
+	struct task_struct___x *t = (void *)task;
+
+	if (bpf_core_field_exists(t->__state))
+		return BPF_CORE_READ(t, __state);
+	return BPF_CORE_READ(task, state);
+}
+
+static __always_inline bool rq_is_target(struct task_struct *task, __u32 *pid, __u32 *tid)
+{
+	if (get_task_pid_tgid(task, pid, tid))
+		return false;
+	if (!pid_is_target(*pid))
+		return false;
+	if (targ_tid != -1 && targ_tid != *tid)
+		return false;
+	return cgroup_is_target(get_task_cgroup_id(task));
+}
+
+static __always_inline void rq_enqueue(struct task_struct *task)
+{
+	struct rq_wait wait = {};
+	__u32 pid, tid, gtid;
+
+	if (!rq_is_target(task, &pid, &tid))
+		return;
+	gtid = BPF_CORE_READ(task, pid);
+	wait.ts = bpf_ktime_get_ns();
+	wait.pid = pid;
+	wait.user_stack_id = -1;
+	bpf_map_update_elem(&rq_waits, &gtid, &wait, BPF_ANY);
+}
+
+/* prev is still current: its user stack is the code the preemption interrupted */
+static __always_inline void rq_preempt(void *ctx, struct task_struct *prev)
+{
+	struct profile_key_t key = {};
+	struct rq_wait wait = {};
+	__u32 pid, tid, gtid, lua_pid = 0, lua_tid = 0;
+
+	if (!rq_is_target(prev, &pid, &tid))
+		return;
+	gtid = BPF_CORE_READ(prev, pid);
+	wait.ts = bpf_ktime_get_ns();
+	wait.pid = pid;
+	wait.preempted = 1;
+	wait.user_stack_id = get_stackid(ctx, BPF_F_USER_STACK);
+	wait.cgroup_id = bpf_get_current_cgroup_id();
+	bpf_get_current_comm(&wait.name, sizeof(wait.name));
+	bpf_map_update_elem(&rq_waits, &gtid, &wait, BPF_ANY);
+
+	key.pid = pid;
+	key.cgroup_id = wait.cgroup_id;
+	key.kern_stack_id = -1;
+	key.user_stack_id = wait.user_stack_id;
+	__builtin_memcpy(key.name, wait.name, sizeof(key.name));
+	/* the Lua stack of a stack id is walked once, the first time it is seen */
+	if (!disable_lua_user_trace && !bpf_map_lookup_elem(&counts, &key) &&
+		!get_current_pid_tgid(&lua_pid, &lua_tid))
+		fix_lua_stack(ctx, lua_tid, key.user_stack_id, 0, false);
+}
+
+static __always_inline void rq_dequeue(struct task_struct *next)
+{
+	static const struct rq_hist zero_hist;
+	static const __u64 zero;
+	struct profile_key_t key = {};
+	struct rq_hist *hist;
+	struct rq_wait *wait;
+	__u64 delta, *valp;
+	__u32 gtid = BPF_CORE_READ(next, pid);
+
+	wait = bpf_map_lookup_elem(&rq_waits, &gtid);
+	if (!wait)
+		return;
+	delta = (bpf_ktime_get_ns() - wait->ts) / 1000;
+
+	hist = bpf_map_lookup_or_try_init(&rq_hists, &wait->pid, &zero_hist);
+	if (hist)
+	{
+		add_hist(hist->slots, delta);
+		__sync_fetch_and_add(&hist->waits, 1);
+		__sync_fetch_and_add(&hist->total_us, delta);
+		if (wait->preempted)
+			__sync_fetch_and_add(&hist->preempts, 1);
+	}
+
+	/* a woken up thread was not running anything: only preemptions get a stack */
+	if (wait->preempted)
+	{
+		key.pid = wait->pid;
+		key.cgroup_id = wait->cgroup_id;
+		key.kern_stack_id = -1;
+		key.user_stack_id = wait->user_stack_id;
+		__builtin_memcpy(key.name, wait->name, sizeof(key.name));
+		valp = bpf_map_lookup_or_try_init(&counts, &key, &zero);
+		if (valp)
+			__sync_fetch_and_add(valp, delta);
+	}
+	bpf_map_delete_elem(&rq_waits, &gtid);
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(handle_rq_wakeup, struct task_struct *p)
+{
+	rq_enqueue(p);
+	return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(handle_rq_wakeup_new, struct task_struct *p)
+{
+	rq_enqueue(p);
+	return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_rq_switch, bool preempt, struct task_struct *prev, struct task_struct *next)
+{
+	if (get_task_state(prev) == TASK_RUNNING)
+		rq_preempt(ctx, prev);
+	rq_dequeue(next);
+	return 0;
+}
+
+static __always_inline bool comm_is_target(struct task_struct *task)
+{
+	char comm[TASK_COMM_LEN];
+
+	BPF_CORE_READ_STR_INTO(&comm, task, comm);
+	for (int i = 0; i < TASK_COMM_LEN; i++)
+	{
+		if (comm[i] != targ_comm[i])
+			return false;
+		if (!comm[i])
+			break;
+	}
+	return true;
+}
+
+/* Workers forked by the master, or by any process named targ_comm */
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(handle_target_fork, struct task_struct *parent, struct task_struct *child)
+{
+	__u32 ppid, ptid, pid, tid;
+	struct unwind_proc *proc;
+	__u8 one = 1;
+
+	// new threads share the tgid of their process
+	if (BPF_CORE_READ(child, pid) != BPF_CORE_READ(child, tgid))
+		return 0;
+	if (get_task_pid_tgid(parent, &ppid, &ptid) || get_task_pid_tgid(child, &pid, &tid))
+		return 0;
+	// the child runs the binaries of its parent until it calls exec
+	if (dwarf_unwind && (proc = bpf_map_lookup_elem(&unwind_procs, &ppid)))
+		bpf_map_update_elem(&unwind_procs, &pid, proc, BPF_ANY);
+	if ((targ_master != -1 && ppid == targ_master) || (targ_comm[0] && comm_is_target(child)))
+		bpf_map_update_elem(&targ_tgids, &pid, &one, BPF_ANY);
+	return 0;
+}
+
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(handle_target_exec, struct task_struct *p)
+{
+	__u32 pid, tid;
+	__u8 one = 1;
+
+	if (get_task_pid_tgid(p, &pid, &tid))
+		return 0;
+	// the rows were of the binaries of the old image
+	if (dwarf_unwind)
+		bpf_map_delete_elem(&unwind_procs, &pid);
+	if (!targ_comm[0])
+		return 0;
+	if (comm_is_target(p))
+		bpf_map_update_elem(&targ_tgids, &pid, &one, BPF_ANY);
+	else
+		bpf_map_delete_elem(&targ_tgids, &pid);
+	return 0;
+}
+
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(handle_target_exit, struct task_struct *p)
+{
+	__u32 pid, tid;
+
+	if (BPF_CORE_READ(p, pid) != BPF_CORE_READ(p, tgid) || get_task_pid_tgid(p, &pid, &tid))
+		return 0;
+	bpf_map_delete_elem(&targ_tgids, &pid);
+	if (dwarf_unwind)
+		bpf_map_delete_elem(&unwind_procs, &pid);
+	return 0;
+}
+
+static __always_inline void read_zone_name(__u64 zone, struct zone_key *key)
+{
+	ngx_shm_zone_t *z = (ngx_shm_zone_t *)zone;
+	unsigned char *data;
+	size_t len;
+
+	if (!z)
+	{
+		__builtin_memcpy(key->name, "[other]", sizeof("[other]"));
+		return;
+	}
+	// ngx_str_t is not NUL-terminated
+	len = BPF_PROBE_READ_USER(z, shm.name.len);
+	data = BPF_PROBE_READ_USER(z, shm.name.data);
+	if (len > ZONE_NAME_LEN - 1)
+		len = ZONE_NAME_LEN - 1;
+	bpf_probe_read_user(key->name, len, data);
+}
+
+static int probe_shdict_entry(struct pt_regs *ctx)
+{
+	__u32 pid = 0, tid = 0;
+	__u64 zone = PT_REGS_PARM1(ctx);
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	if (!pid_is_target(pid))
+		return 0;
+	if (!cgroup_is_target(bpf_get_current_cgroup_id()))
+		return 0;
+	bpf_map_update_elem(&shdict_zones, &tid, &zone, BPF_ANY);
+	return 0;
+}
+
+/* calls that return without locking must not name the next lock of the thread */
+static int probe_shdict_return(struct pt_regs *ctx)
+{
+	__u32 pid = 0, tid = 0;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	bpf_map_delete_elem(&shdict_zones, &tid);
+	return 0;
+}
+
+static int probe_lock_entry(struct pt_regs *ctx)
+{
+	struct lock_wait wait = {};
+	__u32 pid = 0, tid = 0;
+	__u64 *zone;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	if (!pid_is_target(pid))
+		return 0;
+	if (!cgroup_is_target(bpf_get_current_cgroup_id()))
+		return 0;
+
+	wait.mtx = PT_REGS_PARM1(ctx);
+	wait.start = bpf_ktime_get_ns();
+	zone = bpf_map_lookup_elem(&shdict_zones, &tid);
+	if (zone)
+		wait.zone = *zone;
+	bpf_map_update_elem(&lock_waits, &tid, &wait, BPF_ANY);
+	return 0;
+}
+
+static int probe_lock_return(struct pt_regs *ctx)
+{
+	static const struct zone_stats zero_stats;
+	static const __u64 zero;
+	struct profile_key_t key = {};
+	struct lock_hold hold = {};
+	struct zone_stats *stats;
+	struct lock_wait *wait;
+	__u32 pid = 0, tid = 0;
+	__u64 delta, *valp;
+	bool new_stack;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	wait = bpf_map_lookup_elem(&lock_waits, &tid);
+	if (!wait)
+		return 0;
+
+	hold.start = bpf_ktime_get_ns();
+	hold.mtx = wait->mtx;
+	delta = hold.start - wait->start;
+	read_zone_name(wait->zone, &hold.zone);
+	bpf_map_delete_elem(&lock_waits, &tid);
+	bpf_map_update_elem(&lock_holds, &tid, &hold, BPF_ANY);
+
+	stats = bpf_map_lookup_or_try_init(&zone_stats, &hold.zone, &zero_stats);
+	if (stats)
+	{
+		__sync_fetch_and_add(&stats->locks, 1);
+		__sync_fetch_and_add(&stats->wait_ns, delta);
+		add_hist(stats->wait_hist, delta);
+	}
+	if (delta < LOCK_MIN_WAIT_NS)
+		return 0;
+
+	// weigh the stack of the waiter by the time it waited, in usecs
+	key.pid = pid;
+	key.cgroup_id = bpf_get_current_cgroup_id();
+	key.kern_stack_id = -1;
+	key.user_stack_id = get_stackid(ctx, BPF_F_USER_STACK);
+	bpf_get_current_comm(&key.name, sizeof(key.name));
+	__builtin_memcpy(key.zone, hold.zone.name, sizeof(key.zone));
+
+	new_stack = !bpf_map_lookup_elem(&counts, &key);
+	valp = bpf_map_lookup_or_try_init(&counts, &key, &zero);
+	if (valp)
+		__sync_fetch_and_add(valp, delta / 1000);
+	if (!disable_lua_user_trace && new_stack)
+		fix_lua_stack(ctx, tid, key.user_stack_id, 0, false);
+	return 0;
+}
+
+static int probe_unlock(struct pt_regs *ctx)
+{
+	struct zone_stats *stats;
+	struct lock_hold *hold;
+	__u32 pid = 0, tid = 0;
+	__u64 delta;
+
+	if (get_current_pid_tgid(&pid, &tid))
+		return 0;
+	hold = bpf_map_lookup_elem(&lock_holds, &tid);
+	if (!hold || hold->mtx != PT_REGS_PARM1(ctx))
+		return 0;
+
+	delta = bpf_ktime_get_ns() - hold->start;
+	stats = bpf_map_lookup_elem(&zone_stats, &hold->zone);
+	if (stats)
+	{
+		__sync_fetch_and_add(&stats->hold_ns, delta);
+		add_hist(stats->hold_hist, delta);
+	}
+	bpf_map_delete_elem(&lock_holds, &tid);
+	return 0;
+}
+
+/*
+ * Bytes to the next sample, exponentially distributed with a mean of
+ * alloc_sample_bytes: -ln(u) * mean for a uniform u in (0, 1], with
+ * ln(u) = log2(u) * ln(2) and log2(1 + x) ~ x * (1.3466 - 0.3466 * x)
+ * on the mantissa, in 16 bit fixed point.
+ */
+static __always_inline __s64 alloc_interval(void)
+{
+	__u32 r = bpf_get_prandom_u32() | 1;
+	__u64 e = log2(r), x, neg_log2;
+
+	// the mantissa of r, as a fraction in [0, 1)
+	x = ((__u64)r << (32 - e) & 0xFFFFFFFFULL) >> 16;
+	x = x * (88254 - (22713 * x >> 16)) >> 16;
+	neg_log2 = (32 << 16) - (e << 16 | x);
+	return ((alloc_sample_bytes * neg_log2) >> 16) * 45426 >> 16;
+}
+
+/*
+ * Poisson sampling by bytes: a thread is sampled when its allocations use
+ * up the interval drawn at its previous sample, so the chance of an
+ * allocation being sampled grows with its size.
+ */
+static int probe_alloc(struct pt_regs *ctx, __u64 size)
+{
+	static const __u64 zero;
+	struct profile_key_t key = {};
+	__u32 pid = 0, tid = 0;
+	__s64 *left, next;
+	__u64 *valp;
+	bool new_stack;
+
+	if (!size || get_current_pid_tgid(&pid, &tid))
+		return 0;
+	if (!pid_is_target(pid))
+		return 0;
+
+	left = bpf_map_lookup_elem(&alloc_countdown, &tid);
+	if (!left)
+	{
+		next = alloc_interval() - size;
+		if (next > 0)
+		{
+			bpf_map_update_elem(&alloc_countdown, &tid, &next, BPF_ANY);
+			return 0;
+		}
+	}
+	else
+	{
+		*left -= size;
+		if (*left > 0)
+			return 0;
+	}
+	next = alloc_interval();
+	bpf_map_update_elem(&alloc_countdown, &tid, &next, BPF_ANY);
+	if (!cgroup_is_target(bpf_get_current_cgroup_id()))
+		return 0;
+
+	key.pid = pid;
+	key.cgroup_id = bpf_get_current_cgroup_id();
+	key.kern_stack_id = -1;
+	key.user_stack_id = get_stackid(ctx, BPF_F_USER_STACK);
+	bpf_get_current_comm(&key.name, sizeof(key.name));
+	// bytecode allocates through a few VM paths, the Lua frames tell the call sites apart
+	if (!disable_lua_user_trace)
+		key.lua_stack_hash = lua_stack_hash(tid);
+
+	// counts holds the sampled bytes, scaled to an estimate of all of them in user space
+	new_stack = !bpf_map_lookup_elem(&counts, &key);
+	valp = bpf_map_lookup_or_try_init(&counts, &key, &zero);
+	if (valp)
+		__sync_fetch_and_add(valp, size);
+	valp = bpf_map_lookup_or_try_init(&alloc_samples, &key, &zero);
+	if (valp)
+		__sync_fetch_and_add(valp, 1);
+	if (!disable_lua_user_trace && new_stack)
+		fix_lua_stack(ctx, tid, key.user_stack_id, key.lua_stack_hash, true);
+	return 0;
+}
+
+SEC("kprobe/handle_shdict_entry")
+int handle_shdict_entry(struct pt_regs *ctx)
+{
+	return probe_shdict_entry(ctx);
+}
+
+SEC("kprobe/handle_shdict_return")
+int handle_shdict_return(struct pt_regs *ctx)
+{
+	return probe_shdict_return(ctx);
+}
+
+SEC("kprobe/handle_lock_entry")
+int handle_lock_entry(struct pt_regs *ctx)
+{
+	return probe_lock_entry(ctx);
+}
+
+SEC("kprobe/handle_lock_return")
+int handle_lock_return(struct pt_regs *ctx)
+{
+	return probe_lock_return(ctx);
+}
+
+SEC("kprobe/handle_unlock")
+int handle_unlock(struct pt_regs *ctx)
+{
+	return probe_unlock(ctx);
+}
+
+// void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize)
+SEC("kprobe/handle_alloc_f")
+int handle_alloc_f(struct pt_regs *ctx)
+{
+	__u64 osize = PT_REGS_PARM3(ctx), nsize = PT_REGS_PARM4(ctx);
+
+	// frees and shrinking reallocations allocate nothing
+	return probe_alloc(ctx, nsize > osize ? nsize : 0);
+}
+
+// GCobj *lj_mem_newgco(lua_State *L, GCSize size)
+SEC("kprobe/handle_newgco")
+int handle_newgco(struct pt_regs *ctx)
+{
+	return probe_alloc(ctx, (__u32)PT_REGS_PARM2(ctx));
+}
+
 char LICENSE[] SEC("license") = "GPL";
@@ -9,11 +9,16 @@
  */
 #include <argp.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <linux/perf_event.h>
 #include <sys/stat.h>
 #include <asm/unistd.h>
@@ -21,9 +26,17 @@
 #include <bpf/bpf.h>
 #include "profile.h"
 #include "lua_stacks_helper.h"
+#include "flamegraph.h"
+#include "raw_profile.h"
 #include "profile.skel.h"
 #include "trace_helpers.h"
 #include "uprobe_helpers.h"
+#include "cgroup_helpers.h"
+#include "unwind_table.h"
+#include "lua_ffnames.h"
+#include "lua_funcname.h"
+#include "lua_heatmap.h"
+#include "pprof.h"
 
 /* This structure combines key_t and count which should be sorted together */
 struct key_ext_t
@@ -32,13 +45,35 @@ struct key_ext_t
 	__u64 v;
 };
 
+enum output_format
+{
+	FORMAT_TEXT,
+	FORMAT_FOLDED,
+	FORMAT_SVG,
+	FORMAT_HEATMAP,
+	FORMAT_PPROF,
+};
+
 bool exiting = false;
 struct lua_stack_map *lua_bt_map = NULL;
+struct lua_funcnames *lua_funcnames = NULL;
+
+/* perf events sampled in one run */
+#define MAX_EVENTS 4
+#define MAX_CGROUP_FILTERS 16
+#define MAX_PIDS 64
 
 static struct env
 {
 	pid_t pid;
 	pid_t tid;
+	// several -p pids, --master or --comm go to the target set
+	pid_t pids[MAX_PIDS];
+	int nr_pids;
+	pid_t master;
+	const char *comm;
+	// a target process, to find the binaries to probe
+	pid_t lib_pid;
 	__u64 ns_dev;
 	__u64 ns_ino;
 	bool user_stacks_only;
@@ -47,28 +82,57 @@ static struct env
 	bool disable_lua_user_trace;
 	bool lua_user_stacks_only;
 	int stack_storage_size;
+	// set by --stack-storage-size, else sized from the expected samples
+	bool stack_storage_set;
+	bool stack_dedup;
+	// unwind user stacks with .eh_frame tables instead of frame pointers
+	bool dwarf;
 	int stack_depth_limit;
 	int perf_max_stack_depth;
 	int duration;
 	bool verbose;
 	bool freq;
 	int sample_freq;
+	__u64 sample_period;
+	// indexes in perf_events
+	int events[MAX_EVENTS];
+	int nr_events;
+	bool ipc;
 	bool delimiter;
 	bool include_idle;
+	// folded is set for every format built from folded stacks
 	bool folded;
-	int cpu;
+	enum output_format format;
+	// CPU list, e.g. 0-15,32
+	const char *cpus;
+	const char *cgroup;
+	// cgroup trees to profile, filtered in BPF
+	const char *cgroup_filters[MAX_CGROUP_FILTERS];
+	int nr_cgroup_filters;
+	bool per_container;
+	int top;
+	const char *raw_path;
+	int stall_threshold_ms;
+	bool shdict_locks;
+	bool ssl_handshakes;
+	bool runqlat;
+	bool alloc;
+	// mean bytes between two allocation samples
+	__u64 alloc_sample_bytes;
 } env = {
 	.pid = -1,
 	.tid = -1,
+	.master = -1,
+	.lib_pid = -1,
 	.ns_dev = 0,
 	.ns_ino = 0,
 	.stack_storage_size = 8192,
 	.stack_depth_limit = 15,
 	.perf_max_stack_depth = 127,
-	.duration = 3,
+	.duration = 99999999,
 	.freq = 1,
 	.sample_freq = 49,
-	.cpu = -1,
+	.alloc_sample_bytes = 512 * 1024,
 };
 
 #define warn(...) fprintf(stderr, __VA_ARGS__)
@@ -85,23 +149,64 @@ const char argp_program_doc[] =
 	"    profile             # profile stack traces at 49 Hertz until Ctrl-C\n"
 	"    profile -F 99       # profile stack traces at 99 Hertz\n"
 	"    profile -c 1000000  # profile stack traces every 1 in a million events\n"
+	"    profile -e LLC-load-misses -c 10000 # where last level cache misses happen\n"
+	"    profile -e cpu-clock,page-faults -f # both profiles, the event is the root frame\n"
+	"    profile -p 185 --ipc # instructions per cycle of every Lua function\n"
 	"    profile 5           # profile at 49 Hertz for 5 seconds only\n"
 	"    profile -f          # output in folded format for flame graphs\n"
+	"    profile --format=svg > a.svg # render the flame graph directly\n"
 	"    profile -p 185      # only profile process with PID 185\n"
 	"    profile -L 185      # only profile thread with TID 185\n"
+	"    profile --master 184 # the master and every worker, also respawned ones\n"
+	"    profile --comm nginx # every nginx process on the host\n"
+	"    profile -C 0-15,32  # only sample on CPUs 0 to 15 and 32\n"
+	"    profile --cgroup /sys/fs/cgroup/kubepods.slice/... # only one container\n"
+	"    profile --cgroup-filter /sys/fs/cgroup/kubepods.slice --per-container -f\n"
+	"                        # every pod, the container is the root frame\n"
 	"    profile -U          # only show user space stacks (no kernel)\n"
-	"    profile -K          # only show kernel space stacks (no user)\n";
+	"    profile -K          # only show kernel space stacks (no user)\n"
+	"    profile --top 20    # only show the 20 hottest stacks\n"
+	"    profile -p 185 --stall-threshold 50 # stacks of event loop stalls over 50ms\n"
+	"    profile -p 185 --shdict-locks # where workers wait for ngx.shared.DICT locks\n"
+	"    profile -p 185 --ssl-handshakes # only sample inside TLS handshakes\n"
+	"    profile -p 185 --runqlat # run queue latency, by the Lua stack preempted\n"
+	"    profile -p 185 --alloc --format=pprof 30 > alloc.pb.gz # Lua allocations\n"
+	"    profile --output-raw a.raw 30 # capture now, symbolize later\n"
+	"    profile report a.raw > a.folded # symbolize a raw capture\n"
+	"    profile diff a.folded b.folded > diff.folded # compare two captures\n";
 
 #define OPT_PERF_MAX_STACK_DEPTH 1 /* --perf-max-stack-depth */
 #define OPT_STACK_STORAGE_SIZE 2   /* --stack-storage-size */
 #define OPT_STACK_DEPTH_LIMIT 3    /* --stack-depth-limit */
 #define OPT_LUA_USER_STACK_ONLY 4  /* --lua-user-stacks-only */
 #define OPT_DISABLE_LUA_USER_TRACE 5  /* --disable-lua-user-trace */
+#define OPT_TOP 6                  /* --top */
+#define OPT_FORMAT 7               /* --format */
+#define OPT_NO_NORMALIZE 8         /* diff --no-normalize */
+#define OPT_OUTPUT_RAW 9           /* --output-raw */
+#define OPT_SYSROOT 10             /* report/diff --sysroot */
+#define OPT_STALL_THRESHOLD 11     /* --stall-threshold */
+#define OPT_SHDICT_LOCKS 12        /* --shdict-locks */
+#define OPT_SSL_HANDSHAKES 13      /* --ssl-handshakes */
+#define OPT_RUNQLAT 14             /* --runqlat */
+#define OPT_IPC 15                 /* --ipc */
+#define OPT_CGROUP 16              /* --cgroup */
+#define OPT_CGROUP_FILTER 17       /* --cgroup-filter */
+#define OPT_PER_CONTAINER 18       /* --per-container */
+#define OPT_MASTER 19              /* --master */
+#define OPT_COMM 20                /* --comm */
+#define OPT_STACK_DEDUP 21         /* --stack-dedup */
+#define OPT_DWARF 22               /* --dwarf */
+#define OPT_ALLOC 23               /* --alloc */
+#define OPT_ALLOC_SAMPLE_BYTES 24  /* --alloc-sample-bytes */
 #define PERF_BUFFER_PAGES 16
 #define PERF_POLL_TIMEOUT_MS 100
 
 static const struct argp_option opts[] = {
-	{"pid", 'p', "PID", 0, "profile process with this PID only"},
+	{"pid", 'p', "PID", 0, "profile process with this PID only, or these PIDs, comma separated"},
+	{"master", OPT_MASTER, "PID", 0, "profile the nginx master with this PID and its workers, "
+									 "including workers it starts later"},
+	{"comm", OPT_COMM, "NAME", 0, "profile every process named NAME, including ones started later"},
 	{"tid", 'L', "TID", 0, "profile thread with this TID only"},
 	{"user-stacks-only", 'U', NULL, 0,
 	 "show stacks from user space only (no kernel space stacks)"},
@@ -112,14 +217,50 @@ static const struct argp_option opts[] = {
 	{"disable-lua-user-trace", OPT_DISABLE_LUA_USER_TRACE, NULL, 0,
 	 "disable lua user space stack trace"},
 	{"frequency", 'F', "FREQUENCY", 0, "sample frequency, Hertz"},
+	{"count", 'c', "COUNT", 0, "sample period, number of events"},
+	{"event", 'e', "EVENT", 0,
+	 "sample on EVENT: cpu-clock (default), page-faults, cycles, instructions, "
+	 "cache-misses, LLC-load-misses or branch-misses; repeat it or list several, "
+	 "comma separated, for one profile per event"},
+	{"ipc", OPT_IPC, NULL, 0, "sample cycles and report instructions per cycle by Lua function"},
 	{"delimited", 'd', NULL, 0, "insert delimiter between kernel/user stacks"},
 	{"include-idle ", 'I', NULL, 0, "include CPU idle stacks"},
 	{"folded", 'f', NULL, 0, "output folded format, one line per stack (for flame graphs)"},
+	{"format", OPT_FORMAT, "FORMAT", 0, "output format: text (default), folded, svg, heatmap "
+	 "(samples per Lua source line) or pprof (gzipped profile.proto)"},
+	{"output-raw", OPT_OUTPUT_RAW, "FILE", 0,
+	 "write an unsymbolized binary capture to FILE, for profile report"},
+	{"stall-threshold", OPT_STALL_THRESHOLD, "MS", 0,
+	 "only sample nginx event loop iterations busy for longer than MS"},
+	{"shdict-locks", OPT_SHDICT_LOCKS, NULL, 0,
+	 "trace shared memory zone locks instead of sampling, stacks are weighted by usecs waited"},
+	{"ssl-handshakes", OPT_SSL_HANDSHAKES, NULL, 0,
+	 "only sample threads inside SSL_do_handshake()"},
+	{"runqlat", OPT_RUNQLAT, NULL, 0,
+	 "trace run queue latency instead of sampling, stacks are weighted by usecs waited"},
+	{"alloc", OPT_ALLOC, NULL, 0,
+	 "sample LuaJIT allocations instead of CPU time, stacks are weighted by bytes allocated"},
+	{"alloc-sample-bytes", OPT_ALLOC_SAMPLE_BYTES, "BYTES", 0,
+	 "take one allocation sample every BYTES allocated on average (default 524288)"},
 	{"stack-storage-size", OPT_STACK_STORAGE_SIZE, "STACK-STORAGE-SIZE", 0,
-	 "the number of unique stack traces that can be stored and displayed (default 1024)"},
+	 "the number of unique stack traces that can be stored and displayed "
+	 "(default: sized from the sample rate, CPUs and duration)"},
+	{"stack-dedup", OPT_STACK_DEDUP, NULL, 0,
+	 "store stacks in a hash table with probing instead of the stackmap, "
+	 "so that hash collisions do not drop stacks"},
+	{"dwarf", OPT_DWARF, NULL, 0,
+	 "unwind user stacks with the .eh_frame of the binaries, for code built without "
+	 "frame pointers (x86_64)"},
 	{"stack-depth-limit", OPT_STACK_DEPTH_LIMIT, "OPT_STACK_DEPTH_LIMIT", 0,
 	 "the limit depth of stack that be traversed (default 15)"},
-	{"cpu", 'C', "CPU", 0, "cpu number to run profile on"},
+	{"cpu", 'C', "CPUS", 0, "cpu numbers to run profile on, e.g. 0-15,32"},
+	{"cgroup", OPT_CGROUP, "PATH", 0,
+	 "only sample tasks of the cgroup v2 directory PATH, e.g. /sys/fs/cgroup/system.slice/nginx.service"},
+	{"cgroup-filter", OPT_CGROUP_FILTER, "PATH", 0,
+	 "only profile tasks in the cgroup v2 directory PATH or below it, can be repeated"},
+	{"per-container", OPT_PER_CONTAINER, NULL, 0,
+	 "split stacks by container, named after the pod or container id"},
+	{"top", OPT_TOP, "N", 0, "only show the N hottest stacks"},
 	{"perf-max-stack-depth", OPT_PERF_MAX_STACK_DEPTH,
 	 "PERF-MAX-STACK-DEPTH", 0, "the limit for both kernel and user stack traces (default 127)"},
 	{"verbose", 'v', NULL, 0, "Verbose debug output"},
@@ -127,15 +268,23 @@ static const struct argp_option opts[] = {
 	{},
 };
 
-static int read_ns_dev_ino(	__u64 *ns_dev, __u64 *ns_ino)
+/*
+ * The pid namespace pids are translated to in BPF.  This is deliberately
+ * the profiler's own, not the target's: -p, --master and the targ_tgids
+ * set take pids as the profiler sees them, and the pids of the keys are
+ * used to read /proc/PID/maps here.  Containers are selected with
+ * --cgroup-filter instead.
+ */
+static int read_ns_dev_ino(__u64 *ns_dev, __u64 *ns_ino)
 {
 	struct stat statbuf;
-    const char *path = "/proc/self/ns/pid";
+	const char *path = "/proc/self/ns/pid";
 
-    if (stat(path, &statbuf) == -1) {
-        perror("stat");
-        return 1;
-    }
+	if (stat(path, &statbuf) == -1)
+	{
+		perror("stat");
+		return 1;
+	}
 
 	*ns_dev = statbuf.st_dev;
 	*ns_ino = statbuf.st_ino;
@@ -143,6 +292,36 @@ static int read_ns_dev_ino(	__u64 *ns_dev, __u64 *ns_ino)
 	return 0;
 }
 
+static const struct perf_event_spec
+{
+	const char *name;
+	__u32 type;
+	__u64 config;
+} perf_events[] = {
+	{"cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
+	{"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+	{"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	{"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{"LLC-load-misses", PERF_TYPE_HW_CACHE,
+	 PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+#define NR_PERF_EVENTS (sizeof(perf_events) / sizeof(perf_events[0]))
+
+static int find_perf_event(const char *name)
+{
+	for (int i = 0; i < NR_PERF_EVENTS; i++)
+	{
+		if (!strcmp(perf_events[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
 static error_t parse_arg(int key, char *arg, struct argp_state *state)
 {
 	static int pos_args;
@@ -156,14 +335,40 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		env.verbose = true;
 		break;
 	case 'p':
+		for (char *pid = strtok(arg, ","); pid; pid = strtok(NULL, ","))
+		{
+			if (env.nr_pids == MAX_PIDS)
+			{
+				fprintf(stderr, "at most %d PIDs can be given\n", MAX_PIDS);
+				argp_usage(state);
+			}
+			errno = 0;
+			env.pids[env.nr_pids] = strtol(pid, NULL, 10);
+			if (errno || env.pids[env.nr_pids] <= 0)
+			{
+				fprintf(stderr, "invalid PID: %s\n", pid);
+				argp_usage(state);
+			}
+			env.nr_pids++;
+		}
+		break;
+	case OPT_MASTER:
 		errno = 0;
-		env.pid = strtol(arg, NULL, 10);
-		if (errno)
+		env.master = strtol(arg, NULL, 10);
+		if (errno || env.master <= 0)
 		{
 			fprintf(stderr, "invalid PID: %s\n", arg);
 			argp_usage(state);
 		}
 		break;
+	case OPT_COMM:
+		if (strlen(arg) >= TASK_COMM_LEN)
+		{
+			fprintf(stderr, "NAME is at most %d characters: %s\n", TASK_COMM_LEN - 1, arg);
+			argp_usage(state);
+		}
+		env.comm = arg;
+		break;
 	case 'L':
 		errno = 0;
 		env.tid = strtol(arg, NULL, 10);
@@ -188,6 +393,36 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 			argp_usage(state);
 		}
 		break;
+	case 'c':
+		errno = 0;
+		env.sample_period = strtoull(arg, NULL, 10);
+		if (errno || env.sample_period == 0)
+		{
+			fprintf(stderr, "invalid COUNT: %s\n", arg);
+			argp_usage(state);
+		}
+		env.freq = false;
+		break;
+	case 'e':
+		for (char *name = strtok(arg, ","); name; name = strtok(NULL, ","))
+		{
+			if (env.nr_events == MAX_EVENTS)
+			{
+				fprintf(stderr, "at most %d events can be sampled\n", MAX_EVENTS);
+				argp_usage(state);
+			}
+			env.events[env.nr_events] = find_perf_event(name);
+			if (env.events[env.nr_events] < 0)
+			{
+				fprintf(stderr, "unknown EVENT: %s\n", name);
+				argp_usage(state);
+			}
+			env.nr_events++;
+		}
+		break;
+	case OPT_IPC:
+		env.ipc = true;
+		break;
 	case 'd':
 		env.delimiter = true;
 		break;
@@ -196,15 +431,75 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		break;
 	case 'f':
 		env.folded = true;
+		env.format = FORMAT_FOLDED;
 		break;
-	case 'C':
+	case OPT_FORMAT:
+		if (!strcmp(arg, "text"))
+			env.format = FORMAT_TEXT;
+		else if (!strcmp(arg, "folded"))
+			env.format = FORMAT_FOLDED;
+		else if (!strcmp(arg, "svg"))
+			env.format = FORMAT_SVG;
+		else if (!strcmp(arg, "heatmap"))
+			env.format = FORMAT_HEATMAP;
+		else if (!strcmp(arg, "pprof"))
+			env.format = FORMAT_PPROF;
+		else
+		{
+			fprintf(stderr, "invalid FORMAT: %s\n", arg);
+			argp_usage(state);
+		}
+		env.folded = env.format != FORMAT_TEXT;
+		break;
+	case OPT_OUTPUT_RAW:
+		env.raw_path = arg;
+		break;
+	case OPT_STALL_THRESHOLD:
 		errno = 0;
-		env.cpu = strtol(arg, NULL, 10);
-		if (errno)
+		env.stall_threshold_ms = strtol(arg, NULL, 10);
+		if (errno || env.stall_threshold_ms <= 0)
+		{
+			fprintf(stderr, "invalid stall threshold: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_SHDICT_LOCKS:
+		env.shdict_locks = true;
+		break;
+	case OPT_SSL_HANDSHAKES:
+		env.ssl_handshakes = true;
+		break;
+	case OPT_RUNQLAT:
+		env.runqlat = true;
+		break;
+	case OPT_ALLOC:
+		env.alloc = true;
+		break;
+	case OPT_ALLOC_SAMPLE_BYTES:
+		errno = 0;
+		env.alloc_sample_bytes = strtoull(arg, NULL, 10);
+		if (errno || !env.alloc_sample_bytes || env.alloc_sample_bytes > 1ULL << 32)
+		{
+			fprintf(stderr, "invalid allocation sample bytes: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'C':
+		env.cpus = arg;
+		break;
+	case OPT_CGROUP:
+		env.cgroup = arg;
+		break;
+	case OPT_CGROUP_FILTER:
+		if (env.nr_cgroup_filters == MAX_CGROUP_FILTERS)
 		{
-			fprintf(stderr, "invalid CPU: %s\n", arg);
+			fprintf(stderr, "at most %d --cgroup-filter can be given\n", MAX_CGROUP_FILTERS);
 			argp_usage(state);
 		}
+		env.cgroup_filters[env.nr_cgroup_filters++] = arg;
+		break;
+	case OPT_PER_CONTAINER:
+		env.per_container = true;
 		break;
 	case OPT_PERF_MAX_STACK_DEPTH:
 		errno = 0;
@@ -218,11 +513,18 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case OPT_STACK_STORAGE_SIZE:
 		errno = 0;
 		env.stack_storage_size = strtol(arg, NULL, 10);
-		if (errno)
+		if (errno || env.stack_storage_size <= 0)
 		{
 			fprintf(stderr, "invalid stack storage size: %s\n", arg);
 			argp_usage(state);
 		}
+		env.stack_storage_set = true;
+		break;
+	case OPT_STACK_DEDUP:
+		env.stack_dedup = true;
+		break;
+	case OPT_DWARF:
+		env.dwarf = true;
 		break;
 	case OPT_STACK_DEPTH_LIMIT:
 		errno = 0;
@@ -233,6 +535,15 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 			argp_usage(state);
 		}
 		break;
+	case OPT_TOP:
+		errno = 0;
+		env.top = strtol(arg, NULL, 10);
+		if (errno || env.top <= 0)
+		{
+			fprintf(stderr, "invalid top: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
 	case OPT_LUA_USER_STACK_ONLY:
 		env.lua_user_stacks_only = true;
 		break;
@@ -261,48 +572,253 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 }
 
 static int nr_cpus;
+/* CPUs picked by -C, NULL for all of them */
+static bool *cpu_mask;
+/* directory of --cgroup, or -1 */
+static int cgroup_fd = -1;
+
+/* Parse a CPU list such as 0-15,32 into mask */
+static int parse_cpu_list(const char *list, bool *mask, int nr)
+{
+	const char *p = list;
+	long first, last;
+	char *end;
+
+	while (*p)
+	{
+		errno = 0;
+		first = last = strtol(p, &end, 10);
+		if (errno || end == p)
+			return -1;
+		if (*end == '-')
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (errno || end == p)
+				return -1;
+		}
+		if (first < 0 || first > last || last >= nr)
+			return -1;
+		for (; first <= last; first++)
+			mask[first] = true;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		p = end;
+	}
+	return 0;
+}
 
+static bool cpu_wanted(int cpu)
+{
+	return !cpu_mask || cpu_mask[cpu];
+}
+
+/* Per-CPU event, only counting the tasks of the cgroup with --cgroup */
+static int perf_event_open_cpu(struct perf_event_attr *attr, int cpu)
+{
+	if (cgroup_fd >= 0)
+		return syscall(__NR_perf_event_open, attr, cgroup_fd, cpu, -1, PERF_FLAG_PID_CGROUP);
+	return syscall(__NR_perf_event_open, attr, -1, cpu, -1, 0);
+}
+
+/*
+ * Open every event on every CPU.  links has nr_cpus entries per event, the
+ * event index is the attach cookie do_perf_event puts in the key.
+ */
 static int open_and_attach_perf_event(int freq, struct bpf_program *prog,
 									  struct bpf_link *links[])
+{
+	const struct perf_event_spec *ev;
+	struct perf_event_attr attr;
+	struct bpf_link **link;
+	int e, i, fd;
+
+	for (e = 0; e < env.nr_events; e++)
+	{
+		ev = &perf_events[env.events[e]];
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = ev->type;
+		attr.config = ev->config;
+		attr.freq = freq;
+		if (freq)
+			attr.sample_freq = env.sample_freq;
+		else
+			attr.sample_period = env.sample_period;
+
+		for (i = 0; i < nr_cpus; i++)
+		{
+			LIBBPF_OPTS(bpf_perf_event_opts, opts, .bpf_cookie = e);
+
+			if (!cpu_wanted(i))
+				continue;
+
+			fd = perf_event_open_cpu(&attr, i);
+			if (fd < 0)
+			{
+				/* Ignore CPU that is offline */
+				if (errno == ENODEV)
+					continue;
+				/* virtual machines often have no PMU */
+				if (ev->type != PERF_TYPE_SOFTWARE && !env.ipc && env.nr_events == 1 &&
+					(errno == ENOENT || errno == EOPNOTSUPP))
+				{
+					fprintf(stderr, "%s is not supported here, falling back to cpu-clock\n",
+							ev->name);
+					for (i = 0; i < nr_cpus; i++)
+					{
+						bpf_link__destroy(links[i]);
+						links[i] = NULL;
+					}
+					env.events[0] = find_perf_event("cpu-clock");
+					/* -c counts events, for cpu-clock it would be nanoseconds */
+					if (!freq)
+					{
+						fprintf(stderr, "-c %llu counts %s events, sampling cpu-clock at %d Hz instead\n",
+								(unsigned long long)env.sample_period, ev->name, env.sample_freq);
+						env.freq = true;
+					}
+					return open_and_attach_perf_event(true, prog, links);
+				}
+				fprintf(stderr, "failed to init perf sampling of %s: %s\n", ev->name,
+						strerror(errno));
+				return -1;
+			}
+			link = &links[e * nr_cpus + i];
+			if (env.nr_events > 1)
+				*link = bpf_program__attach_perf_event_opts(prog, fd, &opts);
+			else
+				*link = bpf_program__attach_perf_event(prog, fd);
+			if (!*link)
+			{
+				fprintf(stderr, "failed to attach perf event on cpu: "
+								"%d\n",
+						i);
+				close(fd);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Counting instructions events for --ipc, read by do_perf_event */
+static int open_ipc_counters(int map_fd, int *fds)
 {
 	struct perf_event_attr attr = {
-		.type = PERF_TYPE_SOFTWARE,
-		.freq = env.freq,
-		.sample_freq = env.sample_freq,
-		.config = PERF_COUNT_SW_CPU_CLOCK,
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_INSTRUCTIONS,
 	};
-	int i, fd;
+	int i;
 
 	for (i = 0; i < nr_cpus; i++)
 	{
-		if (env.cpu != -1 && env.cpu != i)
+		if (!cpu_wanted(i))
 			continue;
 
-		fd = syscall(__NR_perf_event_open, &attr, -1, i, -1, 0);
-		if (fd < 0)
+		fds[i] = perf_event_open_cpu(&attr, i);
+		if (fds[i] < 0)
 		{
-			/* Ignore CPU that is offline */
 			if (errno == ENODEV)
 				continue;
-			fprintf(stderr, "failed to init perf sampling: %s\n",
+			fprintf(stderr, "failed to open instructions counter, --ipc needs a PMU: %s\n",
 					strerror(errno));
 			return -1;
 		}
-		links[i] = bpf_program__attach_perf_event(prog, fd);
-		if (!links[i])
+		if (bpf_map_update_elem(map_fd, &i, &fds[i], BPF_ANY))
 		{
-			fprintf(stderr, "failed to attach perf event on cpu: "
-							"%d\n",
-					i);
-			links[i] = NULL;
-			close(fd);
+			fprintf(stderr, "failed to set instructions counter of cpu %d\n", i);
 			return -1;
 		}
 	}
+	return 0;
+}
+
+/*
+ * Entries of the cgroup_filter map hold the generation of the last walk
+ * that found them, so that cgroups which are gone can be dropped.
+ */
+struct cgroup_filter_walk
+{
+	int map_fd;
+	__u8 gen;
+	// keep walking a full map, to refresh the entries it has
+	bool refresh;
+};
+
+static bool cgroup_filter_full;
+
+static int add_cgroup_filter(const char *path, __u64 id, void *ctx)
+{
+	struct cgroup_filter_walk *walk = ctx;
+
+	if (bpf_map_update_elem(walk->map_fd, &id, &walk->gen, BPF_ANY))
+	{
+		if (!cgroup_filter_full)
+			fprintf(stderr, "too many cgroups below the --cgroup-filter directories, at most %d\n",
+					MAX_CGROUPS);
+		cgroup_filter_full = true;
+		return walk->refresh ? 0 : -1;
+	}
+	return 0;
+}
+
+/* Every cgroup below the --cgroup-filter directories, as they are now */
+static int fill_cgroup_filter(int map_fd)
+{
+	struct cgroup_filter_walk walk = {.map_fd = map_fd};
+	__u64 id;
+	int i;
 
+	for (i = 0; i < env.nr_cgroup_filters; i++)
+	{
+		if (cgroup_id_of(env.cgroup_filters[i], &id))
+		{
+			fprintf(stderr, "%s is not a cgroup directory: %s\n", env.cgroup_filters[i],
+					strerror(errno));
+			return -1;
+		}
+		if (cgroup_walk(env.cgroup_filters[i], add_cgroup_filter, &walk))
+			return -1;
+	}
 	return 0;
 }
 
+#define CGROUP_REFRESH_INTERVAL_NS (1 * NSEC_PER_SEC)
+
+/*
+ * Pods come and go during a capture: add the cgroups created below the
+ * --cgroup-filter directories since the last walk, and drop the removed ones.
+ */
+static void refresh_cgroup_filter(int map_fd)
+{
+	struct cgroup_filter_walk walk = {.map_fd = map_fd, .refresh = true};
+	static __u8 last_gen;
+	__u64 key, next, stale[MAX_CGROUPS];
+	void *prev = NULL;
+	int i, nr_stale = 0;
+	__u8 gen;
+
+	walk.gen = ++last_gen;
+	for (i = 0; i < env.nr_cgroup_filters; i++)
+		cgroup_walk(env.cgroup_filters[i], add_cgroup_filter, &walk);
+
+	while (!bpf_map_get_next_key(map_fd, prev, &next) && nr_stale < MAX_CGROUPS)
+	{
+		key = next;
+		prev = &key;
+		if (!bpf_map_lookup_elem(map_fd, &key, &gen) && gen != walk.gen)
+			stale[nr_stale++] = key;
+	}
+	for (i = 0; i < nr_stale; i++)
+		bpf_map_delete_elem(map_fd, &stale[i]);
+	if (nr_stale)
+		cgroup_filter_full = false;
+}
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
 	if (level == LIBBPF_DEBUG && !env.verbose)
@@ -327,6 +843,77 @@ static int cmp_counts(const void *dx, const void *dy)
 	return x > y ? -1 : !(x == y);
 }
 
+/*
+ * Partially order items so that the k largest counts come first (in no
+ * particular order), without sorting the rest.  Average O(n).  Counts
+ * equal to the pivot are grouped in one pass, as most stacks often share
+ * a count of 1, and the range left is sorted once partitioning stops
+ * making progress, so this is never slower than sorting everything.
+ */
+static void select_top_counts(struct key_ext_t *items, __u32 n, __u32 k)
+{
+	__u32 lo = 0, hi = n - 1, i, gt, lt, mid, depth = 0, max_depth = 0;
+	struct key_ext_t tmp;
+	__u64 pivot;
+
+	if (k == 0 || k >= n)
+		return;
+	for (i = n; i; i >>= 1)
+		max_depth += 2;
+
+	while (lo < hi)
+	{
+		if (depth++ == max_depth)
+		{
+			qsort(items + lo, hi - lo + 1, sizeof(items[0]), cmp_counts);
+			return;
+		}
+		/* median of three */
+		mid = lo + (hi - lo) / 2;
+		if (items[mid].v > items[lo].v)
+		{
+			tmp = items[mid], items[mid] = items[lo], items[lo] = tmp;
+		}
+		if (items[hi].v > items[lo].v)
+		{
+			tmp = items[hi], items[hi] = items[lo], items[lo] = tmp;
+		}
+		if (items[mid].v > items[hi].v)
+		{
+			tmp = items[mid], items[mid] = items[hi], items[hi] = tmp;
+		}
+		pivot = items[hi].v;
+
+		/* [lo, gt) > pivot, [gt, i) == pivot, [lt, hi] < pivot */
+		gt = i = lo;
+		lt = hi + 1;
+		while (i < lt)
+		{
+			if (items[i].v > pivot)
+			{
+				tmp = items[i], items[i] = items[gt], items[gt] = tmp;
+				gt++, i++;
+			}
+			else if (items[i].v < pivot)
+			{
+				lt--;
+				tmp = items[i], items[i] = items[lt], items[lt] = tmp;
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		if (k <= gt)
+			hi = gt - 1;
+		else if (k <= lt)
+			return;
+		else
+			lo = lt;
+	}
+}
+
 static bool batch_map_ops = true; /* hope for the best */
 
 static bool read_batch_counts_map(int fd, struct key_ext_t *items, __u32 *count)
@@ -334,8 +921,17 @@ static bool read_batch_counts_map(int fd, struct key_ext_t *items, __u32 *count)
 	void *in = NULL, *out;
 	__u32 i, n, n_read = 0;
 	int err = 0;
-	__u64 vals[*count];
-	struct profile_key_t keys[*count];
+	__u64 *vals;
+	struct profile_key_t *keys;
+	bool ok = false;
+
+	vals = calloc(*count, sizeof(*vals));
+	keys = calloc(*count, sizeof(*keys));
+	if (!vals || !keys)
+	{
+		warn("failed to alloc counts buffers\n");
+		goto out;
+	}
 
 	while (n_read < *count && !err)
 	{
@@ -349,7 +945,7 @@ static bool read_batch_counts_map(int fd, struct key_ext_t *items, __u32 *count)
 			if (errno != EINVAL)
 				warn("bpf_map_lookup_batch: %s\n",
 					 strerror(-err));
-			return false;
+			goto out;
 		}
 		n_read += n;
 		in = out;
@@ -357,63 +953,269 @@ static bool read_batch_counts_map(int fd, struct key_ext_t *items, __u32 *count)
 
 	for (i = 0; i < n_read; i++)
 	{
-		items[i].k.pid = keys[i].pid;
-		items[i].k.kernel_ip = keys[i].kernel_ip;
-		items[i].k.user_stack_id = keys[i].user_stack_id;
-		items[i].k.kern_stack_id = keys[i].kern_stack_id;
-		strncpy(items[i].k.name, keys[i].name, TASK_COMM_LEN);
+		items[i].k = keys[i];
 		items[i].v = vals[i];
 	}
 
 	*count = n_read;
-	return true;
+	ok = true;
+out:
+	free(vals);
+	free(keys);
+	return ok;
 }
 
-static bool read_counts_map(int fd, struct key_ext_t *items, __u32 *count)
+/*
+ * Returns a heap array with the entries of the counts map, which holds at
+ * most max_entries keys, or NULL on failure.  The caller frees the array.
+ */
+static struct key_ext_t *read_counts_map(int fd, __u32 max_entries, __u32 *count)
 {
 	struct profile_key_t empty = {};
 	struct profile_key_t *lookup_key = &empty;
-	int i = 0;
+	struct key_ext_t *items, *tmp;
+	__u32 i = 0, cap = max_entries ? max_entries : 1;
+	struct key_ext_t item;
 	int err;
 
+	items = calloc(cap, sizeof(*items));
+	if (!items)
+	{
+		warn("failed to alloc counts\n");
+		return NULL;
+	}
+
 	if (batch_map_ops)
 	{
+		*count = cap;
 		bool ok = read_batch_counts_map(fd, items, count);
 		if (!ok && errno == EINVAL)
 		{
 			/* fall back to a racy variant */
 			batch_map_ops = false;
 		}
+		else if (ok)
+		{
+			return items;
+		}
 		else
 		{
-			return ok;
+			free(items);
+			return NULL;
 		}
 	}
 
-	if (!items || !count || !*count)
-		return true;
-
-	while (!bpf_map_get_next_key(fd, lookup_key, &items[i].k))
+	while (!bpf_map_get_next_key(fd, lookup_key, &item.k))
 	{
-
-		err = bpf_map_lookup_elem(fd, &items[i].k, &items[i].v);
+		err = bpf_map_lookup_elem(fd, &item.k, &item.v);
 		if (err < 0)
 		{
 			fprintf(stderr, "failed to lookup counts: %d\n", err);
-			return false;
+			free(items);
+			return NULL;
 		}
-		if (items[i].v == 0)
-			continue;
-
+		/* the map may grow while it is walked, so keep up with it */
+		if (i == cap)
+		{
+			tmp = realloc(items, (size_t)cap * 2 * sizeof(*items));
+			if (!tmp)
+			{
+				warn("failed to grow counts\n");
+				free(items);
+				return NULL;
+			}
+			items = tmp;
+			cap *= 2;
+		}
+		items[i] = item;
 		lookup_key = &items[i].k;
-		i++;
+		if (item.v)
+			i++;
 	}
 
 	*count = i;
+	return items;
+}
+
+/* Stack traces of the stackmap by stack id, looked up lazily, once per referenced id */
+struct stack_table
+{
+	int sfd;
+	__u32 nr_slots;
+	__u32 depth;
+	__u32 nr_stacks;
+	/* by stack id: 0 if not read yet, STACK_MISSING, else the row + 1 */
+	__u32 *rows;
+	/* depth ips per row, the ones read so far */
+	unsigned long *ips;
+	__u32 *nr_ips;
+	__u32 nr_rows;
+	__u32 cap_rows;
+};
+
+#define STACK_MISSING ((__u32)-1)
+
+static void free_stack_table(struct stack_table *st)
+{
+	if (!st)
+		return;
+	free(st->rows);
+	free(st->ips);
+	free(st->nr_ips);
+	free(st);
+}
+
+static struct stack_table *new_stack_table(int sfd, __u32 max_entries, __u32 depth)
+{
+	struct stack_table *st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	st->sfd = sfd;
+	st->nr_slots = max_entries;
+	st->depth = depth;
+	st->rows = calloc(max_entries, sizeof(*st->rows));
+	if (!st->rows)
+	{
+		free_stack_table(st);
+		return NULL;
+	}
+	return st;
+}
+
+static bool stack_table_grow(struct stack_table *st)
+{
+	__u32 cap = st->cap_rows ? st->cap_rows * 2 : 256;
+	unsigned long *ips;
+	__u32 *nr_ips;
+
+	ips = realloc(st->ips, (size_t)cap * st->depth * sizeof(*ips));
+	if (!ips)
+		return false;
+	st->ips = ips;
+	nr_ips = realloc(st->nr_ips, cap * sizeof(*nr_ips));
+	if (!nr_ips)
+		return false;
+	st->nr_ips = nr_ips;
+	st->cap_rows = cap;
 	return true;
 }
 
-static void print_fold_lua_func(const struct syms *syms, const struct lua_stack_event *eventp)
+/* Returns the ips of stack_id, or NULL if it was not found in the stackmap */
+static const unsigned long *stack_table_get(struct stack_table *st, int stack_id,
+											unsigned int *nr_ips)
+{
+	unsigned long *ips;
+	__u32 key = stack_id, n;
+
+	if (stack_id < 0 || stack_id >= st->nr_slots || st->rows[key] == STACK_MISSING)
+		return NULL;
+	if (!st->rows[key])
+	{
+		if (st->nr_rows == st->cap_rows && !stack_table_grow(st))
+			return NULL;
+		ips = st->ips + (size_t)st->nr_rows * st->depth;
+		if (bpf_map_lookup_elem(st->sfd, &key, ips))
+		{
+			st->rows[key] = STACK_MISSING;
+			return NULL;
+		}
+		/* count the number of ips */
+		n = 0;
+		while (n < st->depth && ips[n])
+			n++;
+		st->nr_ips[st->nr_rows] = n;
+		st->rows[key] = ++st->nr_rows;
+		st->nr_stacks++;
+	}
+	*nr_ips = st->nr_ips[st->rows[key] - 1];
+	return st->ips + (size_t)(st->rows[key] - 1) * st->depth;
+}
+
+/*
+ * The frames of one folded stack, root first.  Names are kept NUL-separated
+ * in a growable buffer so that the same stack can be printed as a folded
+ * line or fed to the flame graph renderer.
+ */
+struct stack_frames
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t *offs;
+	const char **names;
+	int nr;
+	int nr_cap;
+};
+
+static void stack_frames__reset(struct stack_frames *sf)
+{
+	sf->len = 0;
+	sf->nr = 0;
+}
+
+static void stack_frames__free(struct stack_frames *sf)
+{
+	free(sf->buf);
+	free(sf->offs);
+	free(sf->names);
+}
+
+static void stack_frames__push(struct stack_frames *sf, const char *fmt, ...)
+{
+	va_list ap;
+	size_t new_cap;
+	int n;
+	void *tmp;
+
+	if (sf->nr == sf->nr_cap)
+	{
+		new_cap = sf->nr_cap ? sf->nr_cap * 2 : 256;
+		tmp = realloc(sf->offs, new_cap * sizeof(*sf->offs));
+		if (!tmp)
+			return;
+		sf->offs = tmp;
+		tmp = realloc(sf->names, new_cap * sizeof(*sf->names));
+		if (!tmp)
+			return;
+		sf->names = tmp;
+		sf->nr_cap = new_cap;
+	}
+
+	for (;;)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(sf->buf + sf->len, sf->cap - sf->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (sf->len + n < sf->cap)
+			break;
+		new_cap = sf->cap ? sf->cap * 2 : 4096;
+		while (new_cap <= sf->len + n)
+			new_cap *= 2;
+		tmp = realloc(sf->buf, new_cap);
+		if (!tmp)
+			return;
+		sf->buf = tmp;
+		sf->cap = new_cap;
+	}
+	sf->offs[sf->nr++] = sf->len;
+	sf->len += n + 1;
+}
+
+/* Returns the frame names; valid until the next push */
+static const char *const *stack_frames__names(struct stack_frames *sf)
+{
+	for (int i = 0; i < sf->nr; i++)
+		sf->names[i] = sf->buf + sf->offs[i];
+	return sf->names;
+}
+
+/* func_name is the name the caller used for a Lua function, or NULL */
+static void fold_lua_func(struct stack_frames *sf, const struct syms *syms, const struct lua_stack_event *eventp,
+						  const char *func_name)
 {
 	if (!eventp)
 	{
@@ -421,13 +1223,17 @@ static void print_fold_lua_func(const struct syms *syms, const struct lua_stack_
 	}
 	if (eventp->type == FUNC_TYPE_LUA)
 	{
-		if (eventp->ffid)
+		if (eventp->ffid && func_name)
+		{
+			stack_frames__push(sf, "L:%s:%d:%s", eventp->name, eventp->ffid, func_name);
+		}
+		else if (eventp->ffid)
 		{
-			printf(";L:%s:%d", eventp->name, eventp->ffid);
+			stack_frames__push(sf, "L:%s:%d", eventp->name, eventp->ffid);
 		}
 		else
 		{
-			printf(";L:%s", eventp->name);
+			stack_frames__push(sf, "L:%s", eventp->name);
 		}
 	}
 	else if (eventp->type == FUNC_TYPE_C)
@@ -435,23 +1241,109 @@ static void print_fold_lua_func(const struct syms *syms, const struct lua_stack_
 		const struct sym *sym = syms__map_addr(syms, (unsigned long)eventp->funcp);
 		if (sym)
 		{
-			printf(";C:%s", sym ? sym->name : "[unknown]");
+			stack_frames__push(sf, "C:%s", sym ? sym->name : "[unknown]");
 		}
 	}
 	else if (eventp->type == FUNC_TYPE_F)
 	{
-		printf(";builtin#%d", eventp->ffid);
-	}
-	else
-	{
-		printf(";[unknown]");
-	}
+		// a cdata function pointer points to the start of the symbol
+		const struct sym *sym = eventp->ffi_func ? syms__map_addr(syms, (unsigned long)eventp->ffi_func) : NULL;
+		if (sym && !sym->offset)
+		{
+			stack_frames__push(sf, "FFI:%s", sym->name);
+		}
+		else if (lua_ffnames__get(eventp->ffid))
+		{
+			stack_frames__push(sf, "builtin#%s", lua_ffnames__get(eventp->ffid));
+		}
+		else
+		{
+			stack_frames__push(sf, "builtin#%d", eventp->ffid);
+		}
+	}
+	else
+	{
+		stack_frames__push(sf, "[unknown]");
+	}
+}
+
+/* The Lua frames of one segment, outermost first */
+static void fold_lua_segment(struct stack_frames *sf, const struct syms *syms,
+							 const struct stack_backtrace *lua_bt, int segment)
+{
+	for (int i = lua_bt->level_size - 1; i >= 0; i--)
+	{
+		if (lua_bt->stack[i].segment == segment)
+			fold_lua_func(sf, syms, &lua_bt->stack[i], lua_bt->func_names[i]);
+	}
 }
 
-static void print_fold_user_stack_with_lua(const struct stack_backtrace *lua_bt, const struct syms *syms, unsigned long *uip, unsigned int nr_uip)
+/*
+ * Find the native frame that entered the VM for each segment of the Lua
+ * stack, innermost first.  at[k] is the index in uip after which segment k
+ * goes, -1 for the leaf end.  Returns the number of segments found.
+ */
+static int find_lua_segments(const struct stack_backtrace *lua_bt, const unsigned long *uip,
+							 unsigned int nr_uip, int *at)
+{
+	const struct lua_segment *seg;
+	int found = 0, start = 0, i, j, k;
+
+	for (k = 0; k < lua_bt->nr_segments; k++)
+	{
+		seg = &lua_bt->segments[k];
+		at[k] = -1;
+		for (j = start; j < nr_uip && (seg->ret || seg->fp_ret); j++)
+		{
+			if (uip[j] == seg->ret || uip[j] == seg->fp_ret)
+			{
+				at[k] = j;
+				start = j + 1;
+				found++;
+				break;
+			}
+		}
+	}
+	/* a segment that was not found goes right before the next inner one */
+	for (k = 0; k < lua_bt->nr_segments; k++)
+	{
+		for (i = k; i >= 0 && at[i] == -1; i--)
+			;
+		at[k] = i >= 0 ? at[i] : -1;
+	}
+	return found;
+}
+
+/*
+ * Splice the Lua frames into the native user stack.  Each segment of the
+ * Lua stack runs inside one VM entry (lua_resume, lua_pcall, lua_call...),
+ * so it goes right after the native frame that made that call.  Unresolved
+ * native frames are JIT-compiled code, which the Lua frames stand for.
+ * When no VM entry is found, unresolved frames are replaced by Lua frames
+ * in order, and the rest of them go at the leaf.
+ */
+static void fold_user_stack_with_lua(struct stack_frames *sf, const struct stack_backtrace *lua_bt, const struct syms *syms, const unsigned long *uip, unsigned int nr_uip)
 {
 	const struct sym *sym = NULL;
 	int lua_bt_count = lua_bt->level_size - 1;
+	int at[MAX_LUA_SEGMENTS];
+	int seg = lua_bt->nr_segments - 1;
+
+	if (lua_bt->level_size > 0 && find_lua_segments(lua_bt, uip, nr_uip, at))
+	{
+		for (int j = nr_uip - 1; j >= 0; j--)
+		{
+			sym = syms__map_addr(syms, uip[j]);
+			if (sym && !env.lua_user_stacks_only)
+				stack_frames__push(sf, "%s", sym->name);
+			for (; seg >= 0 && at[seg] == j; seg--)
+				fold_lua_segment(sf, syms, lua_bt, seg);
+		}
+		for (; seg >= 0; seg--)
+			fold_lua_segment(sf, syms, lua_bt, seg);
+		return;
+	}
+
 	for (int j = nr_uip - 1; j >= 0; j--)
 	{
 		sym = syms__map_addr(syms, uip[j]);
@@ -459,304 +1351,1496 @@ static void print_fold_user_stack_with_lua(const struct stack_backtrace *lua_bt,
 		{
 			if (!env.lua_user_stacks_only)
 			{
-				printf(";%s", sym->name);
+				stack_frames__push(sf, "%s", sym->name);
 			}
 		}
 		else
 		{
 			if (lua_bt_count >= 0)
 			{
-				print_fold_lua_func(syms, &(lua_bt->stack[lua_bt_count]));
+				fold_lua_func(sf, syms, &(lua_bt->stack[lua_bt_count]), lua_bt->func_names[lua_bt_count]);
 				lua_bt_count--;
 			}
 		}
 	}
 	while (lua_bt_count >= 0)
 	{
-		print_fold_lua_func(syms, &(lua_bt->stack[lua_bt_count]));
+		fold_lua_func(sf, syms, &(lua_bt->stack[lua_bt_count]), lua_bt->func_names[lua_bt_count]);
 		lua_bt_count--;
 	}
 }
 
-static void print_map(struct ksyms *ksyms, struct syms_cache *syms_cache,
-					  struct profile_bpf *obj)
+static void print_folded_line(const char *const *frames, int nr_frames, __u64 v)
 {
-	const struct ksym *ksym;
-	const struct syms *syms = NULL;
+	for (int i = 0; i < nr_frames; i++)
+		printf(i ? ";%s" : "%s", frames[i]);
+	printf(" %lld\n", v);
+}
+
+/* Where folded stacks go: the flame graph or pprof writer, one side of a diff, or stdout */
+struct stack_sink
+{
+	struct flamegraph *fg;
+	struct pprof *pp;
+	struct folded_diff *diff;
+	int which;
+};
+
+/* cgroups that exist at the end of the run, for --per-container and raw captures */
+static struct cgroup_names *cgroup_names;
+
+static const char *container_name(const struct raw_sample *s, char *buf, size_t buf_sz)
+{
+	const char *name = s->container ?: cgroup_names__get(cgroup_names, s->key.cgroup_id);
+
+	if (name)
+		return name;
+	snprintf(buf, buf_sz, "cgroup %llu", s->key.cgroup_id);
+	return buf;
+}
+
+static void print_sample(const struct raw_sample *s, const struct syms *syms,
+						 struct stack_frames *sf, struct stack_sink *sink)
+{
+	const struct profile_key_t *k = &s->key;
+	const struct kernel_frame *kf;
 	const struct sym *sym;
-	int i, j, cfd, sfd;
-	struct stack_backtrace lua_bt = {0};
-	__u32 nr_count;
-	struct profile_key_t *k;
-	__u64 v;
-	unsigned long *kip;
-	unsigned long *uip;
-	bool has_collision = false;
-	unsigned int missing_stacks = 0;
-	struct key_ext_t counts[MAX_ENTRIES];
-	unsigned int nr_kip;
-	unsigned int nr_uip;
+	__u64 v = s->count;
+	int j, first_kernel;
 	int idx = 0;
+	char cgroup[32];
 
-	/* add 1 for kernel_ip */
-	kip = calloc(env.perf_max_stack_depth + 1, sizeof(*kip));
-	if (!kip)
+	if (!env.kernel_stacks_only && k->user_stack_id >= 0 && env.lua_user_stacks_only &&
+		env.folded && s->lua_bt->level_size <= 0)
 	{
-		fprintf(stderr, "failed to alloc kernel ip\n");
+		// if show lua user stack only, then we do not count the stack if it is not lua stack
 		return;
 	}
 
-	uip = calloc(env.perf_max_stack_depth, sizeof(*uip));
-	if (!uip)
+	if (env.folded)
 	{
-		fprintf(stderr, "failed to alloc user ip\n");
+		// build the folded stack, root first
+		stack_frames__reset(sf);
+		if (env.nr_events > 1 && k->event < env.nr_events)
+			stack_frames__push(sf, "%s", perf_events[env.events[k->event]].name);
+		if (env.per_container)
+			stack_frames__push(sf, "%s", container_name(s, cgroup, sizeof(cgroup)));
+		/* lock waits are rooted at their zone instead of the comm */
+		stack_frames__push(sf, "%s", k->zone[0] ? k->zone : k->name);
+
+		if (!env.kernel_stacks_only)
+		{
+			if (stack_id_err(k->user_stack_id))
+				stack_frames__push(sf, "[Missed User Stack]");
+			if (syms)
+			{
+				if (!env.disable_lua_user_trace)
+				{
+					fold_user_stack_with_lua(sf, s->lua_bt, syms, s->uip, s->nr_uip);
+				}
+				else
+				{
+					for (j = s->nr_uip - 1; j >= 0; j--)
+					{
+						sym = syms__map_addr(syms, s->uip[j]);
+						stack_frames__push(sf, "%s", sym ? sym->name : "[unknown]");
+					}
+				}
+			}
+		}
+		first_kernel = sf->nr;
+		if (!env.user_stacks_only)
+		{
+			if (env.delimiter && k->user_stack_id >= 0 &&
+				k->kern_stack_id >= 0)
+			{
+				stack_frames__push(sf, "-");
+				first_kernel = sf->nr;
+			}
+
+			if (stack_id_err(k->kern_stack_id))
+				stack_frames__push(sf, "[Missed Kernel Stack]");
+			for (j = s->nr_kframes - 1; j >= 0; j--)
+				stack_frames__push(sf, "%s", s->kframes[j].name ?: "[unknown]");
+		}
+
+		if (sink->fg)
+		{
+			flamegraph__add_stack(sink->fg, stack_frames__names(sf), sf->nr, first_kernel, v);
+		}
+		else if (sink->pp)
+		{
+			pprof__add_stack(sink->pp, stack_frames__names(sf), sf->nr, v);
+		}
+		else if (sink->diff)
+		{
+			/* the frames are NUL-separated, join them in place */
+			for (size_t i = 0; i + 1 < sf->len; i++)
+				if (!sf->buf[i])
+					sf->buf[i] = ';';
+			folded_diff__add(sink->diff, sink->which, sf->buf, sf->len - 1, v);
+		}
+		else
+		{
+			print_folded_line(stack_frames__names(sf), sf->nr, v);
+		}
 		return;
 	}
 
-	cfd = bpf_map__fd(obj->maps.counts);
-	sfd = bpf_map__fd(obj->maps.stackmap);
-
-	nr_count = MAX_ENTRIES;
-	if (!read_counts_map(cfd, counts, &nr_count))
+	// print default multi-line stack output
+	if (!env.user_stacks_only)
 	{
-		goto cleanup;
+		if (stack_id_err(k->kern_stack_id))
+			printf("    [Missed Kernel Stack]\n");
+		for (j = 0; j < s->nr_kframes; j++)
+		{
+			kf = &s->kframes[j];
+			if (kf->name)
+				printf("    #%-2d 0x%lx %s+0x%lx\n", idx++, kf->ip, kf->name, kf->offset);
+			else
+				printf("    #%-2d 0x%lx [unknown]\n", idx++, kf->ip);
+		}
 	}
 
-	qsort(counts, nr_count, sizeof(counts[0]), cmp_counts);
-
-	for (i = 0; i < nr_count; i++)
+	if (!env.kernel_stacks_only)
 	{
-		k = &counts[i].k;
-		v = counts[i].v;
-		nr_uip = 0;
-		nr_kip = 0;
-		idx = 0;
+		if (env.delimiter && k->kern_stack_id >= 0 &&
+			k->user_stack_id >= 0)
+			printf("    --\n");
 
-		if (!env.user_stacks_only && stack_id_err(k->kern_stack_id))
+		if (stack_id_err(k->user_stack_id))
+			printf("    [Missed User Stack]\n");
+		if (!syms)
 		{
-			missing_stacks += 1;
-			has_collision |= (k->kern_stack_id == -EEXIST);
+			for (j = 0; j < s->nr_uip; j++)
+				printf("    #%-2d 0x%016lx [unknown]\n", idx++, s->uip[j]);
 		}
-		if (!env.kernel_stacks_only && stack_id_err(k->user_stack_id))
+		else
 		{
-			missing_stacks += 1;
-			has_collision |= (k->user_stack_id == -EEXIST);
+			for (j = 0; j < s->nr_uip; j++)
+			{
+				char *dso_name;
+				uint64_t dso_offset;
+				sym = syms__map_addr_dso(syms, s->uip[j], &dso_name, &dso_offset);
+
+				printf("    #%-2d 0x%016lx", idx++, s->uip[j]);
+				if (sym)
+					printf(" %s+0x%lx", sym->name, sym->offset);
+				if (dso_name)
+					printf(" (%s+0x%lx)", dso_name, dso_offset);
+				printf("\n");
+			}
 		}
+	}
+
+	printf("    %-16s %s (%d)\n", "-", k->name, k->pid);
+	if (k->zone[0])
+		printf("    %-16s %s\n", "zone", k->zone);
+	if (env.nr_events > 1 && k->event < env.nr_events)
+		printf("    %-16s %s\n", "event", perf_events[env.events[k->event]].name);
+	if (env.per_container)
+		printf("    %-16s %s\n", "container", container_name(s, cgroup, sizeof(cgroup)));
+	printf("        %lld\n\n", v);
+}
+
+/* The value of a pprof sample is what the counts map weighs stacks by */
+static struct raw_sample_type sample_type(void)
+{
+	if (env.alloc)
+		return (struct raw_sample_type){"alloc_space", "bytes", "space", env.alloc_sample_bytes};
+	if (env.shdict_locks || env.runqlat)
+		return (struct raw_sample_type){"delay", "microseconds", "delay", 1};
+	return (struct raw_sample_type){"samples", "count", "samples", 1};
+}
+
+static struct pprof *new_pprof(const struct raw_sample_type *t)
+{
+	return pprof__new(t->type, t->unit, t->period_type, t->unit, t->period);
+}
+
+static void write_pprof(struct pprof *pp)
+{
+	if (pprof__write(pp, stdout))
+		fprintf(stderr, "failed to write the pprof profile\n");
+}
+
+static void write_flamegraph(struct flamegraph *fg, const char *title)
+{
+	unsigned long long start_ns = get_ktime_ns();
+
+	flamegraph__write_svg(fg, stdout, title);
+	if (env.verbose)
+		fprintf(stderr, "rendered %llu samples in %.3f ms\n", flamegraph__total(fg),
+				(get_ktime_ns() - start_ns) / 1e6);
+}
+
+/*
+ * Gather the stacks of one key into s.  kframes has room for
+ * perf_max_stack_depth + 1 frames; kframes and lua_bt are reused across
+ * calls.  Returns the symbols of the process, unless syms_cache is NULL.
+ */
+static const struct syms *build_sample(struct raw_sample *s, const struct profile_key_t *k, __u64 count,
+									   struct stack_table *st, struct ksyms *ksyms,
+									   struct syms_cache *syms_cache, struct kernel_frame *kframes,
+									   struct stack_backtrace *lua_bt)
+{
+	const struct syms *syms = NULL;
+	const struct ksym *ksym;
+	const unsigned long *stack;
+	unsigned int nr_ips;
+	int j;
+
+	memset(s, 0, sizeof(*s));
+	s->key = *k;
+	s->count = count;
+	s->lua_bt = lua_bt;
+	s->kframes = kframes;
+	lua_bt->level_size = 0;
+	lua_bt->nr_segments = 0;
+
+	if (!env.kernel_stacks_only && k->user_stack_id >= 0)
+	{
+		s->uip = stack_table_get(st, k->user_stack_id, &s->nr_uip);
+		if (s->uip && syms_cache)
+			syms = syms_cache__get_syms(syms_cache, k->pid);
+		get_lua_stack_backtrace(lua_bt_map, k->user_stack_id, k->lua_stack_hash, lua_bt);
+		lua_funcnames__resolve(lua_funcnames, k->pid, lua_bt);
+	}
 
-		if (!env.kernel_stacks_only && k->user_stack_id >= 0)
+	if (!env.user_stacks_only && k->kern_stack_id >= 0)
+	{
+		if (k->kernel_ip)
+			kframes[s->nr_kframes++].ip = k->kernel_ip;
+		stack = stack_table_get(st, k->kern_stack_id, &nr_ips);
+		for (j = 0; stack && j < nr_ips; j++)
+			kframes[s->nr_kframes++].ip = stack[j];
+		/* kernel symbols are resolved here, also for raw captures */
+		for (j = 0; j < s->nr_kframes; j++)
 		{
-			if (bpf_map_lookup_elem(sfd, &k->user_stack_id, uip) == 0)
-			{
-				/* count the number of ips */
-				while (nr_uip < env.perf_max_stack_depth && uip[nr_uip])
-					nr_uip++;
-				syms = syms_cache__get_syms(syms_cache, k->pid);
-			}
-			int stack_level = get_lua_stack_backtrace(lua_bt_map, k->user_stack_id, &lua_bt);
-			if (env.lua_user_stacks_only && env.folded) {
-				if (stack_level <= 0) {
-					// if show lua user stack only, then we do not count the stack if it is not lua stack
-					continue;
-				}
-			}
+			ksym = ksyms__map_addr(ksyms, kframes[j].ip);
+			kframes[j].name = ksym ? ksym->name : NULL;
+			kframes[j].offset = ksym ? kframes[j].ip - ksym->addr : 0;
 		}
+	}
+	return syms;
+}
+
+static void print_zone_stats(struct profile_bpf *obj)
+{
+	int fd = bpf_map__fd(obj->maps.zone_stats);
+	struct zone_key key = {}, next;
+	struct zone_stats stats;
+	void *prev = NULL;
+
+	while (!bpf_map_get_next_key(fd, prev, &next))
+	{
+		key = next;
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &stats) || !stats.locks)
+			continue;
+		printf("\nzone %s: %llu locks, avg wait %llu nsecs, avg hold %llu nsecs\n",
+			   key.name, stats.locks, stats.wait_ns / stats.locks, stats.hold_ns / stats.locks);
+		printf("  wait:\n");
+		print_log2_hist(stats.wait_hist, MAX_SLOTS, "nsecs");
+		printf("  hold:\n");
+		print_log2_hist(stats.hold_hist, MAX_SLOTS, "nsecs");
+	}
+}
+
+/*
+ * An allocation of size bytes is sampled with a chance of
+ * 1 - exp(-size / alloc_sample_bytes).  Scale the sampled bytes of every
+ * stack by the inverse of that chance at their average size, as Go does
+ * for its heap profiles.
+ */
+static void scale_alloc_samples(struct key_ext_t *counts, __u32 nr_count, int fd)
+{
+	__u64 nr_samples;
+	double avg;
+	__u32 i;
+
+	for (i = 0; i < nr_count; i++)
+	{
+		if (bpf_map_lookup_elem(fd, &counts[i].k, &nr_samples) || !nr_samples)
+			continue;
+		avg = (double)counts[i].v / nr_samples;
+		counts[i].v = counts[i].v / -expm1(-avg / env.alloc_sample_bytes);
+	}
+}
+
+static void print_rq_hists(struct profile_bpf *obj)
+{
+	int fd = bpf_map__fd(obj->maps.rq_hists);
+	__u32 key = 0, next;
+	struct rq_hist hist;
+	void *prev = NULL;
+
+	while (!bpf_map_get_next_key(fd, prev, &next))
+	{
+		key = next;
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &hist) || !hist.waits)
+			continue;
+		printf("\nPID %u: %llu waits, %llu after preemption, avg %llu usecs\n",
+			   key, hist.waits, hist.preempts, hist.total_us / hist.waits);
+		print_log2_hist(hist.slots, MAX_SLOTS, "usecs");
+	}
+}
+
+/* Cycles and instructions of the samples whose innermost Lua function is name */
+struct ipc_func
+{
+	char *name;
+	struct ipc_value v;
+};
+
+static struct ipc_func *ipc_funcs;
+static size_t nr_ipc_funcs, ipc_funcs_cap;
+
+/* The innermost Lua function of a sample, or its leaf symbol without one */
+static void add_ipc_sample(const struct raw_sample *s, const struct syms *syms,
+						   const struct ipc_value *v, struct stack_frames *sf)
+{
+	const struct sym *sym = NULL;
+	struct ipc_func *tmp;
+	const char *name;
+	size_t i;
+
+	stack_frames__reset(sf);
+	if (s->lua_bt->level_size > 0)
+		fold_lua_func(sf, syms, &s->lua_bt->stack[0], s->lua_bt->func_names[0]);
+	if (sf->nr)
+	{
+		name = stack_frames__names(sf)[0];
+	}
+	else
+	{
+		if (s->nr_uip)
+			sym = syms__map_addr(syms, s->uip[0]);
+		name = sym ? sym->name : "[unknown]";
+	}
 
-		if (!env.user_stacks_only && k->kern_stack_id >= 0)
+	for (i = 0; i < nr_ipc_funcs; i++)
+	{
+		if (!strcmp(ipc_funcs[i].name, name))
+			break;
+	}
+	if (i == nr_ipc_funcs)
+	{
+		if (nr_ipc_funcs == ipc_funcs_cap)
 		{
-			if (k->kernel_ip)
-				kip[nr_kip++] = k->kernel_ip;
-			if (bpf_map_lookup_elem(sfd, &k->kern_stack_id, kip + nr_kip) == 0)
+			ipc_funcs_cap = ipc_funcs_cap ? ipc_funcs_cap * 2 : 256;
+			tmp = realloc(ipc_funcs, ipc_funcs_cap * sizeof(*ipc_funcs));
+			if (!tmp)
 			{
-				/* count the number of ips */
-				while (nr_kip < env.perf_max_stack_depth && kip[nr_kip])
-					nr_kip++;
+				ipc_funcs_cap = nr_ipc_funcs;
+				return;
 			}
+			ipc_funcs = tmp;
 		}
+		ipc_funcs[i].name = strdup(name);
+		if (!ipc_funcs[i].name)
+			return;
+		memset(&ipc_funcs[i].v, 0, sizeof(ipc_funcs[i].v));
+		nr_ipc_funcs++;
+	}
+	ipc_funcs[i].v.cycles += v->cycles;
+	ipc_funcs[i].v.instructions += v->instructions;
+}
 
-		if (env.folded)
-		{
-			// print folded stack output
-			printf("%s", k->name);
+static int cmp_ipc_funcs(const void *a, const void *b)
+{
+	const struct ipc_func *x = a, *y = b;
 
-			if (!env.kernel_stacks_only)
-			{
-				if (stack_id_err(k->user_stack_id))
-					printf(";[Missed User Stack]");
-				if (syms)
-				{
-					if (!env.disable_lua_user_trace)
-					{
-						print_fold_user_stack_with_lua(&lua_bt, syms, uip, nr_uip);
-					}
-					else
-					{
-						const struct sym *sym = NULL;
-						for (int j = nr_uip - 1; j >= 0; j--)
-						{
-							sym = syms__map_addr(syms, uip[j]);
-							printf(";%s", sym ? sym->name : "[unknown]");
-						}
-					}
-				}
-			}
-			if (!env.user_stacks_only)
-			{
-				if (env.delimiter && k->user_stack_id >= 0 &&
-					k->kern_stack_id >= 0)
-					printf(";-");
+	if (x->v.cycles == y->v.cycles)
+		return 0;
+	return x->v.cycles < y->v.cycles ? 1 : -1;
+}
 
-				if (stack_id_err(k->kern_stack_id))
-					printf(";[Missed Kernel Stack]");
-				for (j = nr_kip - 1; j >= 0; j--)
-				{
-					ksym = ksyms__map_addr(ksyms, kip[j]);
-					printf(";%s", ksym ? ksym->name : "[unknown]");
-				}
-			}
-			printf(" %lld\n", v);
-		}
-		else
+#define NR_IPC_FUNCS_SHOWN 30
+
+static void print_ipc_funcs(void)
+{
+	size_t i, n;
+
+	qsort(ipc_funcs, nr_ipc_funcs, sizeof(*ipc_funcs), cmp_ipc_funcs);
+	n = env.top > 0 ? env.top : NR_IPC_FUNCS_SHOWN;
+	if (n > nr_ipc_funcs)
+		n = nr_ipc_funcs;
+
+	printf("\n%16s %16s %6s  %s\n", "CYCLES", "INSTRUCTIONS", "IPC", "FUNCTION");
+	for (i = 0; i < n; i++)
+	{
+		printf("%16llu %16llu %6.2f  %s\n", ipc_funcs[i].v.cycles, ipc_funcs[i].v.instructions,
+			   (double)ipc_funcs[i].v.instructions / ipc_funcs[i].v.cycles, ipc_funcs[i].name);
+	}
+	for (i = 0; i < nr_ipc_funcs; i++)
+		free(ipc_funcs[i].name);
+	free(ipc_funcs);
+	ipc_funcs = NULL;
+	nr_ipc_funcs = ipc_funcs_cap = 0;
+}
+
+/* Event loop iterations that went over --stall-threshold */
+static struct stall_event *stalls;
+static size_t nr_stalls, stalls_cap;
+
+static void handle_stall_event(void *ctx, int cpu, void *data, __u32 data_sz)
+{
+	struct stall_event *tmp;
+
+	if (nr_stalls == stalls_cap)
+	{
+		stalls_cap = stalls_cap ? stalls_cap * 2 : 256;
+		tmp = realloc(stalls, stalls_cap * sizeof(*stalls));
+		if (!tmp)
 		{
-			// print default multi-line stack output
-			if (!env.user_stacks_only)
-			{
-				if (stack_id_err(k->kern_stack_id))
-					printf("    [Missed Kernel Stack]\n");
-				for (j = 0; j < nr_kip; j++)
-				{
-					ksym = ksyms__map_addr(ksyms, kip[j]);
-					if (ksym)
-						printf("    #%-2d 0x%lx %s+0x%lx\n", idx++, kip[j], ksym->name, kip[j] - ksym->addr);
-					else
-						printf("    #%-2d 0x%lx [unknown]\n", idx++, kip[j]);
-				}
-			}
+			stalls_cap = nr_stalls;
+			return;
+		}
+		stalls = tmp;
+	}
+	stalls[nr_stalls++] = *(const struct stall_event *)data;
+}
 
-			if (!env.kernel_stacks_only)
-			{
-				if (env.delimiter && k->kern_stack_id >= 0 &&
-					k->user_stack_id >= 0)
-					printf("    --\n");
+static int cmp_stalls(const void *a, const void *b)
+{
+	const struct stall_event *x = a, *y = b;
 
-				if (stack_id_err(k->user_stack_id))
-					printf("    [Missed User Stack]\n");
-				if (!syms)
-				{
-					for (j = 0; j < nr_uip; j++)
-						printf("    #%-2d 0x%016lx [unknown]\n", idx++, uip[j]);
-				}
-				else
-				{
-					for (j = 0; j < nr_uip; j++)
-					{
-						char *dso_name;
-						uint64_t dso_offset;
-						sym = syms__map_addr_dso(syms, uip[j], &dso_name, &dso_offset);
-
-						printf("    #%-2d 0x%016lx", idx++, uip[j]);
-						if (sym)
-							printf(" %s+0x%lx", sym->name, sym->offset);
-						if (dso_name)
-							printf(" (%s+0x%lx)", dso_name, dso_offset);
-						printf("\n");
-					}
-				}
-			}
+	if (x->duration_ns == y->duration_ns)
+		return 0;
+	return x->duration_ns > y->duration_ns ? -1 : 1;
+}
+
+#define NR_STALLS_SHOWN 10
 
-			printf("    %-16s %s (%d)\n", "-", k->name, k->pid);
-			printf("        %lld\n\n", v);
+static void print_stalls(struct ksyms *ksyms, struct syms_cache *syms_cache, struct profile_bpf *obj,
+						 struct stack_table *st, struct kernel_frame *kframes,
+						 struct stack_backtrace *lua_bt, struct stack_frames *sf)
+{
+	struct stack_sink sink = {};
+	struct profile_key_t k;
+	const struct syms *syms;
+	struct raw_sample s;
+	size_t i, n;
+
+	printf("\nEvent loop iteration busy time:\n");
+	print_log2_hist(obj->bss->loop_hist, MAX_SLOTS, "usecs");
+
+	qsort(stalls, nr_stalls, sizeof(*stalls), cmp_stalls);
+	n = env.top > 0 ? env.top : NR_STALLS_SHOWN;
+	if (n > nr_stalls)
+		n = nr_stalls;
+	printf("\n%zu iterations over %d ms", nr_stalls, env.stall_threshold_ms);
+	if (n)
+		printf(", the %zu longest (usecs):", n);
+	printf("\n\n");
+
+	for (i = 0; i < n; i++)
+	{
+		printf("    stall #%zu of %.3f ms on TID %u\n", i + 1, stalls[i].duration_ns / 1e6, stalls[i].tid);
+		if (!stalls[i].sampled)
+		{
+			printf("    [No Sample Taken]\n\n");
+			continue;
 		}
+		memset(&k, 0, sizeof(k));
+		k.pid = stalls[i].pid;
+		k.user_stack_id = stalls[i].user_stack_id;
+		k.kern_stack_id = stalls[i].kern_stack_id;
+		memcpy(k.name, stalls[i].name, sizeof(k.name));
+		syms = build_sample(&s, &k, stalls[i].duration_ns / 1000, st, ksyms, syms_cache, kframes, lua_bt);
+		print_sample(&s, syms, sf, &sink);
+	}
+}
+
+/* Stack id requests of every CPU so far */
+static int read_stack_stats(struct profile_bpf *obj, struct stack_stats *total)
+{
+	struct stack_stats *percpu;
+	__u32 zero = 0;
+	int i;
+
+	percpu = calloc(nr_cpus, sizeof(*percpu));
+	if (!percpu)
+		return -1;
+	memset(total, 0, sizeof(*total));
+	if (bpf_map_lookup_elem(bpf_map__fd(obj->maps.stack_stats), &zero, percpu))
+	{
+		free(percpu);
+		return -1;
+	}
+	for (i = 0; i < nr_cpus; i++)
+	{
+		total->stacks += percpu[i].stacks;
+		total->collisions += percpu[i].collisions;
+		total->failures += percpu[i].failures;
 	}
+	free(percpu);
+	return 0;
+}
+
+static const char *stack_storage_advice(void)
+{
+	static char advice[128];
+
+	snprintf(advice, sizeof(advice), "consider --stack-storage-size %d%s",
+			 env.stack_storage_size * 4, env.stack_dedup ? "" : " or --stack-dedup");
+	return advice;
+}
+
+#define STACK_STATS_INTERVAL_NS (5 * NSEC_PER_SEC)
+/* warn while running once this share of the stacks got no id */
+#define STACK_COLLISIONS_WARN 0.01
+
+/*
+ * Report stack storage problems while the capture is still running, when
+ * restarting with a bigger table still helps.  With -v also print how full
+ * the table is, which takes one syscall per stored stack.
+ */
+static void check_stack_stats(struct profile_bpf *obj)
+{
+	static bool warned;
+	struct bpf_map *map = env.stack_dedup ? obj->maps.stack_dedup : obj->maps.stackmap;
+	struct stack_stats stats;
+	__u32 key, *prev = NULL, used = 0;
+
+	if (read_stack_stats(obj, &stats) || !stats.stacks)
+		return;
+	if (env.verbose)
+	{
+		while (!bpf_map_get_next_key(bpf_map__fd(map), prev, &key))
+		{
+			prev = &key;
+			used++;
+		}
+		fprintf(stderr, "stack storage: %u of %u slots used, %llu requests, %llu collisions, "
+						"%llu failures\n",
+				used, bpf_map__max_entries(map), stats.stacks, stats.collisions, stats.failures);
+	}
+	if (!warned && stats.collisions > stats.stacks * STACK_COLLISIONS_WARN)
+	{
+		fprintf(stderr, "WARNING: %llu of %llu stacks (%.1f%%) lost to collisions so far, %s\n",
+				stats.collisions, stats.stacks, 100.0 * stats.collisions / stats.stacks,
+				stack_storage_advice());
+		warned = true;
+	}
+}
+
+/* Smallest power of two not below n */
+static __u32 roundup_pow_of_two(__u32 n)
+{
+	__u32 v = 1;
+
+	while (v < n && v < (1U << 31))
+		v <<= 1;
+	return v;
+}
+
+/* the stack storage is preallocated, keep it under this */
+#define STACK_STORAGE_MAX_BYTES (64ULL << 20)
+#define STACK_STORAGE_MIN 8192
+
+/*
+ * Size the stack storage from the samples the run is expected to take,
+ * counting a user and a kernel stack per sample and assuming one in 16 is
+ * new.  The table is kept four times larger than that, as bucket
+ * collisions grow with the square of its load.
+ */
+static int estimate_stack_storage(void)
+{
+	unsigned long long samples, max;
+	int cpus = 0, i, duration;
+	__u32 size;
+
+	max = STACK_STORAGE_MAX_BYTES / (env.perf_max_stack_depth * sizeof(unsigned long));
+	if (env.shdict_locks || env.runqlat || env.alloc || !env.freq)
+		return STACK_STORAGE_MIN;
+
+	for (i = 0; i < nr_cpus; i++)
+		cpus += cpu_wanted(i);
+	duration = env.duration < 60 ? env.duration : 60;
+	samples = (unsigned long long)env.sample_freq * cpus * duration * env.nr_events;
+	if (!env.user_stacks_only && !env.kernel_stacks_only)
+		samples *= 2;
+	samples = samples / 16 * 4;
+	if (samples < STACK_STORAGE_MIN)
+		return STACK_STORAGE_MIN;
+	size = roundup_pow_of_two(samples < max ? samples : max);
+	while (size > max && size > STACK_STORAGE_MIN)
+		size >>= 1;
+	return size;
+}
+
+static void print_map(struct ksyms *ksyms, struct syms_cache *syms_cache,
+					  struct profile_bpf *obj)
+{
+	const struct syms *syms;
+	int i, cfd, sfd;
+	struct stack_backtrace lua_bt = {0};
+	__u32 nr_count;
+	struct profile_key_t *k;
+	struct kernel_frame *kframes;
+	struct stack_table *st = NULL;
+	struct bpf_map *stack_map;
+	struct stack_stats stats;
+	unsigned long long start_ns;
+	bool has_collision = false;
+	unsigned int missing_stacks = 0;
+	struct key_ext_t *counts = NULL;
+	struct stack_frames sf = {};
+	struct stack_sink sink = {};
+	struct raw_writer *raw = NULL;
+	struct lua_heatmap *heat = NULL;
+	struct ipc_value ipc;
+	struct raw_sample s;
+	struct raw_sample_type type = sample_type();
+
+	/* add 1 for kernel_ip */
+	kframes = calloc(env.perf_max_stack_depth + 1, sizeof(*kframes));
+	if (!kframes)
+	{
+		fprintf(stderr, "failed to alloc kernel frames\n");
+		return;
+	}
+
+	if (env.raw_path)
+	{
+		raw = raw_writer__open(env.raw_path, &type);
+		if (!raw)
+		{
+			fprintf(stderr, "failed to open %s: %s\n", env.raw_path, strerror(errno));
+			goto cleanup;
+		}
+	}
+	else if (env.format == FORMAT_SVG)
+	{
+		sink.fg = flamegraph__new();
+		if (!sink.fg)
+		{
+			fprintf(stderr, "failed to create flame graph\n");
+			goto cleanup;
+		}
+	}
+	else if (env.format == FORMAT_HEATMAP)
+	{
+		heat = lua_heatmap__new();
+	}
+	else if (env.format == FORMAT_PPROF)
+	{
+		sink.pp = new_pprof(&type);
+	}
+
+	cfd = bpf_map__fd(obj->maps.counts);
+	stack_map = env.stack_dedup ? obj->maps.stack_dedup : obj->maps.stackmap;
+	sfd = bpf_map__fd(stack_map);
+
+	/* raw captures name the containers, for report --per-container */
+	if (env.per_container || raw)
+	{
+		cgroup_names = cgroup_names__load();
+		if (!cgroup_names)
+			fprintf(stderr, "failed to read the cgroup v2 hierarchy, containers are shown by id\n");
+	}
+
+	start_ns = get_ktime_ns();
+	counts = read_counts_map(cfd, bpf_map__max_entries(obj->maps.counts), &nr_count);
+	if (!counts)
+	{
+		goto cleanup;
+	}
+
+	st = new_stack_table(sfd, bpf_map__max_entries(stack_map), env.perf_max_stack_depth);
+	if (!st)
+	{
+		fprintf(stderr, "failed to alloc the stack table\n");
+		goto cleanup;
+	}
+	if (env.verbose)
+		fprintf(stderr, "read %u keys in %.3f ms\n", nr_count, (get_ktime_ns() - start_ns) / 1e6);
+	/* before sorting, the hottest stacks are those that allocated the most */
+	if (env.alloc)
+		scale_alloc_samples(counts, nr_count, bpf_map__fd(obj->maps.alloc_samples));
+
+	/* the heatmap shows the top chunks, from every stack */
+	if (env.top > 0 && env.top < nr_count && !heat)
+	{
+		/* only the hottest stacks are wanted, skip sorting the tail */
+		select_top_counts(counts, nr_count, env.top);
+		nr_count = env.top;
+	}
+	qsort(counts, nr_count, sizeof(counts[0]), cmp_counts);
+
+	for (i = 0; i < nr_count; i++)
+	{
+		k = &counts[i].k;
+		syms = build_sample(&s, k, counts[i].v, st, ksyms, raw ? NULL : syms_cache,
+							kframes, &lua_bt);
+
+		if (!env.user_stacks_only && stack_id_err(k->kern_stack_id))
+		{
+			missing_stacks += 1;
+			has_collision |= (k->kern_stack_id == -EEXIST);
+		}
+		if (!env.kernel_stacks_only && stack_id_err(k->user_stack_id))
+		{
+			missing_stacks += 1;
+			has_collision |= (k->user_stack_id == -EEXIST);
+		}
+
+		if (raw)
+		{
+			s.container = cgroup_names__get(cgroup_names, k->cgroup_id);
+			raw_writer__add_sample(raw, &s);
+		}
+		else if (heat)
+			lua_heatmap__add(heat, k->pid, s.lua_bt, s.count);
+		else
+			print_sample(&s, syms, &sf, &sink);
+
+		if (env.ipc && !raw && !env.folded &&
+			!bpf_map_lookup_elem(bpf_map__fd(obj->maps.ipc_counts), k, &ipc))
+			add_ipc_sample(&s, syms, &ipc, &sf);
+	}
+
+	if (sink.fg)
+		write_flamegraph(sink.fg, "Flame Graph");
+	else if (sink.pp)
+		write_pprof(sink.pp);
+	else if (heat)
+		lua_heatmap__print(heat, stdout, env.top);
+	else if (env.stall_threshold_ms && !raw && !env.folded)
+		print_stalls(ksyms, syms_cache, obj, st, kframes, &lua_bt, &sf);
+	else if (env.shdict_locks && !raw && !env.folded)
+		print_zone_stats(obj);
+	else if (env.runqlat && !raw && !env.folded)
+		print_rq_hists(obj);
+	else if (env.ipc && !raw && !env.folded)
+		print_ipc_funcs();
+	if (env.verbose)
+		fprintf(stderr, "read %u stacks from the stackmap\n", st->nr_stacks);
+
+	if (missing_stacks > 0)
+	{
+		fprintf(stderr, "WARNING: %d stack traces could not be displayed.\n", missing_stacks);
+		if (has_collision && !read_stack_stats(obj, &stats))
+			fprintf(stderr, "WARNING: %llu of %llu stacks were lost to collisions, %s\n",
+					stats.collisions, stats.stacks, stack_storage_advice());
+	}
+
+cleanup:
+	if (raw && raw_writer__close(raw))
+		fprintf(stderr, "failed to write %s\n", env.raw_path);
+	flamegraph__free(sink.fg);
+	pprof__free(sink.pp);
+	lua_heatmap__free(heat);
+	stack_frames__free(&sf);
+	free_stack_table(st);
+	free(counts);
+	free(kframes);
+	cgroup_names__free(cgroup_names);
+	cgroup_names = NULL;
+}
+
+static void handle_lua_stack_event(void *ctx, int cpu, void *data, __u32 data_sz)
+{
+	int err;
+	const struct lua_stack_event *e = data;
+	struct tm *tm;
+	char ts[16];
+	time_t t;
+
+	time(&t);
+	tm = localtime(&t);
+	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+	err = insert_lua_stack_map(lua_bt_map, e);
+	if (err)
+		fprintf(stderr, "failed to insert lua stack map\n");
+}
+
+static void handle_lua_stack_lost_events(void *ctx, int cpu, __u64 lost_cnt)
+{
+	warn("lost %llu events on CPU #%d\n", lost_cnt, cpu);
+}
+
+static int attach_lua_uprobes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	char lua_path[128];
+	if (env.lib_pid)
+	{
+		int res = 0;
+
+		res = get_pid_lib_path(env.lib_pid, "luajit-5.1.so", lua_path, sizeof(lua_path));
+		if (res < 0)
+		{
+			fprintf(stderr, "failed to get lib path for pid %d\n", env.lib_pid);
+			return -1;
+		}
+	}
+
+	off_t func_off = get_elf_func_offset(lua_path, "lua_resume");
+	if (func_off < 0)
+	{
+		warn("could not find lua_resume in %s\n", lua_path);
+		return -1;
+	}
+	links[0] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua, false,
+										  -1, lua_path, func_off);
+	if (!links[0])
+	{
+		warn("failed to attach lua_resume: %d\n", -errno);
+		return -1;
+	}
+
+	func_off = get_elf_func_offset(lua_path, "lua_pcall");
+	if (func_off < 0)
+	{
+		warn("could not find lua_pcall in %s\n", lua_path);
+		return -1;
+	}
+	links[1] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua, false,
+										  -1, lua_path, func_off);
+	if (!links[1])
+	{
+		warn("failed to attach lua_pcall: %d\n", -errno);
+		return -1;
+	}
+
+	func_off = get_elf_func_offset(lua_path, "lua_yield");
+	if (func_off < 0)
+	{
+		warn("could not find lua_yield in %s\n", lua_path);
+		return -1;
+	}
+	links[2] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua_cancel, false,
+										  -1, lua_path, func_off);
+	if (!links[2])
+	{
+		warn("failed to attach lua_yield: %d\n", -errno);
+		return -1;
+	}
+
+	const char *version = lua_ffnames__detect(lua_path);
+	int match = version ? lua_ffnames__select(version) : -1;
+	if (match < 0)
+		warn("no fast function names for LuaJIT %s, showing builtin#ffid\n",
+			 version ?: "of unknown version");
+	else if (env.verbose)
+		fprintf(stderr, "LuaJIT %s\n", version);
+	return 0;
+}
+
+/* Symbolize a raw capture, sending every sample through print_sample */
+static int report_raw(const char *path, const char *sysroot, struct stack_sink *sink)
+{
+	struct stack_frames sf = {};
+	const struct syms *syms;
+	struct raw_reader *r;
+	struct raw_sample s;
+	int err, n = 0;
+
+	r = raw_reader__open(path, sysroot);
+	if (!r)
+	{
+		fprintf(stderr, "failed to read raw capture %s\n", path);
+		return -1;
+	}
+	if (env.format == FORMAT_PPROF && !sink->diff)
+		sink->pp = new_pprof(raw_reader__sample_type(r));
+	/* samples were written hottest first */
+	while ((err = raw_reader__next(r, &s)) > 0 && (env.top <= 0 || n++ < env.top))
+	{
+		syms = s.uip ? raw_reader__syms(r, s.key.pid) : NULL;
+		print_sample(&s, syms, &sf, sink);
+	}
+	if (err < 0)
+		fprintf(stderr, "%s is malformed\n", path);
+
+	stack_frames__free(&sf);
+	raw_reader__close(r);
+	return err < 0 ? -1 : 0;
+}
+
+#define STALL_LINKS 4
+
+static int attach_loop_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	char nginx_path[PATH_MAX];
+	off_t func_off;
+
+	if (resolve_binary_path(env.lib_pid != -1 ? "" : "nginx", env.lib_pid != -1 ? env.lib_pid : 0,
+							nginx_path, sizeof(nginx_path)))
+		return -1;
+
+	func_off = get_elf_func_offset(nginx_path, "ngx_process_events_and_timers");
+	if (func_off < 0)
+	{
+		warn("could not find ngx_process_events_and_timers in %s\n", nginx_path);
+		return -1;
+	}
+	links[0] = bpf_program__attach_uprobe(obj->progs.handle_loop_entry, false,
+										  -1, nginx_path, func_off);
+	links[1] = bpf_program__attach_uprobe(obj->progs.handle_loop_return, true,
+										  -1, nginx_path, func_off);
+	if (!links[0] || !links[1])
+	{
+		warn("failed to attach ngx_process_events_and_timers: %d\n", -errno);
+		return -1;
+	}
+
+	/* arm64 only has epoll_pwait */
+	links[2] = bpf_program__attach(obj->progs.handle_epoll_wait_exit);
+	links[3] = bpf_program__attach(obj->progs.handle_epoll_pwait_exit);
+	if (!links[2] && !links[3])
+	{
+		warn("failed to attach epoll_wait tracepoints: %d\n", -errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Entry points of ngx.shared.DICT methods, their first argument is the zone.
+ * The zone is forgotten on return, as some calls return without locking.
+ */
+static const char *shdict_funcs[] = {
+	"ngx_http_lua_ffi_shdict_get",
+	"ngx_http_lua_ffi_shdict_store",
+	"ngx_http_lua_ffi_shdict_incr",
+	"ngx_http_lua_ffi_shdict_flush_all",
+	"ngx_http_lua_ffi_shdict_get_ttl",
+	"ngx_http_lua_ffi_shdict_set_expire",
+	"ngx_http_lua_ffi_shdict_free_space",
+};
+
+#define NR_SHDICT_FUNCS (sizeof(shdict_funcs) / sizeof(shdict_funcs[0]))
+#define SHDICT_LINKS (3 + 2 * NR_SHDICT_FUNCS)
+
+static int attach_lock_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	char nginx_path[PATH_MAX];
+	off_t func_off;
+	int i, n = 0;
+
+	if (resolve_binary_path(env.lib_pid != -1 ? "" : "nginx", env.lib_pid != -1 ? env.lib_pid : 0,
+							nginx_path, sizeof(nginx_path)))
+		return -1;
+
+	func_off = get_elf_func_offset(nginx_path, "ngx_shmtx_lock");
+	if (func_off < 0)
+	{
+		warn("could not find ngx_shmtx_lock in %s\n", nginx_path);
+		return -1;
+	}
+	links[0] = bpf_program__attach_uprobe(obj->progs.handle_lock_entry, false,
+										  -1, nginx_path, func_off);
+	links[1] = bpf_program__attach_uprobe(obj->progs.handle_lock_return, true,
+										  -1, nginx_path, func_off);
+	if (!links[0] || !links[1])
+	{
+		warn("failed to attach ngx_shmtx_lock: %d\n", -errno);
+		return -1;
+	}
+
+	func_off = get_elf_func_offset(nginx_path, "ngx_shmtx_unlock");
+	if (func_off < 0)
+	{
+		warn("could not find ngx_shmtx_unlock in %s\n", nginx_path);
+		return -1;
+	}
+	links[2] = bpf_program__attach_uprobe(obj->progs.handle_unlock, false,
+										  -1, nginx_path, func_off);
+	if (!links[2])
+	{
+		warn("failed to attach ngx_shmtx_unlock: %d\n", -errno);
+		return -1;
+	}
+
+	/* older lua-nginx-module releases lack some of these */
+	for (i = 0; i < NR_SHDICT_FUNCS; i++)
+	{
+		func_off = get_elf_func_offset(nginx_path, shdict_funcs[i]);
+		if (func_off < 0)
+			continue;
+		links[3 + 2 * i] = bpf_program__attach_uprobe(obj->progs.handle_shdict_entry, false,
+													  -1, nginx_path, func_off);
+		links[4 + 2 * i] = bpf_program__attach_uprobe(obj->progs.handle_shdict_return, true,
+													  -1, nginx_path, func_off);
+		if (links[3 + 2 * i] && links[4 + 2 * i])
+		{
+			n++;
+			continue;
+		}
+		/* a zone that is never forgotten names unrelated locks */
+		bpf_link__destroy(links[3 + 2 * i]);
+		bpf_link__destroy(links[4 + 2 * i]);
+		links[3 + 2 * i] = links[4 + 2 * i] = NULL;
+	}
+	if (!n)
+		warn("no ngx.shared.DICT functions in %s, all locks will show as [other]\n",
+			 nginx_path);
+	return 0;
+}
+
+#define SSL_LINKS 2
+
+static int attach_ssl_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	char ssl_path[PATH_MAX];
+	off_t func_off;
+
+	/* OpenResty builds link OpenSSL into nginx */
+	if (resolve_lib_or_binary("ssl", "nginx", env.lib_pid != -1 ? env.lib_pid : 0,
+							  ssl_path, sizeof(ssl_path)))
+		return -1;
+
+	func_off = get_elf_func_offset(ssl_path, "SSL_do_handshake");
+	if (func_off < 0)
+	{
+		warn("could not find SSL_do_handshake in %s\n", ssl_path);
+		return -1;
+	}
+	links[0] = bpf_program__attach_uprobe(obj->progs.handle_ssl_entry, false,
+										  -1, ssl_path, func_off);
+	links[1] = bpf_program__attach_uprobe(obj->progs.handle_ssl_return, true,
+										  -1, ssl_path, func_off);
+	if (!links[0] || !links[1])
+	{
+		warn("failed to attach SSL_do_handshake: %d\n", -errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * LuaJIT allocates everything through lj_alloc_f, its own allocator;
+ * builds with the system allocator only have lj_mem_newgco, which misses
+ * the array and hash parts of tables.  Both are internal symbols, only
+ * found in the .symtab of unstripped builds.
+ */
+#define ALLOC_LINKS 1
+
+static int attach_alloc_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	char lua_path[PATH_MAX];
+	off_t func_off;
+
+	/* OpenResty builds may link LuaJIT into nginx */
+	if (resolve_lib_or_binary("luajit-5.1.so", "nginx", env.lib_pid != -1 ? env.lib_pid : 0,
+							  lua_path, sizeof(lua_path)))
+		return -1;
+
+	func_off = get_elf_func_offset(lua_path, "lj_alloc_f");
+	if (func_off >= 0)
+	{
+		links[0] = bpf_program__attach_uprobe(obj->progs.handle_alloc_f, false,
+											  -1, lua_path, func_off);
+	}
+	else
+	{
+		func_off = get_elf_func_offset(lua_path, "lj_mem_newgco");
+		if (func_off < 0)
+		{
+			warn("could not find lj_alloc_f or lj_mem_newgco in %s, is it stripped?\n", lua_path);
+			return -1;
+		}
+		warn("no lj_alloc_f in %s, only sampling new GC objects\n", lua_path);
+		links[0] = bpf_program__attach_uprobe(obj->progs.handle_newgco, false,
+											  -1, lua_path, func_off);
+	}
+	if (!links[0])
+	{
+		warn("failed to attach the LuaJIT allocator: %d\n", -errno);
+		return -1;
+	}
+	return 0;
+}
+
+#define RQ_LINKS 3
+
+static int attach_rq_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	links[0] = bpf_program__attach(obj->progs.handle_rq_wakeup);
+	links[1] = bpf_program__attach(obj->progs.handle_rq_wakeup_new);
+	links[2] = bpf_program__attach(obj->progs.handle_rq_switch);
+	if (!links[0] || !links[1] || !links[2])
+	{
+		warn("failed to attach sched tracepoints: %d\n", -errno);
+		return -1;
+	}
+	return 0;
+}
+
+#define TARGET_LINKS 3
+
+static int attach_target_probes(struct profile_bpf *obj, struct bpf_link *links[])
+{
+	links[0] = bpf_program__attach(obj->progs.handle_target_fork);
+	links[1] = bpf_program__attach(obj->progs.handle_target_exec);
+	links[2] = bpf_program__attach(obj->progs.handle_target_exit);
+	if (!links[0] || !links[1] || !links[2])
+	{
+		warn("failed to attach process tracepoints: %d\n", -errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int add_target(int map_fd, pid_t pid)
+{
+	__u8 one = 1;
+
+	if (bpf_map_update_elem(map_fd, &pid, &one, BPF_ANY))
+	{
+		warn("too many processes to profile, at most %d\n", MAX_TARGETS);
+		return -1;
+	}
+	if (env.lib_pid == -1)
+		env.lib_pid = pid;
+	return 0;
+}
+
+/*
+ * The -p pids, then the processes running now that --master or --comm
+ * select; the tracepoints above keep the set current from here on.
+ */
+static int fill_targets(int map_fd)
+{
+	char path[64], comm[TASK_COMM_LEN];
+	struct dirent *d;
+	pid_t pid, ppid;
+	DIR *dir;
+	FILE *f;
+	int i;
+
+	for (i = 0; i < env.nr_pids; i++)
+	{
+		if (add_target(map_fd, env.pids[i]))
+			return -1;
+	}
+	if (env.master != -1 && add_target(map_fd, env.master))
+		return -1;
+	if (env.master == -1 && !env.comm)
+		return 0;
+
+	dir = opendir("/proc");
+	if (!dir)
+	{
+		warn("failed to open /proc: %s\n", strerror(errno));
+		return -1;
+	}
+	while ((d = readdir(dir)))
+	{
+		pid = strtol(d->d_name, NULL, 10);
+		if (pid <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%*d (%15[^)]) %*c %d", comm, &ppid) != 2)
+			ppid = 0;
+		fclose(f);
+		if ((env.master != -1 && ppid == env.master) || (env.comm && !strcmp(comm, env.comm)))
+		{
+			if (add_target(map_fd, pid))
+			{
+				closedir(dir);
+				return -1;
+			}
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+/* 16 bytes each, enough for nginx, LuaJIT, OpenSSL and libc */
+#define UNWIND_MAX_ROWS (1 << 20)
+
+/*
+ * Unwind tables of the target processes running now; workers forked later
+ * get a copy of the tables of their parent in BPF.
+ */
+static int fill_unwind_tables(struct profile_bpf *obj)
+{
+	int procs_fd = bpf_map__fd(obj->maps.unwind_procs);
+	int tgids_fd = bpf_map__fd(obj->maps.targ_tgids);
+	struct unwind_tables *tables;
+	pid_t pid, next;
+	void *prev = NULL;
+	int err = 0;
+
+	tables = unwind_tables__new(bpf_map__fd(obj->maps.unwind_rows), UNWIND_MAX_ROWS, env.verbose);
+	if (!tables)
+	{
+		warn("failed to alloc unwind tables\n");
+		return -1;
+	}
+	if (env.pid != -1)
+		err = unwind_tables__add_pid(tables, env.pid, procs_fd);
+	while (env.pid == -1 && !err && !bpf_map_get_next_key(tgids_fd, prev, &next))
+	{
+		pid = next;
+		prev = &pid;
+		err = unwind_tables__add_pid(tables, pid, procs_fd);
+		/* exited since the scan */
+		if (err == -ENOENT)
+			err = 0;
+	}
+	if (err)
+		warn("failed to build unwind tables: %s\n", strerror(-err));
+	else if (env.verbose)
+		fprintf(stderr, "unwind tables: %u rows\n", unwind_tables__nr_rows(tables));
+	unwind_tables__free(tables);
+	return err;
+}
+
+static struct report_env
+{
+	const char *file;
+	const char *sysroot;
+} report_env;
+
+const char report_doc[] =
+	"Symbolize a capture written by profile --output-raw.\n"
+	"\n"
+	"USAGE: profile report [OPTIONS...] FILE\n"
+	"Kernel frames were resolved on the capturing host; user frames are resolved\n"
+	"here, from binaries that must match the recorded build-ids.\n"
+	"EXAMPLES:\n"
+	"    profile report a.raw                 # multi-line stacks\n"
+	"    profile report -f a.raw > a.folded   # folded format for flame graphs\n"
+	"    profile report --format=svg --sysroot /srv/host1 a.raw > a.svg\n";
+
+static const struct argp_option report_opts[] = {
+	{"user-stacks-only", 'U', NULL, 0,
+	 "show stacks from user space only (no kernel space stacks)"},
+	{"kernel-stacks-only", 'K', NULL, 0,
+	 "show stacks from kernel space only (no user space stacks)"},
+	{"lua-user-stacks-only", OPT_LUA_USER_STACK_ONLY, NULL, 0,
+	 "replace user stacks with lua stack traces (no other user space stacks)"},
+	{"disable-lua-user-trace", OPT_DISABLE_LUA_USER_TRACE, NULL, 0,
+	 "disable lua user space stack trace"},
+	{"delimited", 'd', NULL, 0, "insert delimiter between kernel/user stacks"},
+	{"folded", 'f', NULL, 0, "output folded format, one line per stack (for flame graphs)"},
+	{"format", OPT_FORMAT, "FORMAT", 0, "output format: text (default), folded, svg or pprof"},
+	{"top", OPT_TOP, "N", 0, "only show the N hottest stacks"},
+	{"per-container", OPT_PER_CONTAINER, NULL, 0,
+	 "split stacks by container, as named on the capturing host"},
+	{"sysroot", OPT_SYSROOT, "DIR", 0, "look up the captured binaries under DIR"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
 
-	if (missing_stacks > 0)
+static error_t parse_report_arg(int key, char *arg, struct argp_state *state)
+{
+	switch (key)
 	{
-		fprintf(stderr, "WARNING: %d stack traces could not be displayed.%s\n",
-				missing_stacks, has_collision ? " Consider increasing --stack-storage-size." : "");
+	case OPT_SYSROOT:
+		report_env.sysroot = arg;
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num >= 1)
+		{
+			fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+			argp_usage(state);
+		}
+		report_env.file = arg;
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num != 1)
+			argp_usage(state);
+		break;
+	default:
+		/* the output options are shared with live profiling */
+		return parse_arg(key, arg, state);
 	}
-
-cleanup:
-	free(kip);
-	free(uip);
+	return 0;
 }
 
-static void handle_lua_stack_event(void *ctx, int cpu, void *data, __u32 data_sz)
+static int report_main(int argc, char **argv)
 {
+	static const struct argp argp = {
+		.options = report_opts,
+		.parser = parse_report_arg,
+		.args_doc = "FILE",
+		.doc = report_doc,
+	};
+	struct stack_sink sink = {};
 	int err;
-	const struct lua_stack_event *e = data;
-	struct tm *tm;
-	char ts[16];
-	time_t t;
 
-	time(&t);
-	tm = localtime(&t);
-	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
-	err = insert_lua_stack_map(lua_bt_map, e);
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
 	if (err)
-		fprintf(stderr, "failed to insert lua stack map\n");
+		return err;
+	if (env.user_stacks_only && env.kernel_stacks_only)
+	{
+		fprintf(stderr, "user_stacks_only and kernel_stacks_only cannot be used together.\n");
+		return 1;
+	}
+	if (env.format == FORMAT_HEATMAP)
+	{
+		fprintf(stderr, "the heatmap reads Lua state and sources from live processes, raw captures have neither\n");
+		return 1;
+	}
+
+	if (env.format == FORMAT_SVG)
+		sink.fg = flamegraph__new();
+	/* the pprof sink is made in report_raw, the capture knows its sample type */
+	err = report_raw(report_env.file, report_env.sysroot, &sink);
+	if (!err && sink.fg)
+		write_flamegraph(sink.fg, "Flame Graph");
+	else if (!err && sink.pp)
+		write_pprof(sink.pp);
+	flamegraph__free(sink.fg);
+	pprof__free(sink.pp);
+	return err != 0;
 }
 
-static void handle_lua_stack_lost_events(void *ctx, int cpu, __u64 lost_cnt)
+static struct diff_env
 {
-	warn("lost %llu events on CPU #%d\n", lost_cnt, cpu);
-}
+	const char *files[2];
+	const char *sysroot;
+	bool normalize;
+	bool verbose;
+	enum output_format format;
+} diff_env = {
+	.normalize = true,
+	.format = FORMAT_FOLDED,
+};
 
-static int attach_lua_uprobes(struct profile_bpf *obj, struct bpf_link *links[])
+const char diff_doc[] =
+	"Compare two folded profiles or raw captures as a differential flame graph.\n"
+	"\n"
+	"USAGE: profile diff [OPTIONS...] BEFORE AFTER\n"
+	"Widths follow AFTER; frames that grew are red, frames that shrank blue.\n"
+	"EXAMPLES:\n"
+	"    profile diff a.folded b.folded > diff.folded  # input for difffolded-style tools\n"
+	"    profile diff --format=svg a.folded b.folded > diff.svg\n";
+
+static const struct argp_option diff_opts[] = {
+	{"format", OPT_FORMAT, "FORMAT", 0, "output format: folded (default) or svg"},
+	{"no-normalize", OPT_NO_NORMALIZE, NULL, 0,
+	 "compare raw counts instead of scaling BEFORE to the total of AFTER"},
+	{"sysroot", OPT_SYSROOT, "DIR", 0, "look up the binaries of raw captures under DIR"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
+
+static error_t parse_diff_arg(int key, char *arg, struct argp_state *state)
 {
-	char lua_path[128];
-	if (env.pid)
+	switch (key)
 	{
-		int res = 0;
-
-		res = get_pid_lib_path(env.pid, "luajit-5.1.so", lua_path, sizeof(lua_path));
-		if (res < 0)
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		diff_env.verbose = true;
+		break;
+	case OPT_FORMAT:
+		if (!strcmp(arg, "folded"))
+			diff_env.format = FORMAT_FOLDED;
+		else if (!strcmp(arg, "svg"))
+			diff_env.format = FORMAT_SVG;
+		else
 		{
-			fprintf(stderr, "failed to get lib path for pid %d\n", env.pid);
-			return -1;
+			fprintf(stderr, "invalid FORMAT: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_NO_NORMALIZE:
+		diff_env.normalize = false;
+		break;
+	case OPT_SYSROOT:
+		diff_env.sysroot = arg;
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num >= 2)
+		{
+			fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+			argp_usage(state);
 		}
+		diff_env.files[state->arg_num] = arg;
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num != 2)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
 	}
+	return 0;
+}
 
-	off_t func_off = get_elf_func_offset(lua_path, "lua_resume");
-	if (func_off < 0)
-	{
-		warn("could not find lua_resume in %s\n", lua_path);
-		return -1;
-	}
-	links[0] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua, false,
-										  -1, lua_path, func_off);
-	if (!links[0])
-	{
-		warn("failed to attach lua_resume: %d\n", -errno);
-		return -1;
-	}
+static int diff_main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = diff_opts,
+		.parser = parse_diff_arg,
+		.args_doc = "BEFORE AFTER",
+		.doc = diff_doc,
+	};
+	struct folded_diff *d;
+	struct flamegraph *fg;
+	__u64 start_ns;
+	FILE *f;
+	int err, i;
 
-	func_off = get_elf_func_offset(lua_path, "lua_pcall");
-	if (func_off < 0)
-	{
-		warn("could not find lua_pcall in %s\n", lua_path);
-		return -1;
-	}
-	links[1] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua, false,
-										  -1, lua_path, func_off);
-	if (!links[1])
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	d = folded_diff__new();
+	for (i = 0; i < 2; i++)
 	{
-		warn("failed to attach lua_pcall: %d\n", -errno);
-		return -1;
+		start_ns = get_ktime_ns();
+		if (raw_profile__detect(diff_env.files[i]))
+		{
+			struct stack_sink sink = {.diff = d, .which = i};
+
+			env.folded = true;
+			err = report_raw(diff_env.files[i], diff_env.sysroot, &sink);
+			if (err)
+				goto cleanup;
+			if (diff_env.verbose)
+				fprintf(stderr, "%s: %llu samples symbolized in %.3f ms\n", diff_env.files[i],
+						folded_diff__total(d, i), (get_ktime_ns() - start_ns) / 1e6);
+			continue;
+		}
+		f = fopen(diff_env.files[i], "r");
+		if (!f)
+		{
+			fprintf(stderr, "failed to open %s: %s\n", diff_env.files[i], strerror(errno));
+			err = 1;
+			goto cleanup;
+		}
+		err = folded_diff__load(d, i, f);
+		fclose(f);
+		if (err)
+		{
+			fprintf(stderr, "failed to read %s\n", diff_env.files[i]);
+			goto cleanup;
+		}
+		if (diff_env.verbose)
+			fprintf(stderr, "%s: %llu samples loaded in %.3f ms\n", diff_env.files[i],
+					folded_diff__total(d, i), (get_ktime_ns() - start_ns) / 1e6);
 	}
 
-	func_off = get_elf_func_offset(lua_path, "lua_yield");
-	if (func_off < 0)
+	if (diff_env.format == FORMAT_SVG)
 	{
-		warn("could not find lua_yield in %s\n", lua_path);
-		return -1;
+		fg = folded_diff__flamegraph(d, diff_env.normalize);
+		err = flamegraph__write_svg(fg, stdout, "Differential Flame Graph");
+		flamegraph__free(fg);
 	}
-	links[2] = bpf_program__attach_uprobe(obj->progs.handle_entry_lua_cancel, false,
-										  -1, lua_path, func_off);
-	if (!links[2])
+	else
 	{
-		warn("failed to attach lua_yield: %d\n", -errno);
-		return -1;
+		err = folded_diff__write_folded(d, stdout, diff_env.normalize);
 	}
-	return 0;
+
+cleanup:
+	folded_diff__free(d);
+	return err != 0;
 }
 
 int main(int argc, char **argv)
@@ -768,22 +2852,114 @@ int main(int argc, char **argv)
 	};
 	struct syms_cache *syms_cache = NULL;
 	struct ksyms *ksyms = NULL;
-	struct bpf_link *cpu_links[MAX_CPU_NR] = {};
+	struct bpf_link **cpu_links = NULL;
 	struct bpf_link *uprobe_links[UPROBE_SIZE] = {};
+	struct bpf_link *stall_links[STALL_LINKS] = {};
+	struct bpf_link *lock_links[SHDICT_LINKS] = {};
+	struct bpf_link *ssl_links[SSL_LINKS] = {};
+	struct bpf_link *rq_links[RQ_LINKS] = {};
+	struct bpf_link *alloc_links[ALLOC_LINKS] = {};
+	struct bpf_link *target_links[TARGET_LINKS] = {};
+	int *ipc_fds = NULL;
+	struct perf_buffer *stall_pb = NULL;
+	struct perf_buffer *pb = NULL;
 	struct profile_bpf *obj;
+	unsigned long long start_ns, stats_ns, cgroups_ns, now_ns;
 	int err, i;
 	char *stack_context = "user + kernel";
-	char thread_context[64];
-	char sample_context[64];
+	char thread_context[PATH_MAX + 8];
+	char event_names[128] = "";
+	char sample_context[160];
+
+	if (argc > 1 && !strcmp(argv[1], "diff"))
+		return diff_main(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "report"))
+		return report_main(argc - 1, argv + 1);
 
 	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
 	if (err)
 		return err;
+	/* one process is filtered by targ_pid alone */
+	if (env.nr_pids == 1 && env.master == -1 && !env.comm)
+	{
+		env.pid = env.pids[0];
+		env.lib_pid = env.pid;
+	}
 	if (env.user_stacks_only && env.kernel_stacks_only)
 	{
 		fprintf(stderr, "user_stacks_only and kernel_stacks_only cannot be used together.\n");
 		return 1;
 	}
+	if (env.shdict_locks || env.runqlat || env.alloc)
+	{
+		if (env.shdict_locks + env.runqlat + env.alloc + !!env.stall_threshold_ms +
+				env.ssl_handshakes > 1 ||
+			env.kernel_stacks_only)
+		{
+			fprintf(stderr, "--shdict-locks, --runqlat and --alloc cannot be used with each other, "
+							"--stall-threshold, --ssl-handshakes or -K.\n");
+			return 1;
+		}
+		if (env.cpus || env.cgroup)
+		{
+			fprintf(stderr, "-C and --cgroup select perf events, they cannot be used with "
+							"--shdict-locks, --runqlat or --alloc.\n");
+			return 1;
+		}
+		/* waits are timed from probes, the kernel stack would always be the same */
+		env.user_stacks_only = true;
+	}
+	if (env.alloc && env.disable_lua_user_trace)
+	{
+		fprintf(stderr, "--alloc profiles Lua code, it cannot be used with --disable-lua-user-trace.\n");
+		return 1;
+	}
+	if (env.ipc)
+	{
+		if (env.shdict_locks || env.runqlat || env.alloc)
+		{
+			fprintf(stderr, "--ipc needs sampling, it cannot be used with --shdict-locks, "
+							"--runqlat or --alloc.\n");
+			return 1;
+		}
+		if (env.nr_events)
+		{
+			fprintf(stderr, "--ipc samples cycles, it cannot be used with -e.\n");
+			return 1;
+		}
+		env.events[env.nr_events++] = find_perf_event("cycles");
+	}
+	if (!env.nr_events)
+		env.events[env.nr_events++] = find_perf_event("cpu-clock");
+	if (env.dwarf)
+	{
+#if !defined(__x86_64__)
+		fprintf(stderr, "--dwarf only unwinds x86_64 stacks.\n");
+		return 1;
+#endif
+		if (!env.nr_pids && env.master == -1 && !env.comm)
+		{
+			fprintf(stderr, "--dwarf builds unwind tables for the processes of -p, --master or --comm.\n");
+			return 1;
+		}
+		if (env.kernel_stacks_only)
+		{
+			fprintf(stderr, "--dwarf unwinds user stacks, it cannot be used with -K.\n");
+			return 1;
+		}
+		/* the unwound stacks are stored in our own table */
+		env.stack_dedup = true;
+	}
+	if (env.stack_dedup && env.perf_max_stack_depth > MAX_STACK_FRAMES)
+	{
+		fprintf(stderr, "--stack-dedup stores at most %d frames per stack.\n", MAX_STACK_FRAMES);
+		return 1;
+	}
+	if (env.nr_events > 1 && env.raw_path)
+	{
+		fprintf(stderr, "--output-raw records a single event.\n");
+		return 1;
+	}
 
 	libbpf_set_print(libbpf_print_fn);
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
@@ -795,12 +2971,36 @@ int main(int argc, char **argv)
 			   strerror(-nr_cpus));
 		return 1;
 	}
-	if (nr_cpus > MAX_CPU_NR)
+	cpu_links = calloc(nr_cpus * env.nr_events, sizeof(*cpu_links));
+	if (!cpu_links)
 	{
-		fprintf(stderr, "the number of cpu cores is too big, please "
-						"increase MAX_CPU_NR's value and recompile");
+		fprintf(stderr, "failed to alloc perf links\n");
 		return 1;
 	}
+	if (env.cpus)
+	{
+		cpu_mask = calloc(nr_cpus, sizeof(*cpu_mask));
+		if (!cpu_mask)
+		{
+			fprintf(stderr, "failed to alloc cpu mask\n");
+			return 1;
+		}
+		if (parse_cpu_list(env.cpus, cpu_mask, nr_cpus))
+		{
+			fprintf(stderr, "invalid CPU list %s, this host has %d possible CPUs\n", env.cpus,
+					nr_cpus);
+			return 1;
+		}
+	}
+	if (env.cgroup)
+	{
+		cgroup_fd = open(env.cgroup, O_RDONLY);
+		if (cgroup_fd < 0)
+		{
+			fprintf(stderr, "failed to open cgroup %s: %s\n", env.cgroup, strerror(errno));
+			return 1;
+		}
+	}
 
 	obj = profile_bpf__open();
 	if (!obj)
@@ -824,10 +3024,85 @@ int main(int argc, char **argv)
 	obj->rodata->user_stacks_only = env.user_stacks_only;
 	obj->rodata->kernel_stacks_only = env.kernel_stacks_only;
 	obj->rodata->include_idle = env.include_idle;
+	obj->rodata->stall_threshold_ns = env.stall_threshold_ms * 1000000ULL;
+	obj->rodata->ssl_handshakes_only = env.ssl_handshakes;
+	obj->rodata->ipc_mode = env.ipc;
+	obj->rodata->multi_event = env.nr_events > 1;
+	obj->rodata->filter_cgroups = env.nr_cgroup_filters > 0;
+	obj->rodata->filter_tgids = env.nr_pids > 1 || env.master != -1 || env.comm;
+	obj->rodata->targ_master = env.master;
+	obj->rodata->dwarf_unwind = env.dwarf;
+	obj->rodata->alloc_sample_bytes = env.alloc_sample_bytes;
+	if (env.comm)
+		strncpy((char *)obj->rodata->targ_comm, env.comm, TASK_COMM_LEN - 1);
+	if (!env.stall_threshold_ms)
+	{
+		bpf_program__set_autoload(obj->progs.handle_loop_entry, false);
+		bpf_program__set_autoload(obj->progs.handle_loop_return, false);
+		bpf_program__set_autoload(obj->progs.handle_epoll_wait_exit, false);
+		bpf_program__set_autoload(obj->progs.handle_epoll_pwait_exit, false);
+	}
+	if (!env.ssl_handshakes)
+	{
+		bpf_program__set_autoload(obj->progs.handle_ssl_entry, false);
+		bpf_program__set_autoload(obj->progs.handle_ssl_return, false);
+	}
+	if (!env.runqlat)
+	{
+		bpf_program__set_autoload(obj->progs.handle_rq_wakeup, false);
+		bpf_program__set_autoload(obj->progs.handle_rq_wakeup_new, false);
+		bpf_program__set_autoload(obj->progs.handle_rq_switch, false);
+	}
+	/* with --dwarf, they also copy and drop the unwind tables of processes */
+	if (!obj->rodata->filter_tgids && !env.dwarf)
+	{
+		bpf_program__set_autoload(obj->progs.handle_target_fork, false);
+		bpf_program__set_autoload(obj->progs.handle_target_exec, false);
+		bpf_program__set_autoload(obj->progs.handle_target_exit, false);
+	}
+	if (!env.shdict_locks)
+	{
+		bpf_program__set_autoload(obj->progs.handle_shdict_entry, false);
+		bpf_program__set_autoload(obj->progs.handle_shdict_return, false);
+		bpf_program__set_autoload(obj->progs.handle_lock_entry, false);
+		bpf_program__set_autoload(obj->progs.handle_lock_return, false);
+		bpf_program__set_autoload(obj->progs.handle_unlock, false);
+	}
+	if (!env.alloc)
+	{
+		bpf_program__set_autoload(obj->progs.handle_alloc_f, false);
+		bpf_program__set_autoload(obj->progs.handle_newgco, false);
+		bpf_map__set_max_entries(obj->maps.alloc_countdown, 1);
+		bpf_map__set_max_entries(obj->maps.alloc_samples, 1);
+	}
 
+	if (!env.stack_storage_set)
+		env.stack_storage_size = estimate_stack_storage();
+	if (env.stack_dedup)
+	{
+		/* ids are masked hashes */
+		env.stack_storage_size = roundup_pow_of_two(env.stack_storage_size);
+		obj->rodata->own_stack_table = true;
+		obj->rodata->stack_table_mask = env.stack_storage_size - 1;
+		obj->rodata->own_stack_depth = env.perf_max_stack_depth;
+		bpf_map__set_value_size(obj->maps.stack_dedup,
+								env.perf_max_stack_depth * sizeof(unsigned long));
+		bpf_map__set_max_entries(obj->maps.stack_dedup, env.stack_storage_size);
+		/* unused, but still created */
+		bpf_map__set_max_entries(obj->maps.stackmap, 1);
+	}
+	else
+	{
+		bpf_map__set_max_entries(obj->maps.stackmap, env.stack_storage_size);
+	}
 	bpf_map__set_value_size(obj->maps.stackmap,
 							env.perf_max_stack_depth * sizeof(unsigned long));
-	bpf_map__set_max_entries(obj->maps.stackmap, env.stack_storage_size);
+	if (env.dwarf)
+		bpf_map__set_max_entries(obj->maps.unwind_rows, UNWIND_MAX_ROWS);
+	else
+		bpf_map__set_max_entries(obj->maps.unwind_procs, 1);
+	if (env.verbose)
+		fprintf(stderr, "stack storage: %d stacks\n", env.stack_storage_size);
 
 	err = profile_bpf__load(obj);
 	if (err)
@@ -837,6 +3112,20 @@ int main(int argc, char **argv)
 						"consider using the `--stack-depth-limit` option.\n");
 		goto cleanup;
 	}
+	err = fill_cgroup_filter(bpf_map__fd(obj->maps.cgroup_filter));
+	if (err)
+		goto cleanup;
+	if (obj->rodata->filter_tgids || env.dwarf)
+	{
+		/* attached first, so that no worker forked during the scan is missed */
+		err = attach_target_probes(obj, target_links);
+		if (!err && obj->rodata->filter_tgids)
+			err = fill_targets(bpf_map__fd(obj->maps.targ_tgids));
+		if (!err && env.dwarf)
+			err = fill_unwind_tables(obj);
+		if (err)
+			goto cleanup;
+	}
 	ksyms = ksyms__load();
 	if (!ksyms)
 	{
@@ -860,8 +3149,9 @@ int main(int argc, char **argv)
 	lua_bt_map = init_lua_stack_map();
 	if (!lua_bt_map)
 		goto cleanup;
-	struct perf_buffer *pb = perf_buffer__new(bpf_map__fd(obj->maps.lua_event_output), PERF_BUFFER_PAGES,
-											  handle_lua_stack_event, handle_lua_stack_lost_events, NULL, NULL);
+	lua_funcnames = lua_funcnames__new();
+	pb = perf_buffer__new(bpf_map__fd(obj->maps.lua_event_output), PERF_BUFFER_PAGES,
+						  handle_lua_stack_event, handle_lua_stack_lost_events, NULL, NULL);
 	if (!pb)
 	{
 		err = -errno;
@@ -869,7 +3159,51 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	err = open_and_attach_perf_event(env.freq, obj->progs.do_perf_event, cpu_links);
+	if (env.stall_threshold_ms)
+	{
+		err = attach_loop_probes(obj, stall_links);
+		if (err)
+			goto cleanup;
+		stall_pb = perf_buffer__new(bpf_map__fd(obj->maps.stall_output), PERF_BUFFER_PAGES,
+									handle_stall_event, handle_lua_stack_lost_events, NULL, NULL);
+		if (!stall_pb)
+		{
+			err = -errno;
+			warn("failed to open perf buffer: %d\n", err);
+			goto cleanup;
+		}
+	}
+
+	if (env.ipc)
+	{
+		ipc_fds = malloc(nr_cpus * sizeof(*ipc_fds));
+		if (!ipc_fds)
+		{
+			err = -ENOMEM;
+			goto cleanup;
+		}
+		for (i = 0; i < nr_cpus; i++)
+			ipc_fds[i] = -1;
+		err = open_ipc_counters(bpf_map__fd(obj->maps.ipc_counters), ipc_fds);
+		if (err)
+			goto cleanup;
+	}
+
+	if (env.ssl_handshakes)
+	{
+		err = attach_ssl_probes(obj, ssl_links);
+		if (err)
+			goto cleanup;
+	}
+
+	if (env.shdict_locks)
+		err = attach_lock_probes(obj, lock_links);
+	else if (env.runqlat)
+		err = attach_rq_probes(obj, rq_links);
+	else if (env.alloc)
+		err = attach_alloc_probes(obj, alloc_links);
+	else
+		err = open_and_attach_perf_event(env.freq, obj->progs.do_perf_event, cpu_links);
 	if (err)
 		goto cleanup;
 
@@ -877,23 +3211,62 @@ int main(int argc, char **argv)
 
 	if (env.pid != -1)
 		snprintf(thread_context, sizeof(thread_context), "PID %d", env.pid);
+	else if (env.master != -1)
+		snprintf(thread_context, sizeof(thread_context), "master PID %d and its workers",
+				 env.master);
+	else if (env.comm)
+		snprintf(thread_context, sizeof(thread_context), "processes named %s", env.comm);
+	else if (env.nr_pids > 1)
+		snprintf(thread_context, sizeof(thread_context), "%d PIDs", env.nr_pids);
 	else if (env.tid != -1)
 		snprintf(thread_context, sizeof(thread_context), "TID %d", env.tid);
+	else if (env.cgroup)
+		snprintf(thread_context, sizeof(thread_context), "cgroup %s", env.cgroup);
 	else
 		snprintf(thread_context, sizeof(thread_context), "all threads");
 
-	snprintf(sample_context, sizeof(sample_context), "%d Hertz", env.sample_freq);
+	for (i = 0; i < env.nr_events; i++)
+	{
+		if (i)
+			strncat(event_names, ", ", sizeof(event_names) - strlen(event_names) - 1);
+		strncat(event_names, perf_events[env.events[i]].name,
+				sizeof(event_names) - strlen(event_names) - 1);
+	}
+	if (env.freq)
+		snprintf(sample_context, sizeof(sample_context), "%s at %d Hertz",
+				 event_names, env.sample_freq);
+	else
+		snprintf(sample_context, sizeof(sample_context), "%s every %llu events",
+				 event_names, env.sample_period);
 
 	if (env.user_stacks_only)
 		stack_context = "user";
 	else if (env.kernel_stacks_only)
 		stack_context = "kernel";
 
-	if (!env.folded)
+	if (!env.folded && env.alloc)
+	{
+		printf("Sampling LuaJIT allocations of %s every %llu bytes", thread_context,
+			   (unsigned long long)env.alloc_sample_bytes);
+		if (env.duration < 99999999)
+			printf(" for %d secs.\n", env.duration);
+		else
+			printf("... Hit Ctrl-C to end.\n");
+	}
+	else if (!env.folded && (env.shdict_locks || env.runqlat))
+	{
+		printf("Tracing %s of %s", env.runqlat ? "run queue latency" : "shared memory zone locks",
+			   thread_context);
+		if (env.duration < 99999999)
+			printf(" for %d secs.\n", env.duration);
+		else
+			printf("... Hit Ctrl-C to end.\n");
+	}
+	else if (!env.folded)
 	{
-		printf("Sampling at %s of %s by %s stack", sample_context, thread_context, stack_context);
-		if (env.cpu != -1)
-			printf(" on CPU#%d", env.cpu);
+		printf("Sampling %s of %s by %s stack", sample_context, thread_context, stack_context);
+		if (env.cpus)
+			printf(" on CPUs %s", env.cpus);
 		if (env.duration < 99999999)
 			printf(" for %d secs.\n", env.duration);
 		else
@@ -904,9 +3277,23 @@ int main(int argc, char **argv)
 	 * We'll get sleep interrupted when someone presses Ctrl-C (which will
 	 * be "handled" with noop by sig_handler).
 	 */
-	// sleep(env.duration);
+	start_ns = stats_ns = cgroups_ns = get_ktime_ns();
 	while (!exiting)
 	{
+		now_ns = get_ktime_ns();
+		if (env.duration < 99999999 && now_ns - start_ns >= env.duration * NSEC_PER_SEC)
+			break;
+		if (now_ns - stats_ns >= STACK_STATS_INTERVAL_NS)
+		{
+			check_stack_stats(obj);
+			stats_ns = now_ns;
+		}
+		if (env.nr_cgroup_filters && now_ns - cgroups_ns >= CGROUP_REFRESH_INTERVAL_NS)
+		{
+			refresh_cgroup_filter(bpf_map__fd(obj->maps.cgroup_filter));
+			cgroups_ns = now_ns;
+		}
+
 		// print perf event to get stack trace
 		err = perf_buffer__poll(pb, PERF_POLL_TIMEOUT_MS);
 		if (err < 0 && err != -EINTR)
@@ -914,6 +3301,8 @@ int main(int argc, char **argv)
 			warn("error polling perf buffer: %s\n", strerror(-err));
 			goto cleanup;
 		}
+		if (stall_pb)
+			perf_buffer__poll(stall_pb, 0);
 		/* reset err to return 0 if exiting */
 		err = 0;
 	}
@@ -921,18 +3310,37 @@ int main(int argc, char **argv)
 	print_map(ksyms, syms_cache, obj);
 
 cleanup:
-	if (env.cpu != -1)
-		bpf_link__destroy(cpu_links[env.cpu]);
-	else
-	{
-		for (i = 0; i < nr_cpus; i++)
-			bpf_link__destroy(cpu_links[i]);
-	}
+	for (i = 0; cpu_links && i < nr_cpus * env.nr_events; i++)
+		bpf_link__destroy(cpu_links[i]);
+	free(cpu_links);
+	free(cpu_mask);
+	if (cgroup_fd >= 0)
+		close(cgroup_fd);
 	for (i = 0; i < UPROBE_SIZE; i++)
 		bpf_link__destroy(uprobe_links[i]);
+	for (i = 0; i < STALL_LINKS; i++)
+		bpf_link__destroy(stall_links[i]);
+	for (i = 0; i < SHDICT_LINKS; i++)
+		bpf_link__destroy(lock_links[i]);
+	for (i = 0; i < SSL_LINKS; i++)
+		bpf_link__destroy(ssl_links[i]);
+	for (i = 0; i < RQ_LINKS; i++)
+		bpf_link__destroy(rq_links[i]);
+	for (i = 0; i < ALLOC_LINKS; i++)
+		bpf_link__destroy(alloc_links[i]);
+	for (i = 0; i < TARGET_LINKS; i++)
+		bpf_link__destroy(target_links[i]);
+	for (i = 0; ipc_fds && i < nr_cpus; i++)
+	{
+		if (ipc_fds[i] >= 0)
+			close(ipc_fds[i]);
+	}
+	free(ipc_fds);
+	perf_buffer__free(stall_pb);
 	profile_bpf__destroy(obj);
 	perf_buffer__free(pb);
 	syms_cache__free(syms_cache);
 	ksyms__free(ksyms);
+	lua_funcnames__free(lua_funcnames);
 	return err != 0;
 }
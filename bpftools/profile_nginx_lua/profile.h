@@ -3,17 +3,32 @@
 #define __PROFILE_H
 
 #define TASK_COMM_LEN 16
-#define MAX_CPU_NR 128
 #define MAX_ENTRIES 10240
 #define HOST_LEN 80
+#define MAX_SLOTS 32
+#define ZONE_NAME_LEN 32
+#define MAX_CGROUPS 1024
+#define MAX_TARGETS 1024
+// deepest stack --stack-dedup stores, like kernel.perf_event_max_stack
+#define MAX_STACK_FRAMES 127
+#define MAX_UNWIND_MAPPINGS 32
+#define MAX_UNWIND_FRAMES 32
 
 struct profile_key_t
 {
 	unsigned int pid;
+	// index of the sampled event, when there are several
+	unsigned int event;
 	unsigned long long kernel_ip;
+	// cgroup v2 id of the sampled task
+	unsigned long long cgroup_id;
+	// Lua frames of --alloc samples, which share few native stacks; else 0
+	unsigned long long lua_stack_hash;
 	int user_stack_id;
 	int kern_stack_id;
 	char name[TASK_COMM_LEN];
+	// shared dict zone of --shdict-locks waits, else empty
+	char zone[ZONE_NAME_LEN];
 };
 
 enum func_type {
@@ -28,17 +43,122 @@ struct lua_stack_event
 	unsigned int pid;
 	// key for user_stack_id
 	int  user_stack_id;
+	// with lua_stack_hash of the sample
+	unsigned long long lua_stack_hash;
 	// stack level
 	int  level;
 	// function type
 	int type;
 	// function name
 	char name[HOST_LEN];
+	// C function (C, ffunc) or GCproto (lua func)
 	void *funcp;
 	// line number(lua func) or ffid(ffunc)
 	int ffid;
+	// frame link: the return pc into the caller when called from Lua
+	unsigned long long frame_link;
+	// frame link of the running function, which is not reported
+	unsigned long long top_link;
+	// C function a cdata called through ffi.meta.__call points to (ffunc)
+	void *ffi_func;
 	// lua state
 	void *L;
+	// C frame segment of the frame, 0 for the innermost lua_pcall/lua_resume
+	int segment;
+	// return addresses read from the C frame of the segment's VM entry
+	unsigned long long seg_ret;
+	unsigned long long seg_fp_ret;
+};
+
+// one event loop iteration that ran longer than the stall threshold
+struct stall_event
+{
+	unsigned int pid;
+	unsigned int tid;
+	unsigned long long duration_ns;
+	// stacks of the first sample taken after the threshold was crossed
+	int user_stack_id;
+	int kern_stack_id;
+	int sampled;
+	char name[TASK_COMM_LEN];
+};
+
+struct zone_key
+{
+	char name[ZONE_NAME_LEN];
+};
+
+// ngx_shmtx_t lock statistics of one shared memory zone, times in nsecs
+struct zone_stats
+{
+	unsigned long long locks;
+	unsigned long long wait_ns;
+	unsigned long long hold_ns;
+	unsigned int wait_hist[MAX_SLOTS];
+	unsigned int hold_hist[MAX_SLOTS];
+};
+
+// stack id requests of one CPU, and the ones that got no id
+struct stack_stats
+{
+	unsigned long long stacks;
+	unsigned long long collisions;
+	unsigned long long failures;
+};
+
+// how to find the canonical frame address of a row in --dwarf mode
+enum unwind_cfa {
+	UNWIND_CFA_NONE,   // no unwind info, or one we cannot follow
+	UNWIND_CFA_RSP,    // rsp + cfa_offset
+	UNWIND_CFA_RBP,    // rbp + cfa_offset
+	UNWIND_CFA_PLT,    // PLT stub, rsp + 8 or rsp + 16 by the instruction
+	UNWIND_CFA_END,    // outermost frame, the return address is undefined
+};
+
+// .eh_frame rule from pc up to the pc of the next row, x86_64 only
+struct unwind_row
+{
+	unsigned long long pc;
+	// for UNWIND_CFA_PLT, the pc & 15 from which the CFA is rsp + 16
+	int cfa_offset;
+	// where rbp was saved, relative to the CFA, or 0
+	short rbp_offset;
+	unsigned char cfa_type;
+	unsigned char pad;
+};
+
+// executable mapping of a process with its rows in unwind_rows
+struct unwind_mapping
+{
+	unsigned long long start;
+	unsigned long long end;
+	// runtime address minus ELF virtual address
+	unsigned long long bias;
+	unsigned int row_start;
+	unsigned int nr_rows;
+};
+
+struct unwind_proc
+{
+	unsigned int nr_mappings;
+	unsigned int pad;
+	struct unwind_mapping mappings[MAX_UNWIND_MAPPINGS];
+};
+
+// counter deltas of --ipc mode, for one stack or one CPU
+struct ipc_value
+{
+	unsigned long long cycles;
+	unsigned long long instructions;
+};
+
+// run queue latency of one process in --runqlat mode, in usecs
+struct rq_hist
+{
+	unsigned long long waits;
+	unsigned long long preempts;
+	unsigned long long total_us;
+	unsigned int slots[MAX_SLOTS];
 };
 
 #endif /* __PROFILE_H */
@@ -0,0 +1,968 @@
+#include "raw_profile.h"
+#include <deque>
+#include <limits.h>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+extern "C"
+{
+#include "lua_ffnames.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
+}
+
+#define BUILD_ID_SIZE 20
+/* sanity limits for lengths read from a capture */
+#define MAX_RECORD_FRAMES 4096
+#define MAX_RECORD_MAPS 65536
+
+enum raw_record
+{
+    RAW_REC_END = 0,
+    /* id, bytes */
+    RAW_REC_STRING,
+    /* pid, nr, nr * (start, size, file_off, dev_major, dev_minor, inode, path, build-id) */
+    RAW_REC_MAPS,
+    /* stack id, nr, nr * ip delta, lua levels, levels * (type, ffid, funcp, name) */
+    RAW_REC_USER_STACK,
+    /* stack id, nr, nr * (ip delta, name, offset) */
+    RAW_REC_KERNEL_STACK,
+    /* pid, comm, count, user stack id, kernel stack id, kernel ip [, name, offset], cgroup id, container, zone */
+    RAW_REC_SAMPLE,
+    /* stack id, lua levels, levels * segment, nr, nr * (ret, fp ret); follows its user stack */
+    RAW_REC_LUA_SEGMENTS,
+    /* stack id, lua levels, levels * FFI callee; follows its user stack */
+    RAW_REC_LUA_FFI,
+    /* LuaJIT version, for the fast function names */
+    RAW_REC_LUAJIT_VERSION,
+    /* stack id, lua levels, levels * (function name string id + 1, 0 if none); follows its user stack */
+    RAW_REC_LUA_NAMES,
+};
+
+/* LEB128, as used by protobuf */
+static void put_varint(std::string &buf, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+/* zigzag encoding keeps small negative numbers short */
+static void put_svarint(std::string &buf, long long v)
+{
+    put_varint(buf, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+static void put_bytes(std::string &buf, const void *data, size_t len)
+{
+    put_varint(buf, len);
+    buf.append((const char *)data, len);
+}
+
+struct raw_writer
+{
+    FILE *f;
+    std::unordered_map<std::string, uint32_t> strings;
+    std::unordered_map<std::string, std::string> build_ids;
+    std::unordered_set<unsigned int> pids;
+    /*
+     * The ids of the capture by user stack id and Lua stack hash, as --alloc
+     * samples of one native stack can have several Lua stacks.
+     */
+    std::map<std::pair<int, unsigned long long>, int> user_stacks;
+    std::unordered_set<int> kernel_stacks;
+    unsigned long long nr_samples;
+    bool failed;
+};
+
+static void write_record(struct raw_writer *w, const std::string &rec)
+{
+    if (fwrite(rec.data(), 1, rec.size(), w->f) != rec.size())
+    {
+        w->failed = true;
+    }
+}
+
+/* Returns the string id plus one, 0 standing for no string */
+static uint32_t intern(struct raw_writer *w, const char *s)
+{
+    if (!s)
+    {
+        return 0;
+    }
+    auto it = w->strings.find(s);
+    if (it != w->strings.end())
+    {
+        return it->second + 1;
+    }
+    uint32_t id = w->strings.size();
+    w->strings.emplace(s, id);
+
+    std::string rec;
+    put_varint(rec, RAW_REC_STRING);
+    put_varint(rec, id);
+    put_bytes(rec, s, strlen(s));
+    write_record(w, rec);
+    return id + 1;
+}
+
+static const std::string &build_id_of(struct raw_writer *w, unsigned int pid, const char *path)
+{
+    auto it = w->build_ids.find(path);
+    if (it != w->build_ids.end())
+    {
+        return it->second;
+    }
+    /* read the file the process sees, which may live in a container */
+    char root_path[PATH_MAX];
+    unsigned char id[BUILD_ID_SIZE];
+    std::string build_id;
+    snprintf(root_path, sizeof(root_path), "/proc/%u/root%s", pid, path);
+    int len = get_elf_build_id(root_path, id, sizeof(id));
+    if (len > 0)
+    {
+        build_id.assign((const char *)id, len < BUILD_ID_SIZE ? len : BUILD_ID_SIZE);
+    }
+    return w->build_ids.emplace(path, build_id).first->second;
+}
+
+static void write_maps(struct raw_writer *w, unsigned int pid)
+{
+    struct map_entry
+    {
+        unsigned long start, end, file_off, dev_major, dev_minor, inode;
+        uint32_t path;
+        std::string build_id;
+    };
+    std::vector<map_entry> entries;
+    char fname[64], line[PATH_MAX + 128], perm[5];
+    map_entry e;
+    int path_off;
+    FILE *f;
+
+    snprintf(fname, sizeof(fname), "/proc/%u/maps", pid);
+    f = fopen(fname, "r");
+    /* a process that already exited is recorded without mappings */
+    while (f && fgets(line, sizeof(line), f))
+    {
+        path_off = 0;
+        if (sscanf(line, "%lx-%lx %4s %lx %lx:%lx %lu %n", &e.start, &e.end, perm, &e.file_off,
+                   &e.dev_major, &e.dev_minor, &e.inode, &path_off) < 7 ||
+            !path_off)
+        {
+            continue;
+        }
+        char *path = line + path_off;
+        path[strcspn(path, "\n")] = '\0';
+        if (perm[2] != 'x' || path[0] != '/')
+        {
+            continue;
+        }
+        e.path = intern(w, path);
+        e.build_id = build_id_of(w, pid, path);
+        entries.push_back(e);
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+
+    std::string rec;
+    put_varint(rec, RAW_REC_MAPS);
+    put_varint(rec, pid);
+    put_varint(rec, entries.size());
+    for (const auto &m : entries)
+    {
+        put_varint(rec, m.start);
+        put_varint(rec, m.end - m.start);
+        put_varint(rec, m.file_off);
+        put_varint(rec, m.dev_major);
+        put_varint(rec, m.dev_minor);
+        put_varint(rec, m.inode);
+        put_varint(rec, m.path);
+        put_bytes(rec, m.build_id.data(), m.build_id.size());
+    }
+    write_record(w, rec);
+}
+
+static void write_user_stack(struct raw_writer *w, int stack_id, const unsigned long *ips, unsigned int nr,
+                             const struct stack_backtrace *lua_bt)
+{
+    std::vector<uint32_t> names;
+    unsigned long prev = 0;
+    int levels = lua_bt ? lua_bt->level_size : 0;
+
+    /* strings go out before the record that refers to them */
+    for (int i = 0; i < levels; i++)
+    {
+        names.push_back(intern(w, lua_bt->stack[i].name));
+    }
+
+    std::string rec;
+    put_varint(rec, RAW_REC_USER_STACK);
+    put_varint(rec, stack_id);
+    put_varint(rec, nr);
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        put_svarint(rec, (long long)(ips[i] - prev));
+        prev = ips[i];
+    }
+    put_varint(rec, levels);
+    for (int i = 0; i < levels; i++)
+    {
+        const struct lua_stack_event *e = &lua_bt->stack[i];
+        put_varint(rec, e->type);
+        put_svarint(rec, e->ffid);
+        put_varint(rec, (unsigned long)e->funcp);
+        put_varint(rec, names[i]);
+    }
+    write_record(w, rec);
+
+    std::vector<uint32_t> func_names;
+    bool named = false;
+    for (int i = 0; i < levels; i++)
+    {
+        named = named || lua_bt->func_names[i];
+        func_names.push_back(lua_bt->func_names[i] ? intern(w, lua_bt->func_names[i]) + 1 : 0);
+    }
+    if (named)
+    {
+        rec.clear();
+        put_varint(rec, RAW_REC_LUA_NAMES);
+        put_varint(rec, stack_id);
+        put_varint(rec, levels);
+        for (int i = 0; i < levels; i++)
+        {
+            put_varint(rec, func_names[i]);
+        }
+        write_record(w, rec);
+    }
+
+    bool ffi = false;
+    for (int i = 0; i < levels; i++)
+    {
+        ffi = ffi || lua_bt->stack[i].ffi_func;
+    }
+    if (ffi)
+    {
+        rec.clear();
+        put_varint(rec, RAW_REC_LUA_FFI);
+        put_varint(rec, stack_id);
+        put_varint(rec, levels);
+        for (int i = 0; i < levels; i++)
+        {
+            put_varint(rec, (unsigned long)lua_bt->stack[i].ffi_func);
+        }
+        write_record(w, rec);
+    }
+
+    if (levels <= 0 || lua_bt->nr_segments <= 0)
+    {
+        return;
+    }
+    rec.clear();
+    put_varint(rec, RAW_REC_LUA_SEGMENTS);
+    put_varint(rec, stack_id);
+    put_varint(rec, levels);
+    for (int i = 0; i < levels; i++)
+    {
+        put_varint(rec, lua_bt->stack[i].segment);
+    }
+    put_varint(rec, lua_bt->nr_segments);
+    for (int i = 0; i < lua_bt->nr_segments; i++)
+    {
+        put_varint(rec, lua_bt->segments[i].ret);
+        put_varint(rec, lua_bt->segments[i].fp_ret);
+    }
+    write_record(w, rec);
+}
+
+static void write_kernel_stack(struct raw_writer *w, int stack_id, const struct kernel_frame *frames,
+                               unsigned int nr)
+{
+    std::vector<uint32_t> names;
+    unsigned long prev = 0;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        names.push_back(intern(w, frames[i].name));
+    }
+
+    std::string rec;
+    put_varint(rec, RAW_REC_KERNEL_STACK);
+    put_varint(rec, stack_id);
+    put_varint(rec, nr);
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        put_svarint(rec, (long long)(frames[i].ip - prev));
+        prev = frames[i].ip;
+        put_varint(rec, names[i]);
+        put_varint(rec, frames[i].offset);
+    }
+    write_record(w, rec);
+}
+
+struct raw_writer *raw_writer__open(const char *path, const struct raw_sample_type *type)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        return NULL;
+    }
+    struct raw_writer *w = new raw_writer;
+    w->f = f;
+    w->nr_samples = 0;
+    w->failed = fwrite(RAW_PROFILE_MAGIC, 1, RAW_PROFILE_MAGIC_LEN, f) != RAW_PROFILE_MAGIC_LEN;
+    std::string header;
+    put_bytes(header, type->type, strlen(type->type));
+    put_bytes(header, type->unit, strlen(type->unit));
+    put_bytes(header, type->period_type, strlen(type->period_type));
+    put_varint(header, type->period);
+    write_record(w, header);
+    if (lua_ffnames__version())
+    {
+        std::string rec;
+        put_varint(rec, RAW_REC_LUAJIT_VERSION);
+        put_bytes(rec, lua_ffnames__version(), strlen(lua_ffnames__version()));
+        write_record(w, rec);
+    }
+    return w;
+}
+
+int raw_writer__add_sample(struct raw_writer *w, const struct raw_sample *s)
+{
+    const struct profile_key_t *k = &s->key;
+    unsigned int first = k->kernel_ip && s->nr_kframes ? 1 : 0;
+    char comm[TASK_COMM_LEN + 1];
+
+    if (!w)
+    {
+        return -1;
+    }
+    if (w->pids.insert(k->pid).second)
+    {
+        write_maps(w, k->pid);
+    }
+    int user_stack_id = k->user_stack_id;
+    if (user_stack_id >= 0)
+    {
+        auto ust = w->user_stacks.emplace(std::make_pair(user_stack_id, k->lua_stack_hash),
+                                          (int)w->user_stacks.size());
+        user_stack_id = ust.first->second;
+        if (ust.second && s->uip)
+        {
+            write_user_stack(w, user_stack_id, s->uip, s->nr_uip, s->lua_bt);
+        }
+    }
+    if (k->kern_stack_id >= 0 && s->nr_kframes > first && w->kernel_stacks.insert(k->kern_stack_id).second)
+    {
+        write_kernel_stack(w, k->kern_stack_id, s->kframes + first, s->nr_kframes - first);
+    }
+
+    snprintf(comm, sizeof(comm), "%s", k->name);
+    uint32_t comm_id = intern(w, comm);
+    uint32_t kip_name = first ? intern(w, s->kframes[0].name) : 0;
+    uint32_t container = intern(w, s->container);
+    uint32_t zone = k->zone[0] ? intern(w, k->zone) : 0;
+
+    std::string rec;
+    put_varint(rec, RAW_REC_SAMPLE);
+    put_varint(rec, k->pid);
+    put_varint(rec, comm_id);
+    put_varint(rec, s->count);
+    put_svarint(rec, user_stack_id);
+    put_svarint(rec, k->kern_stack_id);
+    put_varint(rec, first ? k->kernel_ip : 0);
+    if (first)
+    {
+        put_varint(rec, kip_name);
+        put_varint(rec, s->kframes[0].offset);
+    }
+    put_varint(rec, k->cgroup_id);
+    put_varint(rec, container);
+    put_varint(rec, zone);
+    write_record(w, rec);
+    w->nr_samples++;
+    return w->failed ? -1 : 0;
+}
+
+int raw_writer__close(struct raw_writer *w)
+{
+    int err;
+
+    if (!w)
+    {
+        return 0;
+    }
+    std::string rec;
+    put_varint(rec, RAW_REC_END);
+    put_varint(rec, w->nr_samples);
+    write_record(w, rec);
+    err = fclose(w->f) || w->failed;
+    delete w;
+    return err ? -1 : 0;
+}
+
+struct raw_kernel_frame
+{
+    unsigned long ip;
+    uint32_t name;
+    unsigned long offset;
+};
+
+struct raw_user_stack
+{
+    std::vector<unsigned long> ips;
+    std::unique_ptr<struct stack_backtrace> lua_bt;
+};
+
+struct raw_reader
+{
+    FILE *f;
+    std::string sysroot;
+    /* a deque keeps c_str() stable while strings are appended */
+    std::deque<std::string> strings;
+    std::unordered_map<int, raw_user_stack> user_stacks;
+    std::unordered_map<int, std::vector<raw_kernel_frame>> kernel_stacks;
+    std::unordered_map<pid_t, struct syms *> syms;
+    std::unordered_set<std::string> checked_paths;
+    std::vector<struct kernel_frame> kframes;
+    struct stack_backtrace no_lua_bt;
+    /* format version, from the magic */
+    int version;
+    std::string type, unit, period_type;
+    struct raw_sample_type sample_type;
+    bool ended;
+};
+
+static bool get_varint(FILE *f, unsigned long long *v)
+{
+    unsigned long long r = 0;
+    int c, shift = 0;
+
+    do
+    {
+        c = getc(f);
+        if (c == EOF || shift > 63)
+        {
+            return false;
+        }
+        r |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *v = r;
+    return true;
+}
+
+static bool get_svarint(FILE *f, long long *v)
+{
+    unsigned long long u;
+
+    if (!get_varint(f, &u))
+    {
+        return false;
+    }
+    *v = (long long)(u >> 1) ^ -(long long)(u & 1);
+    return true;
+}
+
+static bool get_bytes(FILE *f, std::string &out)
+{
+    unsigned long long len;
+
+    if (!get_varint(f, &len) || len > INT_MAX)
+    {
+        return false;
+    }
+    out.resize(len);
+    return fread(&out[0], 1, len, f) == len;
+}
+
+static const char *string_at(const struct raw_reader *r, unsigned long long id)
+{
+    return id && id <= r->strings.size() ? r->strings[id - 1].c_str() : NULL;
+}
+
+static void check_build_id(struct raw_reader *r, const std::string &path, const std::string &build_id)
+{
+    unsigned char id[BUILD_ID_SIZE];
+    int len;
+
+    if (build_id.empty() || !r->checked_paths.insert(path).second)
+    {
+        return;
+    }
+    if (access(path.c_str(), R_OK))
+    {
+        fprintf(stderr, "warning: %s is missing, its frames stay unresolved\n", path.c_str());
+        return;
+    }
+    len = get_elf_build_id(path.c_str(), id, sizeof(id));
+    if (len <= 0 || build_id.compare(0, std::string::npos, (const char *)id,
+                                     len < BUILD_ID_SIZE ? len : BUILD_ID_SIZE))
+    {
+        fprintf(stderr, "warning: build-id of %s differs from the captured one, symbols may be wrong\n",
+                path.c_str());
+    }
+}
+
+/* Load symbols by writing the mappings back out in /proc/PID/maps format */
+static int read_maps(struct raw_reader *r)
+{
+    unsigned long long pid, nr, start, size, file_off, dev_major, dev_minor, inode, path;
+    char tmp_path[] = "/tmp/profile-maps-XXXXXX";
+    std::string build_id;
+    int fd, err = 0;
+    FILE *out;
+
+    if (!get_varint(r->f, &pid) || !get_varint(r->f, &nr) || nr > MAX_RECORD_MAPS)
+    {
+        return -1;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd < 0 || !(out = fdopen(fd, "w")))
+    {
+        fprintf(stderr, "failed to create a temporary maps file\n");
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+    for (unsigned long long i = 0; i < nr; i++)
+    {
+        if (!get_varint(r->f, &start) || !get_varint(r->f, &size) || !get_varint(r->f, &file_off) ||
+            !get_varint(r->f, &dev_major) || !get_varint(r->f, &dev_minor) || !get_varint(r->f, &inode) ||
+            !get_varint(r->f, &path) || !get_bytes(r->f, build_id) || !string_at(r, path))
+        {
+            err = -1;
+            break;
+        }
+        std::string local = r->sysroot + string_at(r, path);
+        check_build_id(r, local, build_id);
+        fprintf(out, "%llx-%llx r-xp %llx %llx:%llx %llu %s\n", start, start + size, file_off, dev_major,
+                dev_minor, inode, local.c_str());
+    }
+    fclose(out);
+    if (!err && !r->syms.count(pid))
+    {
+        struct syms *syms = syms__load_file(tmp_path);
+        if (!syms)
+        {
+            fprintf(stderr, "failed to load symbols of pid %llu\n", pid);
+        }
+        r->syms[pid] = syms;
+    }
+    unlink(tmp_path);
+    return err;
+}
+
+static int read_user_stack(struct raw_reader *r)
+{
+    unsigned long long id, nr, levels, type, funcp, name;
+    long long delta, ffid;
+    unsigned long ip = 0;
+    raw_user_stack st;
+
+    if (!get_varint(r->f, &id) || id > INT_MAX || !get_varint(r->f, &nr) || nr > MAX_RECORD_FRAMES)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < nr; i++)
+    {
+        if (!get_svarint(r->f, &delta))
+        {
+            return -1;
+        }
+        ip += delta;
+        st.ips.push_back(ip);
+    }
+    if (!get_varint(r->f, &levels) || levels > MAX_STACK_DEPTH)
+    {
+        return -1;
+    }
+    if (levels)
+    {
+        st.lua_bt.reset(new stack_backtrace());
+        st.lua_bt->level_size = levels;
+    }
+    for (unsigned long long i = 0; i < levels; i++)
+    {
+        struct lua_stack_event *e = &st.lua_bt->stack[i];
+        if (!get_varint(r->f, &type) || !get_svarint(r->f, &ffid) || !get_varint(r->f, &funcp) ||
+            !get_varint(r->f, &name))
+        {
+            return -1;
+        }
+        e->user_stack_id = id;
+        e->level = i;
+        e->type = type;
+        e->ffid = ffid;
+        e->funcp = (void *)(unsigned long)funcp;
+        snprintf(e->name, sizeof(e->name), "%s", string_at(r, name) ?: "");
+    }
+    r->user_stacks[id] = std::move(st);
+    return 0;
+}
+
+static int read_lua_segments(struct raw_reader *r)
+{
+    unsigned long long id, levels, segment, nr, ret, fp_ret;
+
+    if (!get_varint(r->f, &id) || !get_varint(r->f, &levels) || levels > MAX_STACK_DEPTH)
+    {
+        return -1;
+    }
+    auto it = r->user_stacks.find(id);
+    struct stack_backtrace *lua_bt = it == r->user_stacks.end() ? NULL : it->second.lua_bt.get();
+    if (!lua_bt || levels != (unsigned long long)lua_bt->level_size)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < levels; i++)
+    {
+        if (!get_varint(r->f, &segment))
+        {
+            return -1;
+        }
+        lua_bt->stack[i].segment = segment;
+    }
+    if (!get_varint(r->f, &nr) || nr > MAX_LUA_SEGMENTS)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < nr; i++)
+    {
+        if (!get_varint(r->f, &ret) || !get_varint(r->f, &fp_ret))
+        {
+            return -1;
+        }
+        lua_bt->segments[i] = {(unsigned long)ret, (unsigned long)fp_ret};
+    }
+    lua_bt->nr_segments = nr;
+    return 0;
+}
+
+static int read_lua_names(struct raw_reader *r)
+{
+    unsigned long long id, levels, name;
+
+    if (!get_varint(r->f, &id) || !get_varint(r->f, &levels) || levels > MAX_STACK_DEPTH)
+    {
+        return -1;
+    }
+    auto it = r->user_stacks.find(id);
+    struct stack_backtrace *lua_bt = it == r->user_stacks.end() ? NULL : it->second.lua_bt.get();
+    if (!lua_bt || levels != (unsigned long long)lua_bt->level_size)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < levels; i++)
+    {
+        if (!get_varint(r->f, &name))
+        {
+            return -1;
+        }
+        lua_bt->func_names[i] = name ? string_at(r, name - 1) : NULL;
+    }
+    return 0;
+}
+
+static int read_lua_ffi(struct raw_reader *r)
+{
+    unsigned long long id, levels, func;
+
+    if (!get_varint(r->f, &id) || !get_varint(r->f, &levels) || levels > MAX_STACK_DEPTH)
+    {
+        return -1;
+    }
+    auto it = r->user_stacks.find(id);
+    struct stack_backtrace *lua_bt = it == r->user_stacks.end() ? NULL : it->second.lua_bt.get();
+    if (!lua_bt || levels != (unsigned long long)lua_bt->level_size)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < levels; i++)
+    {
+        if (!get_varint(r->f, &func))
+        {
+            return -1;
+        }
+        lua_bt->stack[i].ffi_func = (void *)(unsigned long)func;
+    }
+    return 0;
+}
+
+static int read_kernel_stack(struct raw_reader *r)
+{
+    unsigned long long id, nr, name, offset;
+    std::vector<raw_kernel_frame> frames;
+    unsigned long ip = 0;
+    long long delta;
+
+    if (!get_varint(r->f, &id) || id > INT_MAX || !get_varint(r->f, &nr) || nr > MAX_RECORD_FRAMES)
+    {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < nr; i++)
+    {
+        if (!get_svarint(r->f, &delta) || !get_varint(r->f, &name) || !get_varint(r->f, &offset))
+        {
+            return -1;
+        }
+        ip += delta;
+        frames.push_back({ip, (uint32_t)name, (unsigned long)offset});
+    }
+    r->kernel_stacks[id] = std::move(frames);
+    return 0;
+}
+
+static int read_sample(struct raw_reader *r, struct raw_sample *s)
+{
+    unsigned long long pid, comm, count, kernel_ip, name = 0, offset = 0;
+    unsigned long long cgroup_id = 0, container = 0, zone = 0;
+    long long user_stack_id, kern_stack_id;
+
+    if (!get_varint(r->f, &pid) || !get_varint(r->f, &comm) || !get_varint(r->f, &count) ||
+        !get_svarint(r->f, &user_stack_id) || !get_svarint(r->f, &kern_stack_id) ||
+        !get_varint(r->f, &kernel_ip))
+    {
+        return -1;
+    }
+    if (kernel_ip && (!get_varint(r->f, &name) || !get_varint(r->f, &offset)))
+    {
+        return -1;
+    }
+    if (r->version >= 2 && (!get_varint(r->f, &cgroup_id) || !get_varint(r->f, &container)))
+    {
+        return -1;
+    }
+    if (r->version >= 4 && !get_varint(r->f, &zone))
+    {
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->key.pid = pid;
+    s->key.kernel_ip = kernel_ip;
+    s->key.user_stack_id = user_stack_id;
+    s->key.kern_stack_id = kern_stack_id;
+    s->key.cgroup_id = cgroup_id;
+    snprintf(s->key.name, sizeof(s->key.name), "%s", string_at(r, comm) ?: "");
+    snprintf(s->key.zone, sizeof(s->key.zone), "%s", string_at(r, zone) ?: "");
+    s->count = count;
+    s->lua_bt = &r->no_lua_bt;
+    s->container = string_at(r, container);
+
+    auto ust = r->user_stacks.find(user_stack_id);
+    if (user_stack_id >= 0 && ust != r->user_stacks.end())
+    {
+        s->uip = ust->second.ips.data();
+        s->nr_uip = ust->second.ips.size();
+        if (ust->second.lua_bt)
+        {
+            s->lua_bt = ust->second.lua_bt.get();
+        }
+    }
+
+    r->kframes.clear();
+    if (kernel_ip)
+    {
+        r->kframes.push_back({(unsigned long)kernel_ip, string_at(r, name), (unsigned long)offset});
+    }
+    auto kst = r->kernel_stacks.find(kern_stack_id);
+    if (kern_stack_id >= 0 && kst != r->kernel_stacks.end())
+    {
+        for (const auto &kf : kst->second)
+        {
+            r->kframes.push_back({kf.ip, string_at(r, kf.name), kf.offset});
+        }
+    }
+    s->kframes = r->kframes.data();
+    s->nr_kframes = r->kframes.size();
+    return 1;
+}
+
+/* Any format version, older ones are read too */
+static bool magic_matches(const char *magic)
+{
+    return !memcmp(magic, RAW_PROFILE_MAGIC, RAW_PROFILE_MAGIC_LEN - 1) &&
+           magic[RAW_PROFILE_MAGIC_LEN - 1] >= RAW_PROFILE_MIN_VERSION;
+}
+
+struct raw_reader *raw_reader__open(const char *path, const char *sysroot)
+{
+    char magic[RAW_PROFILE_MAGIC_LEN];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        return NULL;
+    }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || !magic_matches(magic))
+    {
+        fprintf(stderr, "%s is not a raw profile capture\n", path);
+        fclose(f);
+        return NULL;
+    }
+    if (magic[RAW_PROFILE_MAGIC_LEN - 1] > RAW_PROFILE_MAGIC[RAW_PROFILE_MAGIC_LEN - 1])
+    {
+        fprintf(stderr, "%s is from a newer profile, format version %d\n", path,
+                magic[RAW_PROFILE_MAGIC_LEN - 1]);
+        fclose(f);
+        return NULL;
+    }
+    struct raw_reader *r = new raw_reader;
+    unsigned long long period = 1;
+    r->f = f;
+    r->version = magic[RAW_PROFILE_MAGIC_LEN - 1];
+    r->sysroot = sysroot ? sysroot : "";
+    r->no_lua_bt = {};
+    r->ended = false;
+    r->type = "samples";
+    r->unit = "count";
+    r->period_type = "samples";
+    if (r->version >= 3 && (!get_bytes(f, r->type) || !get_bytes(f, r->unit) ||
+                            !get_bytes(f, r->period_type) || !get_varint(f, &period)))
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        raw_reader__close(r);
+        return NULL;
+    }
+    r->sample_type = {r->type.c_str(), r->unit.c_str(), r->period_type.c_str(), (long long)period};
+    return r;
+}
+
+int raw_reader__next(struct raw_reader *r, struct raw_sample *s)
+{
+    unsigned long long type, id, nr;
+    std::string str;
+
+    while (!r->ended)
+    {
+        if (!get_varint(r->f, &type))
+        {
+            fprintf(stderr, "warning: raw capture is truncated\n");
+            return 0;
+        }
+        switch (type)
+        {
+        case RAW_REC_STRING:
+            if (!get_varint(r->f, &id) || id != r->strings.size() || !get_bytes(r->f, str))
+            {
+                return -1;
+            }
+            r->strings.push_back(std::move(str));
+            break;
+        case RAW_REC_MAPS:
+            if (read_maps(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_USER_STACK:
+            if (read_user_stack(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_KERNEL_STACK:
+            if (read_kernel_stack(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_LUA_SEGMENTS:
+            if (read_lua_segments(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_LUA_FFI:
+            if (read_lua_ffi(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_LUA_NAMES:
+            if (read_lua_names(r))
+            {
+                return -1;
+            }
+            break;
+        case RAW_REC_LUAJIT_VERSION:
+            if (!get_bytes(r->f, str))
+            {
+                return -1;
+            }
+            if (lua_ffnames__select(str.c_str()) < 0)
+            {
+                fprintf(stderr, "no fast function names for LuaJIT %s\n", str.c_str());
+            }
+            break;
+        case RAW_REC_SAMPLE:
+            return read_sample(r, s);
+        case RAW_REC_END:
+            get_varint(r->f, &nr);
+            r->ended = true;
+            break;
+        default:
+            fprintf(stderr, "unknown record type %llu in raw capture\n", type);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const struct syms *raw_reader__syms(struct raw_reader *r, pid_t pid)
+{
+    auto it = r->syms.find(pid);
+    return it == r->syms.end() ? NULL : it->second;
+}
+
+const struct raw_sample_type *raw_reader__sample_type(const struct raw_reader *r)
+{
+    return &r->sample_type;
+}
+
+void raw_reader__close(struct raw_reader *r)
+{
+    if (!r)
+    {
+        return;
+    }
+    for (auto &it : r->syms)
+    {
+        syms__free(it.second);
+    }
+    fclose(r->f);
+    delete r;
+}
+
+bool raw_profile__detect(const char *path)
+{
+    char magic[RAW_PROFILE_MAGIC_LEN];
+    bool ret;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        return false;
+    }
+    ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && magic_matches(magic);
+    fclose(f);
+    return ret;
+}
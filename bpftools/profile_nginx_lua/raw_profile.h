@@ -0,0 +1,89 @@
+#ifndef RAW_PROFILE_H
+#define RAW_PROFILE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "lua_stacks_helper.h"
+
+/*
+ * Compact capture written by profile --output-raw and symbolized later by
+ * profile report.  The file is an 8 byte magic, the sample type, and a
+ * stream of varint-encoded records.  Strings, process maps and stacks are emitted once,
+ * before the first sample that refers to them, so a capture can be read in a
+ * single pass and a truncated file is still usable up to its last record.
+ */
+#define RAW_PROFILE_MAGIC "NLPROF\0\4"
+#define RAW_PROFILE_MAGIC_LEN 8
+/* the last magic byte is the format version; 1 had no cgroup ids, 2 no sample type, 3 no zones */
+#define RAW_PROFILE_MIN_VERSION 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /* A kernel frame, symbolized on the capturing host; name may be NULL */
+    struct kernel_frame
+    {
+        unsigned long ip;
+        const char *name;
+        unsigned long offset;
+    };
+
+    struct raw_sample
+    {
+        struct profile_key_t key;
+        unsigned long long count;
+        const unsigned long *uip;
+        unsigned int nr_uip;
+        /* starts with key.kernel_ip when it is set */
+        const struct kernel_frame *kframes;
+        unsigned int nr_kframes;
+        const struct stack_backtrace *lua_bt;
+        /* the container of key.cgroup_id on the capturing host, may be NULL */
+        const char *container;
+    };
+
+    /* What the count of a sample measures, in pprof terms */
+    struct raw_sample_type
+    {
+        const char *type;
+        const char *unit;
+        const char *period_type;
+        long long period;
+    };
+
+    struct raw_writer;
+
+    struct raw_writer *raw_writer__open(const char *path, const struct raw_sample_type *type);
+    /*
+     * Append one sample.  The /proc/PID/maps executable mappings and their
+     * build-ids are recorded the first time a pid shows up.
+     */
+    int raw_writer__add_sample(struct raw_writer *w, const struct raw_sample *s);
+    /* Writes the trailer; returns non-zero if any write failed */
+    int raw_writer__close(struct raw_writer *w);
+
+    struct raw_reader;
+
+    /* sysroot, if not NULL, is prepended to the paths of mapped files */
+    struct raw_reader *raw_reader__open(const char *path, const char *sysroot);
+    /*
+     * Read the next sample, in the order they were written.  Returns 1 on
+     * success, 0 at the end of the capture and -1 on a malformed file.  The
+     * sample is valid until the next call.
+     */
+    int raw_reader__next(struct raw_reader *r, struct raw_sample *s);
+    /* samples/count for captures that predate the sample type */
+    const struct raw_sample_type *raw_reader__sample_type(const struct raw_reader *r);
+    /* Symbols for the recorded mappings of pid, or NULL */
+    const struct syms *raw_reader__syms(struct raw_reader *r, pid_t pid);
+    void raw_reader__close(struct raw_reader *r);
+
+    bool raw_profile__detect(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+#include "tls_handshake.h"
+#include "bits.bpf.h"
+
+const volatile pid_t targ_pid = -1;
+const volatile bool targ_ms = false;
+
+// the SSL_do_handshake() call a thread is in
+struct hs_call
+{
+	__u64 ssl;
+	__u64 start;
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_HANDSHAKES);
+	__type(key, __u32);
+	__type(value, struct hs_call);
+} calls SEC(".maps");
+
+/*
+ * A non-blocking handshake takes several SSL_do_handshake() calls: wall time
+ * runs from the first to the successful one, CPU time is spent inside them.
+ */
+struct hs_state
+{
+	__u64 start;
+	__u64 cpu_ns;
+	__u32 nr_calls;
+	__u32 full;
+};
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_HANDSHAKES);
+	__type(key, __u64);
+	__type(value, struct hs_state);
+} handshakes SEC(".maps");
+
+__u32 wall_hist[HS_KINDS][MAX_SLOTS] = {};
+__u32 cpu_hist[HS_KINDS][MAX_SLOTS] = {};
+__u64 count[HS_KINDS] = {};
+__u64 wall_ns[HS_KINDS] = {};
+__u64 cpu_ns[HS_KINDS] = {};
+__u64 nr_calls[HS_KINDS] = {};
+
+/* histograms count usecs, or msecs with -m */
+static __always_inline void add_hist_ns(__u32 *hist, __u64 delta)
+{
+	add_hist(hist, delta / (targ_ms ? 1000000 : 1000));
+}
+
+static int probe_handshake_entry(struct pt_regs *ctx)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u32 tid = (__u32)pid_tgid;
+	struct hs_state state = {};
+	struct hs_call call = {};
+
+	if (targ_pid != -1 && targ_pid != pid_tgid >> 32)
+		return 0;
+
+	call.ssl = PT_REGS_PARM1(ctx);
+	call.start = bpf_ktime_get_ns();
+	state.start = call.start;
+	/* only the first call of a handshake creates its state */
+	bpf_map_update_elem(&handshakes, &call.ssl, &state, BPF_NOEXIST);
+	bpf_map_update_elem(&calls, &tid, &call, BPF_ANY);
+	return 0;
+}
+
+static int probe_handshake_return(struct pt_regs *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct hs_state *state;
+	struct hs_call *call;
+	__u64 ssl, start, ts;
+	int kind;
+
+	call = bpf_map_lookup_elem(&calls, &tid);
+	if (!call)
+		return 0;
+	ts = bpf_ktime_get_ns();
+	ssl = call->ssl;
+	start = call->start;
+	bpf_map_delete_elem(&calls, &tid);
+
+	state = bpf_map_lookup_elem(&handshakes, &ssl);
+	if (!state)
+		return 0;
+	state->cpu_ns += ts - start;
+	state->nr_calls++;
+	/* anything but 1 means it wants more I/O, or failed and SSL_free() follows */
+	if ((int)PT_REGS_RC(ctx) != 1)
+		return 0;
+
+	kind = state->full ? HS_FULL : HS_RESUMED;
+	__sync_fetch_and_add(&count[kind], 1);
+	__sync_fetch_and_add(&wall_ns[kind], ts - state->start);
+	__sync_fetch_and_add(&cpu_ns[kind], state->cpu_ns);
+	__sync_fetch_and_add(&nr_calls[kind], state->nr_calls);
+	add_hist_ns(wall_hist[kind], ts - state->start);
+	add_hist_ns(cpu_hist[kind], state->cpu_ns);
+	bpf_map_delete_elem(&handshakes, &ssl);
+	return 0;
+}
+
+/*
+ * Only a full handshake exchanges certificates, uses the private key or
+ * verifies a certificate chain; a resumed one does none of it, whatever the
+ * TLS version.  Calls outside of SSL_do_handshake() have no hs_call.
+ */
+static int probe_full_handshake(struct pt_regs *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct hs_state *state;
+	struct hs_call *call;
+
+	call = bpf_map_lookup_elem(&calls, &tid);
+	if (!call)
+		return 0;
+	state = bpf_map_lookup_elem(&handshakes, &call->ssl);
+	if (state)
+		state->full = 1;
+	return 0;
+}
+
+static int probe_ssl_free(struct pt_regs *ctx)
+{
+	__u64 ssl = PT_REGS_PARM1(ctx);
+
+	bpf_map_delete_elem(&handshakes, &ssl);
+	return 0;
+}
+
+SEC("kprobe/handle_handshake_entry")
+int handle_handshake_entry(struct pt_regs *ctx)
+{
+	return probe_handshake_entry(ctx);
+}
+
+SEC("kprobe/handle_handshake_return")
+int handle_handshake_return(struct pt_regs *ctx)
+{
+	return probe_handshake_return(ctx);
+}
+
+SEC("kprobe/handle_full_handshake")
+int handle_full_handshake(struct pt_regs *ctx)
+{
+	return probe_full_handshake(ctx);
+}
+
+SEC("kprobe/handle_ssl_free")
+int handle_ssl_free(struct pt_regs *ctx)
+{
+	return probe_ssl_free(ctx);
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,341 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * tls_handshake  Summarize the wall and CPU time of TLS handshakes, full and
+ *                resumed apart.
+ *
+ * Handshakes are followed from SSL_do_handshake(), which ngx_ssl_handshake()
+ * calls until it succeeds, so cosocket sslhandshake() calls are seen too.  A
+ * handshake is full if a certificate was sent or received, a private key
+ * signed or decrypted, or a peer certificate chain was verified while it
+ * ran.
+ */
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "tls_handshake.h"
+#include "tls_handshake.skel.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static struct env
+{
+	pid_t pid;
+	const char *libssl;
+	const char *libcrypto;
+	bool milliseconds;
+	int interval;
+	int duration;
+	bool timestamp;
+	bool verbose;
+} env = {
+	.pid = -1,
+	.interval = 99999999,
+	.duration = 99999999,
+};
+
+static volatile bool exiting;
+
+const char *argp_program_version = "tls_handshake 0.1";
+const char argp_program_doc[] =
+	"Summarize the wall and CPU time of TLS handshakes, full and resumed apart.\n"
+	"\n"
+	"USAGE: tls_handshake [OPTIONS...]\n"
+	"Wall time runs from the first SSL_do_handshake() call of a connection to\n"
+	"the one that completes it; CPU time is the time spent inside those calls.\n"
+	"EXAMPLES:\n"
+	"    tls_handshake -p 185            # handshakes of PID 185 until Ctrl-C\n"
+	"    tls_handshake -p 185 -i 5 -T    # print every 5 seconds, with timestamps\n"
+	"    tls_handshake --libssl /usr/local/openresty/openssl/lib/libssl.so.1.1 \\\n"
+	"        --libcrypto /usr/local/openresty/openssl/lib/libcrypto.so.1.1\n";
+
+#define OPT_LIBSSL 1    /* --libssl */
+#define OPT_LIBCRYPTO 2 /* --libcrypto */
+
+static const struct argp_option opts[] = {
+	{"pid", 'p', "PID", 0, "trace process with this PID only"},
+	{"libssl", OPT_LIBSSL, "PATH", 0, "path of libssl (default: found from -p)"},
+	{"libcrypto", OPT_LIBCRYPTO, "PATH", 0, "path of libcrypto (default: found from -p)"},
+	{"milliseconds", 'm', NULL, 0, "millisecond histograms"},
+	{"interval", 'i', "INTERVAL", 0, "summary interval in seconds"},
+	{"duration", 'd', "DURATION", 0, "total duration of trace in seconds"},
+	{"timestamp", 'T', NULL, 0, "print timestamp"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	switch (key)
+	{
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.pid = strtol(arg, NULL, 10);
+		if (errno || env.pid <= 0)
+		{
+			fprintf(stderr, "invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_LIBSSL:
+		env.libssl = arg;
+		break;
+	case OPT_LIBCRYPTO:
+		env.libcrypto = arg;
+		break;
+	case 'm':
+		env.milliseconds = true;
+		break;
+	case 'i':
+		errno = 0;
+		env.interval = strtol(arg, NULL, 10);
+		if (errno || env.interval <= 0)
+		{
+			fprintf(stderr, "invalid INTERVAL: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'd':
+		errno = 0;
+		env.duration = strtol(arg, NULL, 10);
+		if (errno || env.duration <= 0)
+		{
+			fprintf(stderr, "invalid DURATION: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'T':
+		env.timestamp = true;
+		break;
+	case ARGP_KEY_ARG:
+		fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+		argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static void sig_handler(int sig)
+{
+	exiting = true;
+}
+
+/* OpenSSL is a shared library, or linked into nginx by OpenResty builds */
+static int find_openssl(const char *lib, const char *override, char *path, size_t path_sz)
+{
+	if (override)
+	{
+		snprintf(path, path_sz, "%s", override);
+		return 0;
+	}
+	return resolve_lib_or_binary(lib, "nginx", env.pid != -1 ? env.pid : 0, path, path_sz);
+}
+
+static int attach_uprobe(struct bpf_program *prog, bool retprobe, const char *path,
+						 const char *func, struct bpf_link **link)
+{
+	off_t func_off = get_elf_func_offset(path, func);
+
+	if (func_off < 0)
+	{
+		warn("could not find %s in %s\n", func, path);
+		return -1;
+	}
+	*link = bpf_program__attach_uprobe(prog, retprobe, -1, path, func_off);
+	if (!*link)
+	{
+		warn("failed to attach %s: %d\n", func, -errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Only counted inside SSL_do_handshake().  The Certificate message is
+ * encoded by the server and decoded by the client of a full handshake, also
+ * with OpenSSL 3, whose providers sign without EVP_PKEY_sign().  Before 3.0
+ * the private key ops of ServerKeyExchange, CertificateVerify and RSA key
+ * exchange go through EVP_PKEY_sign() and EVP_PKEY_decrypt().
+ * EVP_DigestSign*() also computes HMACs, for the PRF and CBC record MACs of
+ * resumed handshakes, and EVP_PKEY_derive() runs in TLS 1.3 resumptions with
+ * psk_dhe_ke, so neither tells a full handshake.
+ */
+static const char *full_handshake_funcs[] = {
+	"i2d_X509",
+	"d2i_X509",
+	"EVP_PKEY_sign",
+	"EVP_PKEY_decrypt",
+	"X509_verify_cert",
+};
+#define NR_FULL_FUNCS (sizeof(full_handshake_funcs) / sizeof(full_handshake_funcs[0]))
+#define NR_LINKS (3 + NR_FULL_FUNCS)
+
+static int attach_probes(struct tls_handshake_bpf *obj, struct bpf_link *links[])
+{
+	char ssl_path[PATH_MAX], crypto_path[PATH_MAX];
+	int i, attached = 0;
+	off_t func_off;
+
+	if (find_openssl("ssl", env.libssl, ssl_path, sizeof(ssl_path)) ||
+		find_openssl("crypto", env.libcrypto, crypto_path, sizeof(crypto_path)))
+		return -1;
+
+	if (attach_uprobe(obj->progs.handle_handshake_entry, false, ssl_path, "SSL_do_handshake",
+					  &links[0]) ||
+		attach_uprobe(obj->progs.handle_handshake_return, true, ssl_path, "SSL_do_handshake",
+					  &links[1]) ||
+		attach_uprobe(obj->progs.handle_ssl_free, false, ssl_path, "SSL_free", &links[2]))
+		return -1;
+
+	for (i = 0; i < NR_FULL_FUNCS; i++)
+	{
+		func_off = get_elf_func_offset(crypto_path, full_handshake_funcs[i]);
+		if (func_off < 0)
+		{
+			if (env.verbose)
+				warn("could not find %s in %s\n", full_handshake_funcs[i], crypto_path);
+			continue;
+		}
+		links[3 + i] = bpf_program__attach_uprobe(obj->progs.handle_full_handshake, false,
+												  -1, crypto_path, func_off);
+		if (!links[3 + i])
+		{
+			warn("failed to attach %s: %d\n", full_handshake_funcs[i], -errno);
+			return -1;
+		}
+		attached++;
+	}
+	if (!attached)
+	{
+		warn("no certificate functions found in %s, is it libcrypto?\n", crypto_path);
+		return -1;
+	}
+	return 0;
+}
+
+static void print_kind(struct tls_handshake_bpf *obj, int kind, const char *name)
+{
+	const char *unit = env.milliseconds ? "msecs" : "usecs";
+	const unsigned long long div = env.milliseconds ? 1000000 : 1000;
+	__u64 n, wall, cpu, calls;
+
+	n = __atomic_exchange_n(&obj->bss->count[kind], 0, __ATOMIC_RELAXED);
+	wall = __atomic_exchange_n(&obj->bss->wall_ns[kind], 0, __ATOMIC_RELAXED);
+	cpu = __atomic_exchange_n(&obj->bss->cpu_ns[kind], 0, __ATOMIC_RELAXED);
+	calls = __atomic_exchange_n(&obj->bss->nr_calls[kind], 0, __ATOMIC_RELAXED);
+
+	printf("%s handshakes = %llu", name, n);
+	if (n)
+		printf(", avg wall = %llu %s, avg cpu = %llu %s, avg calls = %.1f", wall / n / div, unit,
+			   cpu / n / div, unit, (double)calls / n);
+	printf("\n");
+	if (!n)
+		return;
+
+	printf("\n  wall:\n");
+	print_log2_hist(obj->bss->wall_hist[kind], MAX_SLOTS, unit);
+	printf("\n  cpu:\n");
+	print_log2_hist(obj->bss->cpu_hist[kind], MAX_SLOTS, unit);
+	printf("\n");
+	memset(obj->bss->wall_hist[kind], 0, sizeof(obj->bss->wall_hist[kind]));
+	memset(obj->bss->cpu_hist[kind], 0, sizeof(obj->bss->cpu_hist[kind]));
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	struct bpf_link *links[NR_LINKS] = {};
+	struct tls_handshake_bpf *obj;
+	char ts[32];
+	struct tm *tm;
+	time_t t;
+	int err, i;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	libbpf_set_print(libbpf_print_fn);
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+	obj = tls_handshake_bpf__open();
+	if (!obj)
+	{
+		fprintf(stderr, "failed to open BPF object\n");
+		return 1;
+	}
+
+	obj->rodata->targ_pid = env.pid;
+	obj->rodata->targ_ms = env.milliseconds;
+
+	err = tls_handshake_bpf__load(obj);
+	if (err)
+	{
+		fprintf(stderr, "failed to load BPF programs\n");
+		goto cleanup;
+	}
+
+	err = attach_probes(obj, links);
+	if (err)
+		goto cleanup;
+
+	signal(SIGINT, sig_handler);
+
+	printf("Tracing TLS handshakes");
+	if (env.duration < 99999999)
+		printf(" for %d secs.\n", env.duration);
+	else
+		printf("... Hit Ctrl-C to end.\n");
+
+	for (i = 0; !exiting && i < env.duration; i += env.interval)
+	{
+		sleep(env.interval < env.duration - i ? env.interval : env.duration - i);
+
+		printf("\n");
+		if (env.timestamp)
+		{
+			time(&t);
+			tm = localtime(&t);
+			strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+			printf("%-8s\n", ts);
+		}
+		print_kind(obj, HS_FULL, "full");
+		print_kind(obj, HS_RESUMED, "resumed");
+	}
+
+cleanup:
+	for (i = 0; i < NR_LINKS; i++)
+		bpf_link__destroy(links[i]);
+	tls_handshake_bpf__destroy(obj);
+	return err != 0;
+}
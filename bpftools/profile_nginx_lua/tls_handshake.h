@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef __TLS_HANDSHAKE_H
+#define __TLS_HANDSHAKE_H
+
+#define MAX_SLOTS 32
+#define MAX_HANDSHAKES 10240
+
+enum hs_kind
+{
+	HS_RESUMED,
+	HS_FULL,
+	HS_KINDS,
+};
+
+#endif /* __TLS_HANDSHAKE_H */
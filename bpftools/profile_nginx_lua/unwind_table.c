@@ -0,0 +1,812 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <gelf.h>
+#include <bpf/bpf.h>
+#include "profile.h"
+#include "uprobe_helpers.h"
+#include "unwind_table.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+/* DWARF numbers of the x86_64 registers the unwinder follows */
+#define REG_RBP 6
+#define REG_RSP 7
+#define REG_RA 16
+
+#define DW_EH_PE_omit 0xff
+#define DW_EH_PE_pcrel 0x10
+
+#define DW_CFA_nop 0x00
+#define DW_CFA_set_loc 0x01
+#define DW_CFA_advance_loc1 0x02
+#define DW_CFA_advance_loc2 0x03
+#define DW_CFA_advance_loc4 0x04
+#define DW_CFA_offset_extended 0x05
+#define DW_CFA_restore_extended 0x06
+#define DW_CFA_undefined 0x07
+#define DW_CFA_same_value 0x08
+#define DW_CFA_register 0x09
+#define DW_CFA_remember_state 0x0a
+#define DW_CFA_restore_state 0x0b
+#define DW_CFA_def_cfa 0x0c
+#define DW_CFA_def_cfa_register 0x0d
+#define DW_CFA_def_cfa_offset 0x0e
+#define DW_CFA_def_cfa_expression 0x0f
+#define DW_CFA_expression 0x10
+#define DW_CFA_offset_extended_sf 0x11
+#define DW_CFA_def_cfa_sf 0x12
+#define DW_CFA_def_cfa_offset_sf 0x13
+#define DW_CFA_val_offset 0x14
+#define DW_CFA_val_offset_sf 0x15
+#define DW_CFA_val_expression 0x16
+#define DW_CFA_GNU_args_size 0x2e
+#define DW_CFA_GNU_negative_offset_extended 0x2f
+
+#define MAX_REMEMBERED_STATES 8
+#define MAX_EXEC_SEGMENTS 4
+
+struct cursor {
+	const unsigned char *buf;
+	size_t size;
+	size_t pos;
+	/* address of buf[0], for pc-relative pointers */
+	unsigned long long addr;
+	bool bad;
+};
+
+static unsigned long long read_uint(struct cursor *c, size_t n)
+{
+	unsigned long long v = 0;
+	size_t i;
+
+	if (c->bad || n > c->size - c->pos) {
+		c->bad = true;
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		v |= (unsigned long long)c->buf[c->pos + i] << (8 * i);
+	c->pos += n;
+	return v;
+}
+
+static unsigned long long read_uleb(struct cursor *c)
+{
+	unsigned long long v = 0, b;
+	int shift = 0;
+
+	do {
+		b = read_uint(c, 1);
+		if (shift < 64)
+			v |= (b & 0x7f) << shift;
+		shift += 7;
+	} while ((b & 0x80) && !c->bad);
+	return v;
+}
+
+static long long read_sleb(struct cursor *c)
+{
+	unsigned long long v = 0, b;
+	int shift = 0;
+
+	do {
+		b = read_uint(c, 1);
+		if (shift < 64)
+			v |= (b & 0x7f) << shift;
+		shift += 7;
+	} while ((b & 0x80) && !c->bad);
+	if (shift < 64 && (b & 0x40))
+		v |= ~0ULL << shift;
+	return v;
+}
+
+/* A pointer in one of the DW_EH_PE_* encodings gcc and clang emit */
+static unsigned long long read_encoded(struct cursor *c, unsigned char enc)
+{
+	unsigned long long base = c->addr + c->pos, v;
+
+	if (enc == DW_EH_PE_omit)
+		return 0;
+	switch (enc & 0x0f) {
+	case 0x00:
+	case 0x04:
+	case 0x0c:
+		v = read_uint(c, 8);
+		break;
+	case 0x01:
+		v = read_uleb(c);
+		break;
+	case 0x02:
+		v = read_uint(c, 2);
+		break;
+	case 0x03:
+		v = read_uint(c, 4);
+		break;
+	case 0x09:
+		v = read_sleb(c);
+		break;
+	case 0x0a:
+		v = (short)read_uint(c, 2);
+		break;
+	case 0x0b:
+		v = (int)read_uint(c, 4);
+		break;
+	default:
+		c->bad = true;
+		return 0;
+	}
+	/* DW_EH_PE_indirect only shows up in personality pointers, which are skipped */
+	switch (enc & 0x70) {
+	case 0:
+		break;
+	case DW_EH_PE_pcrel:
+		v += base;
+		break;
+	default:
+		c->bad = true;
+	}
+	return v;
+}
+
+enum ra_rule {
+	RA_AT_CFA,	/* saved at cfa - 8, by the call */
+	RA_UNDEFINED,	/* outermost frame */
+	RA_OTHER,
+};
+
+enum cfa_expr {
+	CFA_EXPR_NONE,
+	CFA_EXPR_PLT,
+	CFA_EXPR_OTHER,
+};
+
+struct cfa_state {
+	unsigned long long cfa_reg;
+	long long cfa_offset;
+	enum cfa_expr cfa_expr;
+	int plt_threshold;
+	long long rbp_offset;
+	enum ra_rule ra;
+};
+
+struct cie {
+	unsigned long long code_align;
+	long long data_align;
+	unsigned char fde_enc;
+	bool has_aug_data;
+	struct cfa_state init;
+};
+
+struct row_vec {
+	struct unwind_row *rows;
+	size_t nr;
+	size_t cap;
+};
+
+static struct unwind_row row_of(const struct cfa_state *st, unsigned long long pc)
+{
+	struct unwind_row row = { .pc = pc, .cfa_type = UNWIND_CFA_NONE };
+
+	if (st->ra == RA_UNDEFINED) {
+		row.cfa_type = UNWIND_CFA_END;
+		return row;
+	}
+	if (st->ra != RA_AT_CFA)
+		return row;
+	if (st->cfa_expr == CFA_EXPR_PLT) {
+		row.cfa_type = UNWIND_CFA_PLT;
+		row.cfa_offset = st->plt_threshold;
+		return row;
+	}
+	if (st->cfa_expr != CFA_EXPR_NONE || st->cfa_offset != (int)st->cfa_offset)
+		return row;
+	if (st->cfa_reg == REG_RSP)
+		row.cfa_type = UNWIND_CFA_RSP;
+	else if (st->cfa_reg == REG_RBP)
+		row.cfa_type = UNWIND_CFA_RBP;
+	else
+		return row;
+	row.cfa_offset = st->cfa_offset;
+	/* an offset that does not fit is dropped, rbp is then left as is */
+	if (st->rbp_offset == (short)st->rbp_offset)
+		row.rbp_offset = st->rbp_offset;
+	return row;
+}
+
+/* Rows of one FDE start at first; a later row at the same pc replaces the earlier */
+static int push_row(struct row_vec *v, size_t first, struct unwind_row row)
+{
+	struct unwind_row *tmp;
+
+	if (v->nr > first && v->rows[v->nr - 1].pc == row.pc) {
+		v->rows[v->nr - 1] = row;
+		return 0;
+	}
+	if (v->nr == v->cap) {
+		v->cap = v->cap ? v->cap * 2 : 4096;
+		tmp = realloc(v->rows, v->cap * sizeof(*v->rows));
+		if (!tmp)
+			return -ENOMEM;
+		v->rows = tmp;
+	}
+	v->rows[v->nr++] = row;
+	return 0;
+}
+
+static void set_offset(struct cfa_state *st, unsigned long long reg, long long off)
+{
+	if (reg == REG_RBP)
+		st->rbp_offset = off;
+	else if (reg == REG_RA)
+		st->ra = off == -8 ? RA_AT_CFA : RA_OTHER;
+}
+
+/* register, expression and val_* rules, which the BPF side cannot follow */
+static void set_other(struct cfa_state *st, unsigned long long reg)
+{
+	if (reg == REG_RBP)
+		st->rbp_offset = 0;
+	else if (reg == REG_RA)
+		st->ra = RA_OTHER;
+}
+
+static void restore_reg(struct cfa_state *st, const struct cfa_state *init,
+			unsigned long long reg)
+{
+	if (reg == REG_RBP)
+		st->rbp_offset = init ? init->rbp_offset : 0;
+	else if (reg == REG_RA)
+		st->ra = init ? init->ra : RA_AT_CFA;
+}
+
+/*
+ * The expression ld writes for the lazy binding .plt entries of x86_64:
+ * DW_OP_breg7 8; DW_OP_breg16 0; DW_OP_lit15; DW_OP_and; DW_OP_litN;
+ * DW_OP_ge; DW_OP_lit3; DW_OP_shl; DW_OP_plus, i.e. the CFA is rsp + 8, or
+ * rsp + 16 from the push of the entry on, at pc & 15 >= N.
+ */
+static int plt_threshold(const unsigned char *e, unsigned long long len)
+{
+	if (len != 11 || e[0] != 0x77 || e[1] != 0x08 || e[2] != 0x80 || e[3] != 0x00 ||
+	    e[4] != 0x3f || e[5] != 0x1a || e[6] < 0x30 || e[6] > 0x4f || e[7] != 0x2a ||
+	    e[8] != 0x33 || e[9] != 0x24 || e[10] != 0x22)
+		return -1;
+	return e[6] - 0x30;
+}
+
+static int advance(struct row_vec *v, size_t first, const struct cfa_state *st,
+		   unsigned long long *loc, unsigned long long new_loc)
+{
+	int err;
+
+	if (v) {
+		err = push_row(v, first, row_of(st, *loc));
+		if (err)
+			return err;
+	}
+	*loc = new_loc;
+	return 0;
+}
+
+/*
+ * Run the call frame instructions in [c->pos, end).  Without v, for the
+ * initial instructions of a CIE, only the state is updated; with v, the row
+ * of every location the instructions advance past is pushed.
+ */
+static int run_cfa(struct cursor *c, size_t end, const struct cie *cie,
+		   const struct cfa_state *init, struct cfa_state *st,
+		   unsigned long long *loc, struct row_vec *v, size_t first)
+{
+	struct cfa_state remembered[MAX_REMEMBERED_STATES];
+	unsigned long long reg, len;
+	int depth = 0, err = 0, n;
+	unsigned char op;
+
+	while (!err && c->pos < end && !c->bad) {
+		op = read_uint(c, 1);
+		switch (op & 0xc0) {
+		case 0x40:
+			err = advance(v, first, st, loc, *loc + (op & 0x3f) * cie->code_align);
+			continue;
+		case 0x80:
+			set_offset(st, op & 0x3f, read_uleb(c) * cie->data_align);
+			continue;
+		case 0xc0:
+			restore_reg(st, init, op & 0x3f);
+			continue;
+		}
+		switch (op) {
+		case DW_CFA_nop:
+			break;
+		case DW_CFA_GNU_args_size:
+			read_uleb(c);
+			break;
+		case DW_CFA_set_loc:
+			err = advance(v, first, st, loc, read_encoded(c, cie->fde_enc));
+			break;
+		case DW_CFA_advance_loc1:
+			err = advance(v, first, st, loc, *loc + read_uint(c, 1) * cie->code_align);
+			break;
+		case DW_CFA_advance_loc2:
+			err = advance(v, first, st, loc, *loc + read_uint(c, 2) * cie->code_align);
+			break;
+		case DW_CFA_advance_loc4:
+			err = advance(v, first, st, loc, *loc + read_uint(c, 4) * cie->code_align);
+			break;
+		case DW_CFA_offset_extended:
+			reg = read_uleb(c);
+			set_offset(st, reg, read_uleb(c) * cie->data_align);
+			break;
+		case DW_CFA_offset_extended_sf:
+			reg = read_uleb(c);
+			set_offset(st, reg, read_sleb(c) * cie->data_align);
+			break;
+		case DW_CFA_GNU_negative_offset_extended:
+			reg = read_uleb(c);
+			set_offset(st, reg, -(long long)read_uleb(c) * cie->data_align);
+			break;
+		case DW_CFA_restore_extended:
+			restore_reg(st, init, read_uleb(c));
+			break;
+		case DW_CFA_undefined:
+			reg = read_uleb(c);
+			if (reg == REG_RA)
+				st->ra = RA_UNDEFINED;
+			else
+				set_other(st, reg);
+			break;
+		case DW_CFA_same_value:
+			reg = read_uleb(c);
+			if (reg == REG_RBP)
+				st->rbp_offset = 0;
+			else if (reg == REG_RA)
+				st->ra = RA_OTHER;
+			break;
+		case DW_CFA_register:
+		case DW_CFA_val_offset:
+			reg = read_uleb(c);
+			read_uleb(c);
+			set_other(st, reg);
+			break;
+		case DW_CFA_val_offset_sf:
+			reg = read_uleb(c);
+			read_sleb(c);
+			set_other(st, reg);
+			break;
+		case DW_CFA_expression:
+		case DW_CFA_val_expression:
+			reg = read_uleb(c);
+			len = read_uleb(c);
+			if (len > c->size - c->pos)
+				c->bad = true;
+			else
+				c->pos += len;
+			set_other(st, reg);
+			break;
+		case DW_CFA_remember_state:
+			if (depth == MAX_REMEMBERED_STATES)
+				return -E2BIG;
+			remembered[depth++] = *st;
+			break;
+		case DW_CFA_restore_state:
+			if (!depth)
+				return -EINVAL;
+			*st = remembered[--depth];
+			break;
+		case DW_CFA_def_cfa:
+			st->cfa_reg = read_uleb(c);
+			st->cfa_offset = read_uleb(c);
+			st->cfa_expr = CFA_EXPR_NONE;
+			break;
+		case DW_CFA_def_cfa_sf:
+			st->cfa_reg = read_uleb(c);
+			st->cfa_offset = read_sleb(c) * cie->data_align;
+			st->cfa_expr = CFA_EXPR_NONE;
+			break;
+		case DW_CFA_def_cfa_register:
+			st->cfa_reg = read_uleb(c);
+			st->cfa_expr = CFA_EXPR_NONE;
+			break;
+		case DW_CFA_def_cfa_offset:
+			st->cfa_offset = read_uleb(c);
+			break;
+		case DW_CFA_def_cfa_offset_sf:
+			st->cfa_offset = read_sleb(c) * cie->data_align;
+			break;
+		case DW_CFA_def_cfa_expression:
+			len = read_uleb(c);
+			if (c->bad || len > c->size - c->pos) {
+				c->bad = true;
+				break;
+			}
+			n = plt_threshold(c->buf + c->pos, len);
+			st->cfa_expr = n < 0 ? CFA_EXPR_OTHER : CFA_EXPR_PLT;
+			st->plt_threshold = n;
+			c->pos += len;
+			break;
+		default:
+			return -EOPNOTSUPP;
+		}
+	}
+	if (c->bad)
+		return -EINVAL;
+	return err;
+}
+
+static int parse_cie(const struct cursor *section, size_t pos, struct cie *cie)
+{
+	struct cursor c = *section;
+	const char *aug;
+	unsigned long long len, loc = 0;
+	size_t end, aug_end;
+	unsigned char version;
+
+	memset(cie, 0, sizeof(*cie));
+	c.pos = pos;
+	len = read_uint(&c, 4);
+	if (len == 0xffffffff)
+		len = read_uint(&c, 8);
+	if (c.bad || len > c.size - c.pos)
+		return -EINVAL;
+	end = c.pos + len;
+	if (read_uint(&c, 4) != 0)
+		return -EINVAL;
+	version = read_uint(&c, 1);
+	if (c.bad || c.pos >= end)
+		return -EINVAL;
+	if (version != 1 && version != 3)
+		return -EOPNOTSUPP;
+	aug = (const char *)c.buf + c.pos;
+	c.pos += strnlen(aug, end - c.pos) + 1;
+	/* the old GNU "eh" augmentation is followed by a pointer we do not know */
+	if (strstr(aug, "eh"))
+		return -EOPNOTSUPP;
+	cie->code_align = read_uleb(&c);
+	cie->data_align = read_sleb(&c);
+	if (version == 1)
+		read_uint(&c, 1);
+	else
+		read_uleb(&c);
+
+	if (aug[0] == 'z') {
+		cie->has_aug_data = true;
+		len = read_uleb(&c);
+		aug_end = c.pos + len;
+		for (aug++; *aug && !c.bad; aug++) {
+			if (*aug == 'R')
+				cie->fde_enc = read_uint(&c, 1);
+			else if (*aug == 'P')
+				read_encoded(&c, read_uint(&c, 1));
+			else if (*aug == 'L')
+				read_uint(&c, 1);
+			else if (*aug != 'S' && *aug != 'B')
+				break;
+		}
+		c.pos = aug_end;
+	}
+	if (c.bad || c.pos > end)
+		return -EINVAL;
+	return run_cfa(&c, end, cie, NULL, &cie->init, &loc, NULL, 0);
+}
+
+/* Rows of every FDE of an .eh_frame section loaded at addr */
+static int parse_eh_frame(const unsigned char *buf, size_t size, unsigned long long addr,
+			  struct row_vec *v)
+{
+	struct cursor c = { .buf = buf, .size = size, .addr = addr };
+	unsigned long long len, pc_begin, pc_range, loc;
+	struct cfa_state st;
+	size_t end, id_pos, first;
+	struct cie cie;
+	__u32 id;
+	int err;
+
+	while (c.pos + 4 <= size) {
+		len = read_uint(&c, 4);
+		/* zero terminator */
+		if (!len)
+			break;
+		if (len == 0xffffffff)
+			len = read_uint(&c, 8);
+		if (c.bad || len > size - c.pos)
+			return -EINVAL;
+		end = c.pos + len;
+		id_pos = c.pos;
+		id = read_uint(&c, 4);
+		/* CIEs are parsed from the FDEs that point to them */
+		if (!id || id > id_pos || parse_cie(&c, id_pos - id, &cie)) {
+			c.pos = end;
+			continue;
+		}
+		pc_begin = read_encoded(&c, cie.fde_enc);
+		pc_range = read_encoded(&c, cie.fde_enc & 0x0f);
+		if (cie.has_aug_data) {
+			len = read_uleb(&c);
+			c.pos += len;
+		}
+		if (c.bad || c.pos > end) {
+			c.bad = false;
+			c.pos = end;
+			continue;
+		}
+
+		st = cie.init;
+		loc = pc_begin;
+		first = v->nr;
+		err = run_cfa(&c, end, &cie, &cie.init, &st, &loc, v, first);
+		if (err == -ENOMEM)
+			return err;
+		/* from an instruction we cannot run on, the function is not unwound */
+		if (err)
+			st.ra = RA_OTHER;
+		err = push_row(v, first, row_of(&st, loc));
+		if (!err && loc < pc_begin + pc_range) {
+			st.ra = RA_OTHER;
+			err = push_row(v, first, row_of(&st, pc_begin + pc_range));
+		}
+		if (err)
+			return err;
+		c.bad = false;
+		c.pos = end;
+	}
+	return 0;
+}
+
+static int row_cmp(const void *a, const void *b)
+{
+	const struct unwind_row *x = a, *y = b;
+
+	if (x->pc != y->pc)
+		return x->pc < y->pc ? -1 : 1;
+	/* the end of a function is also the start of the next one */
+	return (x->cfa_type != UNWIND_CFA_NONE) - (y->cfa_type != UNWIND_CFA_NONE);
+}
+
+static bool same_rule(const struct unwind_row *a, const struct unwind_row *b)
+{
+	return a->cfa_type == b->cfa_type && a->cfa_offset == b->cfa_offset &&
+	       a->rbp_offset == b->rbp_offset;
+}
+
+/* Sort by pc, keep one row per pc and drop rows that do not change the rule */
+static size_t compact_rows(struct unwind_row *rows, size_t nr)
+{
+	size_t i, n = 0;
+
+	qsort(rows, nr, sizeof(*rows), row_cmp);
+	for (i = 0; i < nr; i++) {
+		if (n && rows[n - 1].pc == rows[i].pc) {
+			rows[n - 1] = rows[i];
+			if (n > 1 && same_rule(&rows[n - 2], &rows[n - 1]))
+				n--;
+			continue;
+		}
+		if (n && same_rule(&rows[n - 1], &rows[i]))
+			continue;
+		rows[n++] = rows[i];
+	}
+	return n;
+}
+
+struct exec_segment {
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned long long vaddr;
+};
+
+struct dso_table {
+	dev_t dev;
+	ino_t ino;
+	/* 0 if the DSO has no usable .eh_frame, or did not fit */
+	unsigned int nr_rows;
+	unsigned int row_start;
+	int nr_segments;
+	struct exec_segment segments[MAX_EXEC_SEGMENTS];
+};
+
+struct unwind_tables {
+	int rows_fd;
+	unsigned int max_rows;
+	unsigned int nr_rows;
+	bool verbose;
+	bool full;
+	struct dso_table *dsos;
+	size_t nr_dsos;
+	size_t cap;
+};
+
+static int read_eh_frame(Elf *e, struct dso_table *dso, struct row_vec *v)
+{
+	size_t shstrndx, i, nr_phdrs;
+	Elf_Scn *scn = NULL;
+	const char *name;
+	Elf_Data *data;
+	GElf_Shdr shdr;
+	GElf_Phdr phdr;
+
+	if (elf_getphdrnum(e, &nr_phdrs))
+		return -EINVAL;
+	for (i = 0; i < nr_phdrs && dso->nr_segments < MAX_EXEC_SEGMENTS; i++) {
+		if (!gelf_getphdr(e, i, &phdr) || phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X))
+			continue;
+		dso->segments[dso->nr_segments].offset = phdr.p_offset;
+		dso->segments[dso->nr_segments].size = phdr.p_filesz;
+		dso->segments[dso->nr_segments++].vaddr = phdr.p_vaddr;
+	}
+
+	if (elf_getshdrstrndx(e, &shstrndx))
+		return -EINVAL;
+	while ((scn = elf_nextscn(e, scn))) {
+		if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_PROGBITS)
+			continue;
+		name = elf_strptr(e, shstrndx, shdr.sh_name);
+		if (!name || strcmp(name, ".eh_frame"))
+			continue;
+		data = elf_getdata(scn, NULL);
+		if (!data || !data->d_buf)
+			return -EINVAL;
+		return parse_eh_frame(data->d_buf, data->d_size, shdr.sh_addr, v);
+	}
+	return -ENOENT;
+}
+
+static void build_dso(struct unwind_tables *t, struct dso_table *dso, const char *path,
+		      const char *name)
+{
+	struct row_vec v = {};
+	unsigned int i;
+	size_t n = 0;
+	int fd, err;
+	Elf *e;
+
+	e = open_elf(path, &fd);
+	if (!e)
+		return;
+	err = read_eh_frame(e, dso, &v);
+	close_elf(e, fd);
+	if (!err)
+		n = compact_rows(v.rows, v.nr);
+	if (err || !n) {
+		if (t->verbose)
+			warn("no unwind rows for %s: %s\n", name, err ? strerror(-err) : "empty .eh_frame");
+		goto out;
+	}
+	if (n > t->max_rows - t->nr_rows) {
+		if (!t->full)
+			warn("unwind table full at %u rows, %s and later binaries are not unwound\n",
+			     t->nr_rows, name);
+		t->full = true;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		__u32 idx = t->nr_rows + i;
+
+		if (bpf_map_update_elem(t->rows_fd, &idx, &v.rows[i], BPF_ANY)) {
+			warn("failed to store unwind rows of %s: %s\n", name, strerror(errno));
+			goto out;
+		}
+	}
+	dso->row_start = t->nr_rows;
+	dso->nr_rows = n;
+	t->nr_rows += n;
+	if (t->verbose)
+		warn("%u unwind rows for %s\n", dso->nr_rows, name);
+out:
+	free(v.rows);
+}
+
+static struct dso_table *get_dso(struct unwind_tables *t, dev_t dev, ino_t ino,
+				 const char *path, const char *name)
+{
+	struct dso_table *tmp;
+	size_t i;
+
+	for (i = 0; i < t->nr_dsos; i++) {
+		if (t->dsos[i].dev == dev && t->dsos[i].ino == ino)
+			return &t->dsos[i];
+	}
+	if (t->nr_dsos == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		tmp = realloc(t->dsos, t->cap * sizeof(*t->dsos));
+		if (!tmp)
+			return NULL;
+		t->dsos = tmp;
+	}
+	tmp = &t->dsos[t->nr_dsos++];
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->dev = dev;
+	tmp->ino = ino;
+	build_dso(t, tmp, path, name);
+	return tmp;
+}
+
+struct unwind_tables *unwind_tables__new(int rows_fd, unsigned int max_rows, bool verbose)
+{
+	struct unwind_tables *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->rows_fd = rows_fd;
+	t->max_rows = max_rows;
+	t->verbose = verbose;
+	return t;
+}
+
+int unwind_tables__add_pid(struct unwind_tables *t, pid_t pid, int procs_fd)
+{
+	unsigned long long start, end, off, ino, bias;
+	char line[PATH_MAX + 128], name[PATH_MAX], path[96], perms[8];
+	struct unwind_proc proc = {};
+	struct unwind_mapping *m;
+	struct exec_segment *seg;
+	unsigned int major, minor;
+	struct dso_table *dso;
+	__u32 key = pid;
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llx-%llx %7s %llx %x:%x %llu %4095s", &start, &end, perms, &off,
+			   &major, &minor, &ino, name) != 8)
+			continue;
+		if (perms[2] != 'x' || !ino || name[0] != '/')
+			continue;
+		if (proc.nr_mappings == MAX_UNWIND_MAPPINGS) {
+			if (t->verbose)
+				warn("pid %d maps more than %d executable files, %s and later ones are not unwound\n",
+				     pid, MAX_UNWIND_MAPPINGS, name);
+			break;
+		}
+		/* opens deleted files and files of other mount namespaces alike */
+		snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid, start, end);
+		dso = get_dso(t, makedev(major, minor), ino, path, name);
+		if (!dso) {
+			fclose(f);
+			return -ENOMEM;
+		}
+		if (!dso->nr_rows)
+			continue;
+		for (i = 0; i < dso->nr_segments; i++) {
+			seg = &dso->segments[i];
+			if (off >= (seg->offset & ~0xfffULL) && off < seg->offset + seg->size)
+				break;
+		}
+		if (i == dso->nr_segments)
+			continue;
+		/* address of the mapping minus the ELF address it was loaded from */
+		bias = start - off + seg->offset - seg->vaddr;
+		m = &proc.mappings[proc.nr_mappings++];
+		m->start = start;
+		m->end = end;
+		m->bias = bias;
+		m->row_start = dso->row_start;
+		m->nr_rows = dso->nr_rows;
+	}
+	fclose(f);
+
+	if (bpf_map_update_elem(procs_fd, &key, &proc, BPF_ANY))
+		return -errno;
+	return 0;
+}
+
+unsigned int unwind_tables__nr_rows(const struct unwind_tables *t)
+{
+	return t->nr_rows;
+}
+
+void unwind_tables__free(struct unwind_tables *t)
+{
+	if (!t)
+		return;
+	free(t->dsos);
+	free(t);
+}
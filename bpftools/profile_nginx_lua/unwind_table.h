@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __UNWIND_TABLE_H
+#define __UNWIND_TABLE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Unwind rows built from the .eh_frame of every executable mapping of a
+ * process, for the BPF unwinder of profile --dwarf.  Rows of one DSO are
+ * contiguous and sorted by pc in the rows map; a DSO mapped by several
+ * processes is only parsed and stored once.
+ */
+struct unwind_tables;
+
+struct unwind_tables *unwind_tables__new(int rows_fd, unsigned int max_rows, bool verbose);
+/* Store the rows of the mappings of pid and its unwind_proc in procs_fd */
+int unwind_tables__add_pid(struct unwind_tables *t, pid_t pid, int procs_fd);
+unsigned int unwind_tables__nr_rows(const struct unwind_tables *t);
+void unwind_tables__free(struct unwind_tables *t);
+
+#endif /* __UNWIND_TABLE_H */
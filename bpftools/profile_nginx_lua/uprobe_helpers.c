@@ -45,12 +45,8 @@ int get_pid_binary_path(pid_t pid, char *path, size_t path_sz)
 	return 0;
 }
 
-/*
- * Returns 0 on success; -1 on failure.  On success, returns via `path` the full
- * path to a library matching the name `lib` that is loaded into pid's address
- * space.
- */
-int get_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz)
+/* Like get_pid_lib_path(), but returns 1 quietly if pid does not map lib */
+static int find_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz)
 {
 	FILE *maps;
 	char *p;
@@ -88,9 +84,22 @@ int get_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz)
 		return 0;
 	}
 
-	warn("Cannot find library %s\n", lib);
 	fclose(maps);
-	return -1;
+	return 1;
+}
+
+/*
+ * Returns 0 on success; -1 on failure.  On success, returns via `path` the full
+ * path to a library matching the name `lib` that is loaded into pid's address
+ * space.
+ */
+int get_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz)
+{
+	int err = find_pid_lib_path(pid, lib, path, path_sz);
+
+	if (err > 0)
+		warn("Cannot find library %s\n", lib);
+	return err ? -1 : 0;
 }
 
 /*
@@ -157,6 +166,19 @@ int resolve_binary_path(const char *binary, pid_t pid, char *path, size_t path_s
 	return 0;
 }
 
+/*
+ * For code that is either a shared library or linked into the binary, like
+ * OpenSSL: returns via `path` the library `lib` if pid maps it, and the binary
+ * of pid, or `binary` when pid is 0, otherwise.
+ */
+int resolve_lib_or_binary(const char *lib, const char *binary, pid_t pid, char *path,
+			  size_t path_sz)
+{
+	if (pid && !find_pid_lib_path(pid, lib, path, path_sz))
+		return 0;
+	return resolve_binary_path(pid ? "" : binary, pid, path, path_sz);
+}
+
 /*
  * Opens an elf at `path` of kind ELF_K_ELF.  Returns NULL on failure.  On
  * success, close with close_elf(e, fd_close).
@@ -287,3 +309,44 @@ out:
 	close_elf(e, fd);
 	return ret;
 }
+
+/*
+ * Returns the length of the GNU build-id of the ELF file at path, copied to
+ * build_id (truncated to size), or -1 if it has none.
+ */
+int get_elf_build_id(const char *path, unsigned char *build_id, size_t size)
+{
+	int ret = -1, fd = -1;
+	Elf *e;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	GElf_Shdr shdr[1];
+	GElf_Nhdr nhdr;
+	size_t off, next, name_off, desc_off;
+
+	e = open_elf(path, &fd);
+	if (!e)
+		return -1;
+
+	scn = NULL;
+	while ((scn = elf_nextscn(e, scn))) {
+		if (!gelf_getshdr(scn, shdr) || shdr->sh_type != SHT_NOTE)
+			continue;
+		data = NULL;
+		while ((data = elf_getdata(scn, data))) {
+			for (off = 0; (next = gelf_getnote(data, off, &nhdr, &name_off, &desc_off)) > 0;
+			     off = next) {
+				if (nhdr.n_type != NT_GNU_BUILD_ID || nhdr.n_namesz != 4 ||
+				    memcmp((char *)data->d_buf + name_off, "GNU", 4))
+					continue;
+				ret = nhdr.n_descsz;
+				memcpy(build_id, (char *)data->d_buf + desc_off,
+				       (size_t)ret < size ? (size_t)ret : size);
+				goto out;
+			}
+		}
+	}
+out:
+	close_elf(e, fd);
+	return ret;
+}
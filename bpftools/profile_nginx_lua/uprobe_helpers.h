@@ -10,7 +10,10 @@
 int get_pid_binary_path(pid_t pid, char *path, size_t path_sz);
 int get_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz);
 int resolve_binary_path(const char *binary, pid_t pid, char *path, size_t path_sz);
+int resolve_lib_or_binary(const char *lib, const char *binary, pid_t pid, char *path,
+			  size_t path_sz);
 off_t get_elf_func_offset(const char *path, const char *func);
+int get_elf_build_id(const char *path, unsigned char *build_id, size_t size);
 Elf *open_elf(const char *path, int *fd_close);
 Elf *open_elf_by_fd(int fd);
 void close_elf(Elf *e, int fd_close);
@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+#include "upstream_lat.h"
+#include "bits.bpf.h"
+#include "maps.bpf.h"
+
+#define AF_INET 2
+#define AF_INET6 10
+
+const volatile pid_t targ_pid = -1;
+const volatile bool targ_ms = false;
+
+/*
+ * One request/response exchange on a connection: the first send after the
+ * previous response starts it, the first read of the worker ends the TTFB,
+ * and the next send or the close ends the transfer.
+ */
+struct sock_info
+{
+	struct peer_key peer;
+	__u64 connect_start;
+	__u64 req_start;
+	__u64 first_rx;
+	__u64 last_rx;
+};
+
+// sockets connected by the target; a close that is missed is dropped by the LRU
+struct
+{
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_SOCKS);
+	__type(key, __u64);
+	__type(value, struct sock_info);
+} socks SEC(".maps");
+
+// enum peer_kind of the nginx function a thread is connecting from
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_SOCKS);
+	__type(key, __u32);
+	__type(value, __u32);
+} connecting SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PEERS);
+	__type(key, struct peer_key);
+	__type(value, struct peer_stats);
+} peers SEC(".maps");
+
+static const struct peer_stats zero_stats;
+
+/* histograms count usecs, or msecs with -m */
+static __always_inline void add_hist_ns(__u32 *hist, __u64 delta)
+{
+	add_hist(hist, delta / (targ_ms ? 1000000 : 1000));
+}
+
+static __always_inline bool is_target(void)
+{
+	char comm[TASK_COMM_LEN];
+
+	if (targ_pid != -1)
+		return targ_pid == bpf_get_current_pid_tgid() >> 32;
+	/* every worker by default, they all go by the name of the master */
+	bpf_get_current_comm(comm, sizeof(comm));
+	return comm[0] == 'n' && comm[1] == 'g' && comm[2] == 'i' && comm[3] == 'n' &&
+		   comm[4] == 'x';
+}
+
+static __always_inline void end_exchange(struct sock_info *info)
+{
+	struct peer_stats *stats;
+
+	if (info->first_rx)
+	{
+		stats = bpf_map_lookup_or_try_init(&peers, &info->peer, &zero_stats);
+		if (stats)
+			add_hist_ns(stats->xfer_hist, info->last_rx - info->first_rx);
+	}
+	info->req_start = 0;
+	info->first_rx = 0;
+	info->last_rx = 0;
+}
+
+static int probe_connect_from(__u32 kind)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+
+	if (!is_target())
+		return 0;
+	bpf_map_update_elem(&connecting, &tid, &kind, BPF_ANY);
+	return 0;
+}
+
+static int probe_connect_return(void)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+
+	bpf_map_delete_elem(&connecting, &tid);
+	return 0;
+}
+
+static int probe_set_state(struct trace_event_raw_inet_sock_set_state *ctx)
+{
+	__u64 sk = (__u64)ctx->skaddr;
+	struct sock_info info = {}, *infop;
+	struct peer_stats *stats;
+	__u32 tid, *kind;
+
+	if (ctx->protocol != IPPROTO_TCP)
+		return 0;
+
+	if (ctx->newstate == TCP_SYN_SENT)
+	{
+		/* tcp_v4_connect() and tcp_v6_connect() run in the connecting task */
+		if (!is_target())
+			return 0;
+		tid = (__u32)bpf_get_current_pid_tgid();
+		kind = bpf_map_lookup_elem(&connecting, &tid);
+		info.peer.kind = kind ? *kind : PEER_OTHER;
+		info.peer.family = ctx->family;
+		info.peer.port = ctx->dport;
+		if (ctx->family == AF_INET)
+			bpf_probe_read_kernel(info.peer.addr, sizeof(ctx->daddr), ctx->daddr);
+		else if (ctx->family == AF_INET6)
+			bpf_probe_read_kernel(info.peer.addr, sizeof(ctx->daddr_v6), ctx->daddr_v6);
+		else
+			return 0;
+		info.connect_start = bpf_ktime_get_ns();
+		bpf_map_update_elem(&socks, &sk, &info, BPF_ANY);
+		return 0;
+	}
+
+	infop = bpf_map_lookup_elem(&socks, &sk);
+	if (!infop)
+		return 0;
+
+	if (ctx->oldstate == TCP_SYN_SENT && ctx->newstate == TCP_ESTABLISHED)
+	{
+		stats = bpf_map_lookup_or_try_init(&peers, &infop->peer, &zero_stats);
+		if (stats)
+		{
+			__u64 delta = bpf_ktime_get_ns() - infop->connect_start;
+
+			__sync_fetch_and_add(&stats->connects, 1);
+			__sync_fetch_and_add(&stats->connect_ns, delta);
+			add_hist_ns(stats->connect_hist, delta);
+		}
+		return 0;
+	}
+
+	if (ctx->oldstate == TCP_ESTABLISHED)
+		end_exchange(infop);
+	if (ctx->newstate == TCP_CLOSE)
+		bpf_map_delete_elem(&socks, &sk);
+	return 0;
+}
+
+static int probe_sendmsg(struct pt_regs *ctx)
+{
+	__u64 sk = PT_REGS_PARM1(ctx);
+	struct sock_info *info;
+
+	info = bpf_map_lookup_elem(&socks, &sk);
+	if (!info)
+		return 0;
+	/* a send after a response starts the next request on a keepalive connection */
+	if (info->first_rx)
+		end_exchange(info);
+	if (!info->req_start)
+		info->req_start = bpf_ktime_get_ns();
+	return 0;
+}
+
+static int probe_cleanup_rbuf(struct pt_regs *ctx)
+{
+	__u64 sk = PT_REGS_PARM1(ctx);
+	int copied = (int)PT_REGS_PARM2(ctx);
+	struct peer_stats *stats;
+	struct sock_info *info;
+	__u64 ts;
+
+	if (copied <= 0)
+		return 0;
+	info = bpf_map_lookup_elem(&socks, &sk);
+	if (!info || !info->req_start)
+		return 0;
+
+	ts = bpf_ktime_get_ns();
+	if (!info->first_rx)
+	{
+		info->first_rx = ts;
+		stats = bpf_map_lookup_or_try_init(&peers, &info->peer, &zero_stats);
+		if (stats)
+		{
+			__sync_fetch_and_add(&stats->requests, 1);
+			__sync_fetch_and_add(&stats->ttfb_ns, ts - info->req_start);
+			add_hist_ns(stats->ttfb_hist, ts - info->req_start);
+		}
+	}
+	info->last_rx = ts;
+	return 0;
+}
+
+SEC("kprobe/handle_upstream_connect")
+int handle_upstream_connect(struct pt_regs *ctx)
+{
+	return probe_connect_from(PEER_UPSTREAM);
+}
+
+SEC("kprobe/handle_cosocket_connect")
+int handle_cosocket_connect(struct pt_regs *ctx)
+{
+	return probe_connect_from(PEER_COSOCKET);
+}
+
+SEC("kprobe/handle_connect_return")
+int handle_connect_return(struct pt_regs *ctx)
+{
+	return probe_connect_return();
+}
+
+SEC("tracepoint/sock/inet_sock_set_state")
+int handle_set_state(struct trace_event_raw_inet_sock_set_state *ctx)
+{
+	return probe_set_state(ctx);
+}
+
+SEC("kprobe/tcp_sendmsg")
+int handle_sendmsg(struct pt_regs *ctx)
+{
+	return probe_sendmsg(ctx);
+}
+
+SEC("kprobe/tcp_cleanup_rbuf")
+int handle_cleanup_rbuf(struct pt_regs *ctx)
+{
+	return probe_cleanup_rbuf(ctx);
+}
+
+char LICENSE[] SEC("license") = "GPL";
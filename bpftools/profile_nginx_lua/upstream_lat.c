@@ -0,0 +1,359 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * upstream_lat  Summarize the latency of nginx connections to upstreams and
+ *               cosocket peers, per peer address.
+ *
+ * Connections are followed in the kernel from the sock/inet_sock_set_state
+ * tracepoint, tcp_sendmsg() and tcp_cleanup_rbuf(), keyed by socket, so
+ * proxy_pass upstreams and ngx.socket.tcp cosockets are seen alike.  Uprobes
+ * on the nginx functions that open them tell the two apart.
+ */
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "upstream_lat.h"
+#include "upstream_lat.skel.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static struct env
+{
+	pid_t pid;
+	const char *binary;
+	bool milliseconds;
+	bool histograms;
+	int interval;
+	int duration;
+	bool timestamp;
+	bool verbose;
+} env = {
+	.pid = -1,
+	.interval = 99999999,
+	.duration = 99999999,
+};
+
+static volatile bool exiting;
+
+const char *argp_program_version = "upstream_lat 0.1";
+const char argp_program_doc[] =
+	"Summarize connect, time to first byte and transfer latency per upstream peer.\n"
+	"\n"
+	"USAGE: upstream_lat [OPTIONS...]\n"
+	"Every TCP connection opened by nginx is followed, from proxy_pass upstreams\n"
+	"and ngx.socket.tcp cosockets alike. TTFB runs from the first send of a\n"
+	"request to the first read of the response by the worker, transfer from\n"
+	"there to its last read.\n"
+	"EXAMPLES:\n"
+	"    upstream_lat                 # all nginx processes until Ctrl-C\n"
+	"    upstream_lat -p 185 -i 5     # PID 185, print every 5 seconds\n"
+	"    upstream_lat -H -m -d 30     # with millisecond histograms, for 30s\n";
+
+static const struct argp_option opts[] = {
+	{"pid", 'p', "PID", 0, "trace process with this PID only"},
+	{"binary", 'b', "PATH", 0, "path of the nginx binary (default: found from -p or PATH)"},
+	{"histograms", 'H', NULL, 0, "print latency histograms of every peer"},
+	{"milliseconds", 'm', NULL, 0, "millisecond histograms"},
+	{"interval", 'i', "INTERVAL", 0, "summary interval in seconds"},
+	{"duration", 'd', "DURATION", 0, "total duration of trace in seconds"},
+	{"timestamp", 'T', NULL, 0, "print timestamp"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	switch (key)
+	{
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.pid = strtol(arg, NULL, 10);
+		if (errno || env.pid <= 0)
+		{
+			fprintf(stderr, "invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'b':
+		env.binary = arg;
+		break;
+	case 'H':
+		env.histograms = true;
+		break;
+	case 'm':
+		env.milliseconds = true;
+		break;
+	case 'i':
+		errno = 0;
+		env.interval = strtol(arg, NULL, 10);
+		if (errno || env.interval <= 0)
+		{
+			fprintf(stderr, "invalid INTERVAL: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'd':
+		errno = 0;
+		env.duration = strtol(arg, NULL, 10);
+		if (errno || env.duration <= 0)
+		{
+			fprintf(stderr, "invalid DURATION: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'T':
+		env.timestamp = true;
+		break;
+	case ARGP_KEY_ARG:
+		fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+		argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static void sig_handler(int sig)
+{
+	exiting = true;
+}
+
+/*
+ * Functions a connection is opened from.  A cosocket whose host name needs an
+ * asynchronous DNS lookup connects from the resolver handler and shows as
+ * "other".
+ */
+static const struct
+{
+	const char *name;
+	int kind;
+} connect_funcs[] = {
+	{"ngx_http_upstream_connect", PEER_UPSTREAM},
+	{"ngx_http_lua_socket_tcp_connect", PEER_COSOCKET},
+	{"ngx_stream_lua_socket_tcp_connect", PEER_COSOCKET},
+};
+#define NR_CONNECT_FUNCS (sizeof(connect_funcs) / sizeof(connect_funcs[0]))
+#define NR_LINKS (2 * NR_CONNECT_FUNCS + 3)
+
+static const char *kind_names[] = {
+	[PEER_OTHER] = "other",
+	[PEER_UPSTREAM] = "upstream",
+	[PEER_COSOCKET] = "cosocket",
+};
+
+static int attach_connect_funcs(struct upstream_lat_bpf *obj, struct bpf_link *links[])
+{
+	char nginx_path[PATH_MAX];
+	struct bpf_program *prog;
+	int i, attached = 0;
+	off_t func_off;
+
+	if (env.binary)
+		snprintf(nginx_path, sizeof(nginx_path), "%s", env.binary);
+	else if (resolve_binary_path(env.pid != -1 ? "" : "nginx", env.pid != -1 ? env.pid : 0,
+								 nginx_path, sizeof(nginx_path)))
+		return -1;
+
+	for (i = 0; i < NR_CONNECT_FUNCS; i++)
+	{
+		func_off = get_elf_func_offset(nginx_path, connect_funcs[i].name);
+		if (func_off < 0)
+		{
+			if (env.verbose)
+				warn("could not find %s in %s\n", connect_funcs[i].name, nginx_path);
+			continue;
+		}
+		prog = connect_funcs[i].kind == PEER_UPSTREAM ? obj->progs.handle_upstream_connect
+													  : obj->progs.handle_cosocket_connect;
+		links[2 * i] = bpf_program__attach_uprobe(prog, false, -1, nginx_path, func_off);
+		links[2 * i + 1] = bpf_program__attach_uprobe(obj->progs.handle_connect_return, true,
+													  -1, nginx_path, func_off);
+		if (!links[2 * i] || !links[2 * i + 1])
+		{
+			warn("failed to attach %s: %d\n", connect_funcs[i].name, -errno);
+			return -1;
+		}
+		attached++;
+	}
+	if (!attached)
+		warn("no connect functions found in %s, all peers will show as other\n", nginx_path);
+	return 0;
+}
+
+struct peer
+{
+	struct peer_key key;
+	struct peer_stats stats;
+};
+
+static int cmp_peers(const void *a, const void *b)
+{
+	const struct peer *x = a, *y = b;
+
+	if (x->stats.requests != y->stats.requests)
+		return x->stats.requests < y->stats.requests ? 1 : -1;
+	return x->stats.connects < y->stats.connects ? 1 : (x->stats.connects > y->stats.connects ? -1 : 0);
+}
+
+static void print_peers(int fd)
+{
+	static struct peer peers[MAX_PEERS];
+	const char *unit = env.milliseconds ? "msecs" : "usecs";
+	const unsigned long long div = env.milliseconds ? 1000000 : 1000;
+	struct peer_key key = {}, next;
+	char addr[INET6_ADDRSTRLEN + 8];
+	char ip[INET6_ADDRSTRLEN];
+	void *prev = NULL;
+	int i, n = 0;
+
+	while (n < MAX_PEERS && !bpf_map_get_next_key(fd, prev, &next))
+	{
+		key = next;
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &peers[n].stats))
+			continue;
+		peers[n++].key = key;
+	}
+	/* every interval starts from zero, the BPF side recreates the entries */
+	for (i = 0; i < n; i++)
+		bpf_map_delete_elem(fd, &peers[i].key);
+	qsort(peers, n, sizeof(peers[0]), cmp_peers);
+
+	printf("%-40s %-8s %8s %8s %12s %12s\n", "PEER", "KIND", "CONNECTS", "REQUESTS",
+		   env.milliseconds ? "CONNECT(ms)" : "CONNECT(us)", env.milliseconds ? "TTFB(ms)" : "TTFB(us)");
+	for (i = 0; i < n; i++)
+	{
+		const struct peer_key *k = &peers[i].key;
+		struct peer_stats *s = &peers[i].stats;
+
+		inet_ntop(k->family == AF_INET ? AF_INET : AF_INET6, k->addr, ip, sizeof(ip));
+		snprintf(addr, sizeof(addr), k->family == AF_INET ? "%s:%u" : "[%s]:%u", ip, k->port);
+		printf("%-40s %-8s %8llu %8llu %12llu %12llu\n", addr,
+			   k->kind < sizeof(kind_names) / sizeof(kind_names[0]) ? kind_names[k->kind] : "?",
+			   s->connects, s->requests, s->connects ? s->connect_ns / s->connects / div : 0,
+			   s->requests ? s->ttfb_ns / s->requests / div : 0);
+		if (!env.histograms)
+			continue;
+		if (s->connects)
+		{
+			printf("\n  connect:\n");
+			print_log2_hist(s->connect_hist, MAX_SLOTS, unit);
+		}
+		if (s->requests)
+		{
+			printf("\n  ttfb:\n");
+			print_log2_hist(s->ttfb_hist, MAX_SLOTS, unit);
+			printf("\n  transfer:\n");
+			print_log2_hist(s->xfer_hist, MAX_SLOTS, unit);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	struct bpf_link *links[NR_LINKS] = {};
+	struct upstream_lat_bpf *obj;
+	char ts[32];
+	struct tm *tm;
+	time_t t;
+	int err, i;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	libbpf_set_print(libbpf_print_fn);
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+	obj = upstream_lat_bpf__open();
+	if (!obj)
+	{
+		fprintf(stderr, "failed to open BPF object\n");
+		return 1;
+	}
+
+	obj->rodata->targ_pid = env.pid;
+	obj->rodata->targ_ms = env.milliseconds;
+
+	err = upstream_lat_bpf__load(obj);
+	if (err)
+	{
+		fprintf(stderr, "failed to load BPF programs\n");
+		goto cleanup;
+	}
+
+	err = attach_connect_funcs(obj, links);
+	if (err)
+		goto cleanup;
+	links[NR_LINKS - 3] = bpf_program__attach(obj->progs.handle_set_state);
+	links[NR_LINKS - 2] = bpf_program__attach(obj->progs.handle_sendmsg);
+	links[NR_LINKS - 1] = bpf_program__attach(obj->progs.handle_cleanup_rbuf);
+	if (!links[NR_LINKS - 3] || !links[NR_LINKS - 2] || !links[NR_LINKS - 1])
+	{
+		err = -errno;
+		warn("failed to attach TCP probes: %d\n", err);
+		goto cleanup;
+	}
+
+	signal(SIGINT, sig_handler);
+
+	printf("Tracing connections of %s", env.pid != -1 ? "one nginx process" : "nginx");
+	if (env.duration < 99999999)
+		printf(" for %d secs.\n", env.duration);
+	else
+		printf("... Hit Ctrl-C to end.\n");
+
+	for (i = 0; !exiting && i < env.duration; i += env.interval)
+	{
+		sleep(env.interval < env.duration - i ? env.interval : env.duration - i);
+
+		printf("\n");
+		if (env.timestamp)
+		{
+			time(&t);
+			tm = localtime(&t);
+			strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+			printf("%-8s\n", ts);
+		}
+		print_peers(bpf_map__fd(obj->maps.peers));
+	}
+
+cleanup:
+	for (i = 0; i < NR_LINKS; i++)
+		bpf_link__destroy(links[i]);
+	upstream_lat_bpf__destroy(obj);
+	return err != 0;
+}
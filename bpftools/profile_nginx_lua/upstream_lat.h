@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef __UPSTREAM_LAT_H
+#define __UPSTREAM_LAT_H
+
+#define MAX_SLOTS 32
+#define MAX_PEERS 1024
+#define MAX_SOCKS 10240
+
+/* who opened the connection, see the connect hooks of upstream_lat.c */
+enum peer_kind
+{
+	PEER_OTHER,
+	PEER_UPSTREAM,
+	PEER_COSOCKET,
+};
+
+struct peer_key
+{
+	unsigned char addr[16];
+	unsigned short family;
+	unsigned short port;
+	unsigned int kind;
+};
+
+struct peer_stats
+{
+	unsigned long long connects;
+	unsigned long long requests;
+	unsigned long long connect_ns;
+	unsigned long long ttfb_ns;
+	unsigned int connect_hist[MAX_SLOTS];
+	unsigned int ttfb_hist[MAX_SLOTS];
+	unsigned int xfer_hist[MAX_SLOTS];
+};
+
+#endif /* __UPSTREAM_LAT_H */
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+#include "worker_balance.h"
+#include "maps.bpf.h"
+
+#define TASK_RUNNING 0
+
+// when a worker thread was put on a run queue
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_THREADS);
+	__type(key, __u32);
+	__type(value, __u64);
+} enqueued SEC(".maps");
+
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_WORKERS);
+	__type(key, __u32);
+	__type(value, struct worker_stats);
+} workers SEC(".maps");
+
+// pids of the worker processes, kept current by user space
+struct
+{
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_WORKERS);
+	__type(key, __u32);
+	__type(value, __u8);
+} worker_pids SEC(".maps");
+
+static const struct worker_stats zero_stats;
+
+/* task_struct::state was renamed to __state in 5.14 */
+struct task_struct___x
+{
+	unsigned int __state;
+} __attribute__((preserve_access_index));
+
+static __always_inline long get_task_state(struct task_struct *task)
+{
+	struct task_struct___x *t = (void *)task;
+
+	if (bpf_core_field_exists(t->__state))
+		return BPF_CORE_READ(t, __state);
+	return BPF_CORE_READ(task, state);
+}
+
+/* the cache manager and loader are children of the master too, see list_workers() */
+static __always_inline bool is_worker(struct task_struct *task)
+{
+	__u32 tgid = BPF_CORE_READ(task, tgid);
+
+	return bpf_map_lookup_elem(&worker_pids, &tgid) != NULL;
+}
+
+static __always_inline struct worker_stats *worker_of(struct task_struct *task)
+{
+	__u32 tgid = BPF_CORE_READ(task, tgid);
+
+	return bpf_map_lookup_or_try_init(&workers, &tgid, &zero_stats);
+}
+
+static __always_inline void enqueue(struct task_struct *task)
+{
+	__u32 tid = BPF_CORE_READ(task, pid);
+	__u64 ts = bpf_ktime_get_ns();
+
+	if (is_worker(task))
+		bpf_map_update_elem(&enqueued, &tid, &ts, BPF_ANY);
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(handle_sched_wakeup, struct task_struct *p)
+{
+	enqueue(p);
+	return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(handle_sched_wakeup_new, struct task_struct *p)
+{
+	enqueue(p);
+	return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt, struct task_struct *prev,
+			 struct task_struct *next)
+{
+	struct worker_stats *stats;
+	__u32 tid;
+	__u64 ts = bpf_ktime_get_ns(), *tsp, delta;
+
+	/* a preempted worker waits on the run queue right away */
+	if (get_task_state(prev) == TASK_RUNNING)
+		enqueue(prev);
+
+	if (!is_worker(next))
+		return 0;
+	tid = BPF_CORE_READ(next, pid);
+	stats = worker_of(next);
+	if (!stats)
+		return 0;
+	stats->cpu = bpf_get_smp_processor_id();
+	tsp = bpf_map_lookup_elem(&enqueued, &tid);
+	if (!tsp)
+		return 0;
+	delta = ts - *tsp;
+	bpf_map_delete_elem(&enqueued, &tid);
+	__sync_fetch_and_add(&stats->runq_ns, delta);
+	__sync_fetch_and_add(&stats->runqs, 1);
+	if (delta > stats->runq_max_ns)
+		stats->runq_max_ns = delta;
+	return 0;
+}
+
+SEC("kretprobe/inet_csk_accept")
+int handle_accept_return(struct pt_regs *ctx)
+{
+	struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+	struct worker_stats *stats;
+
+	if (!PT_REGS_RC(ctx) || !is_worker(task))
+		return 0;
+	stats = worker_of(task);
+	if (stats)
+		__sync_fetch_and_add(&stats->accepts, 1);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * worker_balance  Report how evenly CPU time and new connections are spread
+ *                 over the nginx workers.
+ *
+ * On-CPU time is the growth of the run time in /proc/PID/task/TID/schedstat,
+ * which includes the slice a worker is running, so a worker that never
+ * leaves the CPU counts fully.  Run queue time comes from the sched_switch
+ * and sched_wakeup tracepoints, accepted connections from inet_csk_accept()
+ * returns.  Workers are the children of the nginx master titled "worker
+ * process", listed from /proc every second so that a worker that never ran
+ * still counts, and passed to the BPF programs.
+ */
+#include <argp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "worker_balance.h"
+#include "worker_balance.skel.h"
+#include "trace_helpers.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static struct env
+{
+	pid_t master;
+	int interval;
+	int duration;
+	bool summary;
+	bool timestamp;
+	bool verbose;
+} env = {
+	.master = -1,
+	.interval = 99999999,
+	.duration = 99999999,
+};
+
+static volatile bool exiting;
+
+const char *argp_program_version = "worker_balance 0.1";
+const char argp_program_doc[] =
+	"Report how evenly CPU time and new connections are spread over nginx workers.\n"
+	"\n"
+	"USAGE: worker_balance [OPTIONS...]\n"
+	"For on-CPU time and accepts, max/mean is the load of the busiest worker\n"
+	"relative to the average, cv the coefficient of variation and jain Jain's\n"
+	"fairness index, 1 when perfectly even and 1/N when one worker does it all.\n"
+	"EXAMPLES:\n"
+	"    worker_balance -d 10          # every nginx on the host, over 10 seconds\n"
+	"    worker_balance -p 184 -i 5    # workers of master PID 184, every 5 seconds\n"
+	"    worker_balance -s -d 60       # one summary line, for fleet collection\n";
+
+static const struct argp_option opts[] = {
+	{"pid", 'p', "PID", 0, "workers of the nginx master with this PID only"},
+	{"interval", 'i', "INTERVAL", 0, "report interval in seconds"},
+	{"duration", 'd', "DURATION", 0, "total duration of trace in seconds"},
+	{"summary", 's', NULL, 0, "only print the imbalance metrics, on one line"},
+	{"timestamp", 'T', NULL, 0, "print timestamp"},
+	{"verbose", 'v', NULL, 0, "Verbose debug output"},
+	{NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help"},
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	switch (key)
+	{
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.master = strtol(arg, NULL, 10);
+		if (errno || env.master <= 0)
+		{
+			fprintf(stderr, "invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'i':
+		errno = 0;
+		env.interval = strtol(arg, NULL, 10);
+		if (errno || env.interval <= 0)
+		{
+			fprintf(stderr, "invalid INTERVAL: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'd':
+		errno = 0;
+		env.duration = strtol(arg, NULL, 10);
+		if (errno || env.duration <= 0)
+		{
+			fprintf(stderr, "invalid DURATION: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 's':
+		env.summary = true;
+		break;
+	case 'T':
+		env.timestamp = true;
+		break;
+	case ARGP_KEY_ARG:
+		fprintf(stderr, "unrecognized positional argument: %s\n", arg);
+		argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static void sig_handler(int sig)
+{
+	exiting = true;
+}
+
+static bool is_nginx(pid_t pid)
+{
+	char path[64], comm[32] = {};
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	if (!fgets(comm, sizeof(comm), f))
+		comm[0] = '\0';
+	fclose(f);
+	return !strcmp(comm, "nginx\n");
+}
+
+/* The cache manager and loader are children of the master too, but mostly idle */
+static bool is_worker_process(pid_t pid)
+{
+	char path[64], cmdline[64] = {};
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	/* "nginx: worker process", as set by ngx_setproctitle() */
+	if (!fread(cmdline, 1, sizeof(cmdline) - 1, f))
+		cmdline[0] = '\0';
+	fclose(f);
+	return strstr(cmdline, "worker process") != NULL;
+}
+
+static int list_workers(pid_t *pids, int max)
+{
+	char path[64], comm[32];
+	struct dirent *d;
+	int n = 0, pid, ppid;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -1;
+	while (n < max && (d = readdir(dir)))
+	{
+		pid = strtol(d->d_name, NULL, 10);
+		if (pid <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%*d (%31[^)]) %*c %d", comm, &ppid) != 2)
+			ppid = 0;
+		fclose(f);
+		if (!ppid || strcmp(comm, "nginx"))
+			continue;
+		if (env.master != -1 ? ppid != env.master : !is_nginx(ppid))
+			continue;
+		if (!is_worker_process(pid))
+			continue;
+		pids[n++] = pid;
+	}
+	closedir(dir);
+	return n;
+}
+
+/* Run time of all threads of pid in ns, 0 if it is gone */
+static unsigned long long read_cpu_ns(pid_t pid)
+{
+	char path[64];
+	unsigned long long ns, sum = 0;
+	struct dirent *d;
+	DIR *dir;
+	FILE *f;
+	int tid;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir)))
+	{
+		tid = strtol(d->d_name, NULL, 10);
+		if (tid <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", pid, tid);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%llu", &ns) == 1)
+			sum += ns;
+		fclose(f);
+	}
+	closedir(dir);
+	return sum;
+}
+
+/* Run time of the workers at the previous report */
+static struct worker_cpu
+{
+	pid_t pid;
+	unsigned long long ns;
+} cpu_base[MAX_WORKERS];
+static int nr_cpu_base;
+
+/* Run time since the previous report; workers forked since then start at 0 */
+static unsigned long long cpu_since_base(pid_t pid, unsigned long long ns)
+{
+	int i;
+
+	for (i = 0; i < nr_cpu_base; i++)
+	{
+		if (cpu_base[i].pid == pid)
+			return ns > cpu_base[i].ns ? ns - cpu_base[i].ns : 0;
+	}
+	return ns;
+}
+
+static void set_cpu_base(const pid_t *pids, const unsigned long long *ns, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		cpu_base[i].pid = pids[i];
+		cpu_base[i].ns = ns[i];
+	}
+	nr_cpu_base = n;
+}
+
+/* Make the pid set of the BPF side the workers listed now */
+static void update_worker_pids(int fd, const pid_t *pids, int n)
+{
+	static __u32 stale[MAX_WORKERS];
+	static __u8 gen;
+	__u32 key, next;
+	void *prev = NULL;
+	int i, nr_stale = 0;
+	__u8 v;
+
+	gen++;
+	for (i = 0; i < n; i++)
+	{
+		key = pids[i];
+		bpf_map_update_elem(fd, &key, &gen, BPF_ANY);
+	}
+	while (nr_stale < MAX_WORKERS && !bpf_map_get_next_key(fd, prev, &next))
+	{
+		if (!bpf_map_lookup_elem(fd, &next, &v) && v != gen)
+			stale[nr_stale++] = next;
+		key = next;
+		prev = &key;
+	}
+	for (i = 0; i < nr_stale; i++)
+		bpf_map_delete_elem(fd, &stale[i]);
+}
+
+struct imbalance
+{
+	double total;
+	double max_mean;
+	double cv;
+	double jain;
+};
+
+static void compute_imbalance(const double *x, int n, struct imbalance *m)
+{
+	double sum = 0, sq = 0, max = 0, mean;
+	int i;
+
+	memset(m, 0, sizeof(*m));
+	for (i = 0; i < n; i++)
+	{
+		sum += x[i];
+		sq += x[i] * x[i];
+		if (x[i] > max)
+			max = x[i];
+	}
+	m->total = sum;
+	if (!n || sum <= 0)
+		return;
+	mean = sum / n;
+	m->max_mean = max / mean;
+	m->cv = sqrt(sq / n - mean * mean > 0 ? sq / n - mean * mean : 0) / mean;
+	m->jain = sum * sum / (n * sq);
+}
+
+static void report(int fd, double elapsed_ns)
+{
+	static pid_t pids[MAX_WORKERS];
+	static struct worker_stats stats[MAX_WORKERS];
+	static unsigned long long cpu_ns[MAX_WORKERS];
+	static double cpu[MAX_WORKERS], accepts[MAX_WORKERS];
+	struct imbalance mc, ma;
+	__u32 key, next;
+	void *prev = NULL;
+	int i, n;
+
+	n = list_workers(pids, MAX_WORKERS);
+	if (n < 0)
+	{
+		warn("failed to list nginx workers: %s\n", strerror(errno));
+		return;
+	}
+	for (i = 0; i < n; i++)
+	{
+		key = pids[i];
+		if (bpf_map_lookup_elem(fd, &key, &stats[i]))
+			memset(&stats[i], 0, sizeof(stats[i]));
+		cpu_ns[i] = read_cpu_ns(pids[i]);
+		cpu[i] = cpu_since_base(pids[i], cpu_ns[i]) * 100.0 / elapsed_ns;
+		accepts[i] = stats[i].accepts;
+	}
+	set_cpu_base(pids, cpu_ns, n);
+	/* every interval starts from zero, including exited workers */
+	while (!bpf_map_get_next_key(fd, prev, &next))
+	{
+		bpf_map_delete_elem(fd, &next);
+		prev = NULL;
+	}
+
+	compute_imbalance(cpu, n, &mc);
+	compute_imbalance(accepts, n, &ma);
+	if (env.summary)
+	{
+		printf("workers=%d cpu=%.1f%% cpu_max_mean=%.2f cpu_cv=%.2f cpu_jain=%.3f "
+			   "accepts=%.0f accepts_max_mean=%.2f accepts_cv=%.2f accepts_jain=%.3f\n",
+			   n, mc.total, mc.max_mean, mc.cv, mc.jain, ma.total, ma.max_mean, ma.cv, ma.jain);
+		return;
+	}
+
+	printf("%-8s %4s %7s %13s %13s %9s\n", "PID", "CPU", "ONCPU%", "RUNQ_AVG(us)",
+		   "RUNQ_MAX(us)", "ACCEPTS");
+	for (i = 0; i < n; i++)
+	{
+		printf("%-8d %4u %7.1f %13llu %13llu %9llu\n", pids[i], stats[i].cpu, cpu[i],
+			   stats[i].runqs ? stats[i].runq_ns / stats[i].runqs / 1000 : 0,
+			   stats[i].runq_max_ns / 1000, stats[i].accepts);
+	}
+	printf("\n%d workers\n", n);
+	printf("cpu:     total %.1f%%, max/mean %.2f, cv %.2f, jain %.3f\n",
+		   mc.total, mc.max_mean, mc.cv, mc.jain);
+	printf("accepts: total %.0f, max/mean %.2f, cv %.2f, jain %.3f\n",
+		   ma.total, ma.max_mean, ma.cv, ma.jain);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	static pid_t pids[MAX_WORKERS];
+	static unsigned long long cpu_ns[MAX_WORKERS];
+	struct worker_balance_bpf *obj;
+	unsigned long long start_ns, now_ns;
+	char ts[32];
+	struct tm *tm;
+	time_t t;
+	int err, i, n;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	libbpf_set_print(libbpf_print_fn);
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+	obj = worker_balance_bpf__open();
+	if (!obj)
+	{
+		fprintf(stderr, "failed to open BPF object\n");
+		return 1;
+	}
+
+	err = worker_balance_bpf__load(obj);
+	if (err)
+	{
+		fprintf(stderr, "failed to load BPF programs\n");
+		goto cleanup;
+	}
+
+	/* the run time of the workers already running counts from now */
+	n = list_workers(pids, MAX_WORKERS);
+	if (n < 0)
+		n = 0;
+	for (i = 0; i < n; i++)
+		cpu_ns[i] = read_cpu_ns(pids[i]);
+	set_cpu_base(pids, cpu_ns, n);
+	update_worker_pids(bpf_map__fd(obj->maps.worker_pids), pids, n);
+
+	err = worker_balance_bpf__attach(obj);
+	if (err)
+	{
+		fprintf(stderr, "failed to attach BPF programs\n");
+		goto cleanup;
+	}
+
+	signal(SIGINT, sig_handler);
+
+	if (!env.summary)
+	{
+		printf("Tracing nginx workers");
+		if (env.duration < 99999999)
+			printf(" for %d secs.\n", env.duration);
+		else
+			printf("... Hit Ctrl-C to end.\n");
+	}
+
+	start_ns = get_ktime_ns();
+	for (i = 1;; i++)
+	{
+		sleep(1);
+		/* workers started by a reload are traced from the next second */
+		n = list_workers(pids, MAX_WORKERS);
+		if (n >= 0)
+			update_worker_pids(bpf_map__fd(obj->maps.worker_pids), pids, n);
+		if (!exiting && i < env.duration && i % env.interval)
+			continue;
+
+		if (!env.summary)
+			printf("\n");
+		if (env.timestamp)
+		{
+			time(&t);
+			tm = localtime(&t);
+			strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+			printf(env.summary ? "%s " : "%-8s\n", ts);
+		}
+		now_ns = get_ktime_ns();
+		report(bpf_map__fd(obj->maps.workers), now_ns - start_ns);
+		start_ns = now_ns;
+		if (exiting || i >= env.duration)
+			break;
+	}
+
+cleanup:
+	worker_balance_bpf__destroy(obj);
+	return err != 0;
+}
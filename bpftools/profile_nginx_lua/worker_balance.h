@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef __WORKER_BALANCE_H
+#define __WORKER_BALANCE_H
+
+#define MAX_WORKERS 1024
+#define MAX_THREADS 10240
+
+struct worker_stats
+{
+	unsigned long long runq_ns;
+	unsigned long long runq_max_ns;
+	unsigned long long runqs;
+	unsigned long long accepts;
+	unsigned int cpu;
+	unsigned int pad;
+};
+
+#endif /* __WORKER_BALANCE_H */